@@ -5,18 +5,74 @@ namespace Codeloader {
   /**
    * Creates and initializes the Allegro subsystem.
    */
-  cAllegro::cAllegro() : cUtility() {
+  cAllegro::cAllegro() : cAllegro(false) {
+  }
+
+  /**
+   * Creates the Allegro subsystem. Without a head only the core is started so
+   * that memory bitmaps, threads and the clock work, but there is no display,
+   * audio or input.
+   * @param headless True to leave out the display, audio and input.
+   * @throws An error if Allegro could not be initialized.
+   */
+  cAllegro::cAllegro(bool headless) : cUtility() {
     this->display = NULL;
+    this->headless = headless;
     this->screen = NULL;
     this->font = NULL;
     this->button_index = 0;
     this->button_map_loaded = false;
-    this->button_count = sizeof(sInput) - BUTTONS_START;
+    this->button_count = BUTTON_COUNT - BUTTONS_START;
     this->event_queue = NULL;
+    this->load_mutex = NULL;
+    this->load_cond = NULL;
+    this->load_total = 0;
+    this->load_count = 0;
+    this->cache_budget = 0;
+    this->cache_bytes = 0;
+    this->cache_hits = 0;
+    this->cache_misses = 0;
+    this->cache_evictions = 0;
+    this->cache_tick = 0;
+    this->draw_calls = 0;
+    this->draw_batches = 0;
+    this->frame_time = 0;
+    this->dirty_mode = false;
+    this->full_redraw = true;
+    this->dirty_rects = 0;
+    this->renderer = NULL;
+    this->render_mutex = NULL;
+    this->render_cond = NULL;
+    this->frame_pending = false;
+    this->frame_stamp = 0.0;
+    this->render_time = 0;
+    this->script_busy = 0;
+    this->render_busy = 0;
+    this->text_tick = 0;
+    this->raster_mutex = NULL;
+    this->raster_cond = NULL;
+    this->raster_threads = 1; // The raster command turns on the band workers.
+    this->raster_generation = 0;
+    this->raster_finished = 0;
+    this->raster_next = 0;
+    this->raster_target = NULL;
+    this->scale_mode = SCALE_FILTERED;
+    this->audio_voice = NULL;
+    this->audio_mixer = NULL;
+    this->voice_tick = 0;
+    this->voice_steals = 0;
+    this->voice_drops = 0;
+    this->music_buffers = MUSIC_BUFFERS;
+    this->music_samples = MUSIC_SAMPLES;
+    this->music_fade = MUSIC_FADE;
+    this->music_stamp = 0.0;
     bool allegro_ok = al_init();
     if (!allegro_ok) {
       throw std::string("Allegro could not be initialized.");
     }
+    if (headless) {
+      return;
+    }
     bool audio_ok = al_install_audio();
     if (!audio_ok) {
       throw std::string("Could not install audio.");
@@ -25,6 +81,7 @@ namespace Codeloader {
     if (codec_ok) {
       throw std::string("Could not initialize codec.");
     }
+    this->Create_Voices();
     bool font_ok = al_init_font_addon();
     if (!font_ok) {
       throw std::string("Could not initialize font.");
@@ -63,7 +120,17 @@ namespace Codeloader {
    * Does cleanup for the Allegro subsystem.
    */
   cAllegro::~cAllegro() {
-    al_uninstall_audio();
+    this->Stop_Renderer();
+    this->Destroy_Rasterizers();
+    this->Destroy_Loaders();
+    this->Clear_Text_Cache();
+    while (this->music.size() > 0) {
+      this->Release_Music(this->music.size() - 1);
+    }
+    this->Destroy_Voices();
+    if (!this->headless) {
+      al_uninstall_audio();
+    }
     if (this->display) {
       al_destroy_display(this->display);
     }
@@ -73,17 +140,16 @@ namespace Codeloader {
     for (std::map<std::string, ALLEGRO_BITMAP*>::iterator i = this->images.begin(); i != this->images.end(); ++i) {
       al_destroy_bitmap(i->second);
     }
+    // Pages go after their sub-bitmaps.
+    int page_count = this->atlas.size();
+    for (int page_index = 0; page_index < page_count; page_index++) {
+      if (this->atlas[page_index].bitmap) {
+        al_destroy_bitmap(this->atlas[page_index].bitmap);
+      }
+    }
     for (std::map<std::string, ALLEGRO_SAMPLE*>::iterator i = this->sounds.begin(); i != this->sounds.end(); ++i) {
       al_destroy_sample(i->second);
     }
-    /*
-    for (std::map<std::string, ALLEGRO_SAMPLE_ID*>::iterator i = this->sound_ids.begin(); i != this->sound_ids.end(); ++i) {
-      al_destroy_sample_instance(i->second);
-    }
-    */
-    for (std::map<std::string, ALLEGRO_MIXER*>::iterator i = this->mixers.begin(); i != this->mixers.end(); ++i) {
-      al_destroy_mixer(i->second);
-    }
     if (this->font) {
       al_destroy_font(this->font);
     }
@@ -104,126 +170,661 @@ namespace Codeloader {
     }
     al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
     this->screen = al_create_bitmap(width, height);
+    this->screen_w = width;
+    this->screen_h = height;
     this->Clear_Screen();
+    this->full_redraw = true;
   }
   
   /**
-   * Renders images from a vector.
-   * @param images The list of image objects to render.
+   * Renders the image stacks of all layers, back to front, onto a cleared screen.
+   * @param layers The image stacks, one per layer.
+   * @param layer_count The number of layers.
    */
-  void cAllegro::Render_Images(std::vector<sImage>& images) {
+  void cAllegro::Render_Images(std::vector<sImage>* layers, int layer_count) {
+    cScope_Timer timer(&this->profiler, cProfiler::STAGE_RENDER_IMAGES);
+    this->draw_calls = 0;
+    this->draw_batches = 0;
+    this->compositor.blits = 0;
+    if ((this->raster_threads > 1) && this->Render_Parallel(layers, layer_count)) {
+      return;
+    }
     this->Clear_Screen();
-    this->Render_Layer(images, "background");
-    this->Render_Layer(images, "platform");
-    this->Render_Layer(images, "character");
-    this->Render_Layer(images, "foreground");
-    this->Render_Layer(images, "overlay");
-    images.clear(); // Clear out image stack.
-    // Draw the screen.
-    this->Render_Screen();
+    sBox clip = { 0, 0, this->screen_w, this->screen_h };
+    for (int layer_index = 0; layer_index < layer_count; layer_index++) {
+      this->Render_Layer(layers[layer_index], clip);
+    }
   }
   
   /**
-   * Renders a layer given the name of the layer.
+   * Re-renders only the given regions of the screen. Everything outside of
+   * them is left as it was last frame. The texts are timed as part of the
+   * images here.
+   * @param layers The image stacks, one per layer.
+   * @param layer_count The number of layers.
+   * @param texts The texts to draw over the images.
+   * @param rects The regions to redraw.
+   */
+  void cAllegro::Render_Regions(std::vector<sImage>* layers, int layer_count, std::vector<sText>& texts, std::vector<sBox>& rects) {
+    cScope_Timer timer(&this->profiler, cProfiler::STAGE_RENDER_IMAGES);
+    this->draw_calls = 0;
+    this->draw_batches = 0;
+    this->compositor.blits = 0;
+    al_set_target_bitmap(this->screen);
+    int rect_count = rects.size();
+    for (int rect_index = 0; rect_index < rect_count; rect_index++) {
+      sBox& rect = rects[rect_index];
+      al_set_clipping_rectangle(rect.left, rect.top, rect.right - rect.left, rect.bottom - rect.top);
+      al_clear_to_color(al_map_rgb(255, 255, 255));
+      for (int layer_index = 0; layer_index < layer_count; layer_index++) {
+        this->Render_Layer(layers[layer_index], rect);
+      }
+      this->Draw_Texts(texts);
+    }
+    al_reset_clipping_rectangle();
+  }
+  
+  /**
+   * Renders the images of one layer in the order they were drawn.
    * @param images The list of images to render in the layer.
-   * @param layer The layer to render.
+   * @param clip The part of the screen being drawn. Images outside of it are skipped.
    */
-  void cAllegro::Render_Layer(std::vector<sImage>& images, std::string layer) {
+  void cAllegro::Render_Layer(std::vector<sImage>& images, sBox clip) {
+    ALLEGRO_BITMAP* page = NULL;
+    bool composite = this->compositor.Is_Ready();
+    // Draws from the same atlas page are batched. The draw order is kept so overlaps stay correct.
+    al_hold_bitmap_drawing(true);
     int image_count = images.size();
     for (int image_index = 0; image_index < image_count; image_index++) {
       sImage& image = images[image_index];
-      if ((this->images.find(image.name) != this->images.end()) && (image.layer == layer)) {
-        ALLEGRO_BITMAP* bitmap = this->images[image.name];
-        int flags = 0;
-        if (image.flip_x) {
-          flags |= ALLEGRO_FLIP_HORIZONTAL;
-        }
-        if (image.flip_y) {
-          flags |= ALLEGRO_FLIP_VERTICAL;
-        }
-        if (image.angle > 0) {
-          if (image.scale > 1) {
-            al_draw_scaled_rotated_bitmap(bitmap, image.width / 2, image.height / 2, image.x, image.y, image.scale, image.scale, (float)image.angle * cAllegro::RADIAN, flags);
-          }
-          else {
-            al_draw_rotated_bitmap(bitmap, image.width / 2, image.height / 2, image.x, image.y, image.angle * cAllegro::RADIAN, flags);
-          }
+      sBox bounds = this->Get_Image_Bounds(image);
+      if ((bounds.right <= clip.left) || (bounds.left >= clip.right) || (bounds.bottom <= clip.top) || (bounds.top >= clip.bottom)) {
+        continue;
+      }
+      ALLEGRO_BITMAP* bitmap = image.bitmap;
+      ALLEGRO_BITMAP* parent = al_get_parent_bitmap(bitmap);
+      if (!parent) {
+        parent = bitmap;
+      }
+      if (parent != page) {
+        page = parent;
+        this->draw_batches++;
+      }
+      this->draw_calls++;
+      if (composite && this->compositor.Blit(this->screen, image, clip)) {
+        continue;
+      }
+      int flags = 0;
+      if (image.flip_x) {
+        flags |= ALLEGRO_FLIP_HORIZONTAL;
+      }
+      if (image.flip_y) {
+        flags |= ALLEGRO_FLIP_VERTICAL;
+      }
+      if (image.angle > 0) {
+        if (image.scale > 1) {
+          al_draw_scaled_rotated_bitmap(bitmap, image.width / 2, image.height / 2, image.x, image.y, image.scale, image.scale, (float)image.angle * cAllegro::RADIAN, flags);
         }
         else {
-          if (image.scale > 1) {
-            al_draw_scaled_bitmap(bitmap, 0, 0, image.width, image.height, image.x, image.y, image.width * image.scale, image.height * image.scale, flags);
-          }
-          else {
-            al_draw_bitmap(bitmap, image.x, image.y, flags);
-          }
+          al_draw_rotated_bitmap(bitmap, image.width / 2, image.height / 2, image.x, image.y, image.angle * cAllegro::RADIAN, flags);
+        }
+      }
+      else {
+        if (image.scale > 1) {
+          al_draw_scaled_bitmap(bitmap, 0, 0, image.width, image.height, image.x, image.y, image.width * image.scale, image.height * image.scale, flags);
+        }
+        else {
+          al_draw_bitmap(bitmap, image.x, image.y, flags);
         }
       }
     }
+    al_hold_bitmap_drawing(false);
   }
   
   /**
-   * Outputs sounds from the stack.
+   * Renders the image stacks with the raster workers. The screen is cut into
+   * bands and each image is binned into the bands it covers, in layer order.
+   * Each band is cleared and composited by one thread, so the pixels come
+   * out the same as the serial compositor. Frames with anything the
+   * compositor cannot draw are left to the serial path.
+   * @param layers The image stacks, one per layer.
+   * @param layer_count The number of layers.
+   * @return True if the frame was rendered.
+   */
+  bool cAllegro::Render_Parallel(std::vector<sImage>* layers, int layer_count) {
+    if (!this->compositor.Is_Ready()) {
+      return false;
+    }
+    int format = al_get_bitmap_format(this->screen);
+    if ((format != ALLEGRO_PIXEL_FORMAT_ARGB_8888) && (format != ALLEGRO_PIXEL_FORMAT_ABGR_8888)) {
+      return false;
+    }
+    if ((int)this->raster_workers.size() != (this->raster_threads - 1)) {
+      this->Destroy_Rasterizers();
+      this->Create_Rasterizers();
+    }
+    if (this->raster_workers.size() == 0) {
+      return false;
+    }
+    int band_count = (this->screen_h + BAND_H - 1) / BAND_H;
+    this->raster_bins.resize(band_count);
+    for (int band_index = 0; band_index < band_count; band_index++) {
+      this->raster_bins[band_index].clear();
+    }
+    int calls = 0;
+    int batches = 0;
+    ALLEGRO_BITMAP* page = NULL;
+    for (int layer_index = 0; layer_index < layer_count; layer_index++) {
+      std::vector<sImage>& images = layers[layer_index];
+      int image_count = images.size();
+      for (int image_index = 0; image_index < image_count; image_index++) {
+        sImage& image = images[image_index];
+        sBox bounds = this->Get_Image_Bounds(image);
+        if ((bounds.right <= 0) || (bounds.left >= this->screen_w) || (bounds.bottom <= 0) || (bounds.top >= this->screen_h)) {
+          continue;
+        }
+        if ((image.angle > 0) || (al_get_bitmap_format(image.bitmap) != format)) {
+          this->Unlock_Raster();
+          return false;
+        }
+        ALLEGRO_BITMAP* parent = al_get_parent_bitmap(image.bitmap);
+        if (!parent) {
+          parent = image.bitmap;
+        }
+        // Each page is locked once for the whole frame.
+        std::map<ALLEGRO_BITMAP*, ALLEGRO_LOCKED_REGION*>::iterator lock = this->raster_locks.find(parent);
+        if (lock == this->raster_locks.end()) {
+          ALLEGRO_LOCKED_REGION* region = al_lock_bitmap(parent, format, ALLEGRO_LOCK_READONLY);
+          if (!region) {
+            this->Unlock_Raster();
+            return false;
+          }
+          lock = this->raster_locks.insert(std::make_pair(parent, region)).first;
+        }
+        if (parent != page) {
+          page = parent;
+          batches++;
+        }
+        calls++;
+        sRaster_Item item;
+        item.image = &image;
+        item.source = lock->second;
+        item.source_x = (parent != image.bitmap) ? al_get_bitmap_x(image.bitmap) : 0;
+        item.source_y = (parent != image.bitmap) ? al_get_bitmap_y(image.bitmap) : 0;
+        int first = (bounds.top > 0) ? (bounds.top / BAND_H) : 0;
+        int last = (bounds.bottom < this->screen_h) ? ((bounds.bottom - 1) / BAND_H) : (band_count - 1);
+        for (int band_index = first; band_index <= last; band_index++) {
+          this->raster_bins[band_index].push_back(item);
+        }
+      }
+    }
+    this->raster_target = al_lock_bitmap(this->screen, format, ALLEGRO_LOCK_READWRITE);
+    if (!this->raster_target) {
+      this->Unlock_Raster();
+      return false;
+    }
+    // Wake the workers and take bands alongside them.
+    this->raster_next.store(0);
+    al_lock_mutex(this->raster_mutex);
+    this->raster_finished = 0;
+    this->raster_generation++;
+    al_broadcast_cond(this->raster_cond);
+    al_unlock_mutex(this->raster_mutex);
+    this->Raster_Bands(this->compositor.row);
+    al_lock_mutex(this->raster_mutex);
+    while (this->raster_finished < (int)this->raster_workers.size()) {
+      al_wait_cond(this->raster_cond, this->raster_mutex);
+    }
+    al_unlock_mutex(this->raster_mutex);
+    this->Unlock_Raster();
+    this->draw_calls = calls;
+    this->draw_batches = batches;
+    this->compositor.blits = calls;
+    return true;
+  }
+
+  /**
+   * Renders bands until there are none left. This is run by the render thread
+   * and the raster workers at the same time.
+   * @param row A scratch row owned by the calling thread.
+   */
+  void cAllegro::Raster_Bands(std::vector<uint32_t>& row) {
+    int band_count = this->raster_bins.size();
+    int band_index = this->raster_next.fetch_add(1);
+    while (band_index < band_count) {
+      sBox band = { 0, band_index * BAND_H, this->screen_w, (band_index + 1) * BAND_H };
+      band.bottom = (band.bottom < this->screen_h) ? band.bottom : this->screen_h;
+      // Clear to white.
+      for (int y = band.top; y < band.bottom; y++) {
+        uint32_t* pixels = (uint32_t*)((char*)this->raster_target->data + (y * this->raster_target->pitch));
+        std::fill(pixels, pixels + this->screen_w, 0xFFFFFFFF);
+      }
+      std::vector<sRaster_Item>& items = this->raster_bins[band_index];
+      int item_count = items.size();
+      for (int item_index = 0; item_index < item_count; item_index++) {
+        sRaster_Item& item = items[item_index];
+        sImage& image = *item.image;
+        int scale = (image.scale > 1) ? image.scale : 1;
+        sBox box;
+        box.left = (image.x > 0) ? image.x : 0;
+        box.top = (image.y > band.top) ? image.y : band.top;
+        box.right = image.x + (image.width * scale);
+        box.bottom = image.y + (image.height * scale);
+        box.right = (box.right < band.right) ? box.right : band.right;
+        box.bottom = (box.bottom < band.bottom) ? box.bottom : band.bottom;
+        if ((box.right > box.left) && (box.bottom > box.top)) {
+          this->compositor.Blit_Pixels(this->raster_target, 0, 0, item.source, item.source_x, item.source_y, image, box, row);
+        }
+      }
+      band_index = this->raster_next.fetch_add(1);
+    }
+  }
+
+  /**
+   * Unlocks the screen and pages locked for a parallel frame.
+   */
+  void cAllegro::Unlock_Raster() {
+    for (std::map<ALLEGRO_BITMAP*, ALLEGRO_LOCKED_REGION*>::iterator i = this->raster_locks.begin(); i != this->raster_locks.end(); ++i) {
+      al_unlock_bitmap(i->first);
+    }
+    this->raster_locks.clear();
+    if (this->raster_target) {
+      al_unlock_bitmap(this->screen);
+      this->raster_target = NULL;
+    }
+  }
+
+  /**
+   * Starts the raster workers. The render thread is the last rasterizer so
+   * one less worker is made than there are raster threads. If a worker cannot
+   * be made rendering goes back to one thread.
+   */
+  void cAllegro::Create_Rasterizers() {
+    int worker_count = this->raster_threads - 1;
+    if (worker_count < 1) {
+      return;
+    }
+    this->raster_mutex = al_create_mutex();
+    this->raster_cond = al_create_cond();
+    if (!this->raster_mutex || !this->raster_cond) {
+      this->Destroy_Rasterizers();
+      this->raster_threads = 1;
+      return;
+    }
+    // Workers hold pointers into this list so it is sized once.
+    this->raster_workers.resize(worker_count);
+    for (int worker_index = 0; worker_index < worker_count; worker_index++) {
+      sRaster_Worker& worker = this->raster_workers[worker_index];
+      worker.allegro = this;
+      worker.generation = this->raster_generation;
+      worker.thread = al_create_thread(cAllegro::Run_Rasterizer, &worker);
+    }
+    for (int worker_index = 0; worker_index < worker_count; worker_index++) {
+      if (!this->raster_workers[worker_index].thread) {
+        this->Destroy_Rasterizers();
+        this->raster_threads = 1;
+        return;
+      }
+    }
+    for (int worker_index = 0; worker_index < worker_count; worker_index++) {
+      al_start_thread(this->raster_workers[worker_index].thread);
+    }
+  }
+
+  /**
+   * Stops the raster workers.
+   */
+  void cAllegro::Destroy_Rasterizers() {
+    int worker_count = this->raster_workers.size();
+    for (int worker_index = 0; worker_index < worker_count; worker_index++) {
+      if (this->raster_workers[worker_index].thread) {
+        al_set_thread_should_stop(this->raster_workers[worker_index].thread);
+      }
+    }
+    if (this->raster_mutex) {
+      al_lock_mutex(this->raster_mutex);
+      al_broadcast_cond(this->raster_cond);
+      al_unlock_mutex(this->raster_mutex);
+    }
+    for (int worker_index = 0; worker_index < worker_count; worker_index++) {
+      if (this->raster_workers[worker_index].thread) {
+        al_join_thread(this->raster_workers[worker_index].thread, NULL);
+        al_destroy_thread(this->raster_workers[worker_index].thread);
+      }
+    }
+    this->raster_workers.clear();
+    if (this->raster_cond) {
+      al_destroy_cond(this->raster_cond);
+      this->raster_cond = NULL;
+    }
+    if (this->raster_mutex) {
+      al_destroy_mutex(this->raster_mutex);
+      this->raster_mutex = NULL;
+    }
+  }
+
+  /**
+   * This is a raster worker. It renders bands each time a frame is handed
+   * out and reports back when there are none left.
+   * @param thread The Allegro thread.
+   * @param data The worker object.
+   * @return Nothing.
+   */
+  void* cAllegro::Run_Rasterizer(ALLEGRO_THREAD* thread, void* data) {
+    sRaster_Worker* worker = (sRaster_Worker*)data;
+    cAllegro* allegro = worker->allegro;
+    while (true) {
+      al_lock_mutex(allegro->raster_mutex);
+      while ((worker->generation == allegro->raster_generation) && !al_get_thread_should_stop(thread)) {
+        al_wait_cond(allegro->raster_cond, allegro->raster_mutex);
+      }
+      worker->generation = allegro->raster_generation;
+      al_unlock_mutex(allegro->raster_mutex);
+      if (al_get_thread_should_stop(thread)) {
+        break;
+      }
+      allegro->Raster_Bands(worker->row);
+      al_lock_mutex(allegro->raster_mutex);
+      allegro->raster_finished++;
+      al_broadcast_cond(allegro->raster_cond);
+      al_unlock_mutex(allegro->raster_mutex);
+    }
+    return NULL;
+  }
+
+  /**
+   * Outputs sounds from the stack. Sounds play on the voice pool. A sound
+   * that is already looping is restarted instead of doubled, and stop ends
+   * every voice playing the sound.
    * @param sounds The list of sounds to output.
    */
   void cAllegro::Output_Sounds(std::vector<sSound>& sounds) {
+    cScope_Timer timer(&this->profiler, cProfiler::STAGE_OUTPUT_SOUNDS);
     int sound_count = sounds.size();
     for (int sound_index = 0; sound_index < sound_count; sound_index++) {
       sSound& sound = sounds[sound_index];
-      if (this->sounds.find(sound.name) != this->sounds.end()) {
-        ALLEGRO_SAMPLE* sample = this->sounds[sound.name];
-        ALLEGRO_SAMPLE_ID* sample_id = NULL;
-        // Check for old sound ID and delete.
-        if (this->sound_ids.find(sound.name) != this->sound_ids.end()) {
-          // al_destroy_sample_instance(this->sound_ids[sound.name]);
-          // Delete record.
-          this->sound_ids.erase(sound.name);
-        }
+      if (sound.mode == "stop") {
+        this->Stop_Voices(sound.name);
+        continue;
+      }
+      ALLEGRO_SAMPLE* sample = this->Get_Sound(sound.name);
+      if (sample) {
         if (sound.mode == "loop") {
-          bool sound_ok = al_play_sample(sample, 1.0, 0.0, 1.0, ALLEGRO_PLAYMODE_LOOP, sample_id);
-          if (sound_ok) {
-            this->sound_ids[sound.name] = sample_id; // Replace this.
-          }
+          this->Stop_Voices(sound.name);
+          this->Start_Voice(sound.name, sample, PRIORITY_LOOP);
         }
         else if (sound.mode == "play") {
-          bool sound_ok = al_play_sample(sample, 1.0, 0.0, 1.0, ALLEGRO_PLAYMODE_LOOP, sample_id);
-          if (sound_ok) {
-            this->sound_ids[sound.name] = sample_id; // Replace this.
-          }
-        }
-        else if (sound.mode == "stop") {
-          if (this->sound_ids.find(sound.name) != this->sound_ids.end()) {
-            al_stop_sample(this->sound_ids[sound.name]);
-          }
+          this->Start_Voice(sound.name, sample, PRIORITY_EFFECT);
         }
       }
     }
     sounds.clear();
   }
+
+  /**
+   * Creates the voice pool. All of the sample instances are made up front
+   * and attached to one mixer so playing a sound never allocates. Without an
+   * audio device the pool stays empty and sounds are dropped.
+   */
+  void cAllegro::Create_Voices() {
+    this->audio_voice = al_create_voice(AUDIO_FREQUENCY, ALLEGRO_AUDIO_DEPTH_INT16, ALLEGRO_CHANNEL_CONF_2);
+    if (!this->audio_voice) {
+      return;
+    }
+    this->audio_mixer = al_create_mixer(AUDIO_FREQUENCY, ALLEGRO_AUDIO_DEPTH_FLOAT32, ALLEGRO_CHANNEL_CONF_2);
+    if (!this->audio_mixer || !al_attach_mixer_to_voice(this->audio_mixer, this->audio_voice)) {
+      throw std::string("Could not create sound mixer.");
+    }
+    for (int voice_index = 0; voice_index < VOICE_MAX; voice_index++) {
+      sVoice voice;
+      voice.instance = al_create_sample_instance(NULL);
+      voice.name = "";
+      voice.priority = PRIORITY_EFFECT;
+      voice.started = 0;
+      if (!voice.instance || !al_attach_sample_instance_to_mixer(voice.instance, this->audio_mixer)) {
+        throw std::string("Could not create sound voice.");
+      }
+      this->voices.push_back(voice);
+    }
+  }
+
+  /**
+   * Destroys the voice pool, its mixer, and the audio voice.
+   */
+  void cAllegro::Destroy_Voices() {
+    int voice_count = this->voices.size();
+    for (int voice_index = 0; voice_index < voice_count; voice_index++) {
+      if (this->voices[voice_index].instance) {
+        al_destroy_sample_instance(this->voices[voice_index].instance);
+      }
+    }
+    this->voices.clear();
+    if (this->audio_mixer) {
+      al_destroy_mixer(this->audio_mixer);
+      this->audio_mixer = NULL;
+    }
+    if (this->audio_voice) {
+      al_destroy_voice(this->audio_voice);
+      this->audio_voice = NULL;
+    }
+  }
+
+  /**
+   * Finds a voice for a sound. A voice that is done playing is used first.
+   * Otherwise the oldest voice of the lowest priority at or below the sound's
+   * is stolen, so effects never cut off loops.
+   * @param priority The priority of the sound.
+   * @return The index of the voice or -1 if every voice outranks the sound.
+   */
+  int cAllegro::Find_Voice(int priority) {
+    int victim = -1;
+    int voice_count = this->voices.size();
+    for (int voice_index = 0; voice_index < voice_count; voice_index++) {
+      sVoice& voice = this->voices[voice_index];
+      if ((voice.name.length() == 0) || !al_get_sample_instance_playing(voice.instance)) {
+        return voice_index;
+      }
+      if (voice.priority <= priority) {
+        if ((victim == -1) ||
+            (voice.priority < this->voices[victim].priority) ||
+            ((voice.priority == this->voices[victim].priority) && (voice.started < this->voices[victim].started))) {
+          victim = voice_index;
+        }
+      }
+    }
+    if (victim != -1) {
+      this->voice_steals++;
+    }
+    return victim;
+  }
+
+  /**
+   * Starts a sound on a free or stolen voice.
+   * @param name The name of the sound.
+   * @param sample The sample to play.
+   * @param priority The priority of the sound. Loops keep their sample resident.
+   */
+  void cAllegro::Start_Voice(std::string name, ALLEGRO_SAMPLE* sample, int priority) {
+    int voice_index = this->Find_Voice(priority);
+    if (voice_index == -1) {
+      this->voice_drops++;
+      return;
+    }
+    sVoice& voice = this->voices[voice_index];
+    if ((voice.name.length() > 0) && (voice.priority == PRIORITY_LOOP)) {
+      this->Release_Resource(voice.name, ASSET_SOUND);
+    }
+    voice.name = "";
+    if (al_set_sample(voice.instance, sample) &&
+        al_set_sample_instance_playmode(voice.instance, (priority == PRIORITY_LOOP) ? ALLEGRO_PLAYMODE_LOOP : ALLEGRO_PLAYMODE_ONCE) &&
+        al_play_sample_instance(voice.instance)) {
+      voice.name = name;
+      voice.priority = priority;
+      voice.started = this->voice_tick++;
+      if (priority == PRIORITY_LOOP) {
+        this->Retain_Resource(name, ASSET_SOUND); // Keep looping sounds resident.
+      }
+    }
+    else {
+      this->voice_drops++;
+    }
+  }
+
+  /**
+   * Stops every voice playing a sound.
+   * @param name The name of the sound.
+   */
+  void cAllegro::Stop_Voices(std::string name) {
+    int voice_count = this->voices.size();
+    for (int voice_index = 0; voice_index < voice_count; voice_index++) {
+      sVoice& voice = this->voices[voice_index];
+      if (voice.name == name) {
+        al_stop_sample_instance(voice.instance);
+        if (voice.priority == PRIORITY_LOOP) {
+          this->Release_Resource(voice.name, ASSET_SOUND);
+        }
+        voice.name = "";
+      }
+    }
+  }
+
+  /**
+   * Takes a sample off every voice using it so it can be freed.
+   * @param sample The sample.
+   */
+  void cAllegro::Release_Voices(ALLEGRO_SAMPLE* sample) {
+    int voice_count = this->voices.size();
+    for (int voice_index = 0; voice_index < voice_count; voice_index++) {
+      sVoice& voice = this->voices[voice_index];
+      if (al_get_sample(voice.instance) == sample) {
+        al_set_sample(voice.instance, NULL);
+        voice.name = "";
+      }
+    }
+  }
+
+  /**
+   * Counts the voices that are playing.
+   * @return The number of busy voices.
+   */
+  int cAllegro::Count_Busy_Voices() {
+    int busy = 0;
+    int voice_count = this->voices.size();
+    for (int voice_index = 0; voice_index < voice_count; voice_index++) {
+      sVoice& voice = this->voices[voice_index];
+      if ((voice.name.length() > 0) && al_get_sample_instance_playing(voice.instance)) {
+        busy++;
+      }
+    }
+    return busy;
+  }
   
   /**
-   * Outputs tracks from the stack. There are usually not too many.
+   * Outputs tracks from the stack and steps the crossfades. Tracks stream
+   * from their files through a fixed set of buffers, so a long track costs
+   * no more than a short one. Starting a track fades out whatever is
+   * playing. A stream is destroyed as soon as it is silent or done.
    * @param tracks The list of tracks to output.
+   * @throws An error if a track could not be opened.
    */
   void cAllegro::Output_Tracks(std::vector<sSound>& tracks) {
+    cScope_Timer timer(&this->profiler, cProfiler::STAGE_OUTPUT_SOUNDS);
+    double now = al_get_time();
+    double elapsed = (this->music_stamp > 0.0) ? (now - this->music_stamp) : 0.0;
+    this->music_stamp = now;
     int track_count = tracks.size();
     for (int track_index = 0; track_index < track_count; track_index++) {
       sSound& track = tracks[track_index];
-      if (this->tracks.find(track.name) != this->tracks.end()) {
-        ALLEGRO_AUDIO_STREAM* audio = this->tracks[track.name];
-        ALLEGRO_MIXER* mixer = this->mixers[track.name];
-        al_rewind_audio_stream(audio);
-        if (track.mode == "loop") {
-          al_set_audio_stream_playmode(audio, ALLEGRO_PLAYMODE_LOOP);
-          al_set_mixer_playing(mixer, true);
-        }
-        else if (track.mode == "play") {
-          al_set_mixer_playing(mixer, true);
-        }
-        else if (track.mode == "stop") {
-          al_set_mixer_playing(mixer, false);
-        }
+      if (track.mode == "loop") {
+        this->Start_Music(track.name, true);
+      }
+      else if (track.mode == "play") {
+        this->Start_Music(track.name, false);
+      }
+      else if (track.mode == "stop") {
+        this->Fade_Music(track.name);
+      }
+    }
+    tracks.clear();
+    float step = (this->music_fade > 0) ? (float)((elapsed * 1000.0) / this->music_fade) : 1.0;
+    for (int music_index = this->music.size() - 1; music_index >= 0; music_index--) {
+      sMusic& music = this->music[music_index];
+      if (music.gain < music.target) {
+        music.gain = ((music.gain + step) < music.target) ? (music.gain + step) : music.target;
+      }
+      else if (music.gain > music.target) {
+        music.gain = ((music.gain - step) > music.target) ? (music.gain - step) : music.target;
+      }
+      al_set_audio_stream_gain(music.stream, music.gain);
+      if (((music.target == 0.0) && (music.gain == 0.0)) || !al_get_audio_stream_playing(music.stream)) {
+        this->Release_Music(music_index);
+      }
+    }
+  }
+
+  /**
+   * Starts streaming a track. If the track is already the one playing it is
+   * started over instead.
+   * @param name The name of the track.
+   * @param loop Whether the track loops.
+   * @throws An error if the track could not be opened.
+   */
+  void cAllegro::Start_Music(std::string name, bool loop) {
+    std::map<std::string, std::string>::iterator track = this->tracks.find(name);
+    if (!this->audio_mixer || (track == this->tracks.end())) {
+      return;
+    }
+    ALLEGRO_PLAYMODE mode = loop ? ALLEGRO_PLAYMODE_LOOP : ALLEGRO_PLAYMODE_ONCE;
+    bool fading = false;
+    int music_count = this->music.size();
+    for (int music_index = 0; music_index < music_count; music_index++) {
+      sMusic& music = this->music[music_index];
+      if ((music.name == name) && (music.target > 0.0)) {
+        al_rewind_audio_stream(music.stream);
+        al_set_audio_stream_playmode(music.stream, mode);
+        al_set_audio_stream_playing(music.stream, true);
+        return;
       }
+      music.target = 0.0;
+      fading = true;
+    }
+    sMusic music;
+    music.stream = al_load_audio_stream(std::string(this->root + "/" + track->second).c_str(), this->music_buffers, this->music_samples);
+    if (!music.stream) {
+      throw std::string("Could not stream track " + name + ".");
+    }
+    music.name = name;
+    music.gain = (fading && (this->music_fade > 0)) ? 0.0 : 1.0;
+    music.target = 1.0;
+    al_set_audio_stream_playmode(music.stream, mode);
+    al_set_audio_stream_gain(music.stream, music.gain);
+    if (!al_attach_audio_stream_to_mixer(music.stream, this->audio_mixer)) {
+      al_destroy_audio_stream(music.stream);
+      throw std::string("Could not play track " + name + ".");
     }
+    this->music.push_back(music);
+  }
+
+  /**
+   * Fades out every stream of a track.
+   * @param name The name of the track.
+   */
+  void cAllegro::Fade_Music(std::string name) {
+    int music_count = this->music.size();
+    for (int music_index = 0; music_index < music_count; music_index++) {
+      if (this->music[music_index].name == name) {
+        this->music[music_index].target = 0.0;
+      }
+    }
+  }
+
+  /**
+   * Destroys a stream along with its buffers and decoder.
+   * @param index The index of the stream.
+   */
+  void cAllegro::Release_Music(int index) {
+    al_destroy_audio_stream(this->music[index].stream);
+    this->music.erase(this->music.begin() + index);
   }
   
   /**
@@ -231,58 +832,997 @@ namespace Codeloader {
    * @param texts All of the texts stored in the stacks.
    */
   void cAllegro::Output_Texts(std::vector<sText>& texts) {
-    al_set_target_bitmap(this->screen);
+    cScope_Timer timer(&this->profiler, cProfiler::STAGE_OUTPUT_TEXTS);
+    this->Draw_Texts(texts);
+  }
+  
+  /**
+   * Draws texts onto the screen from the text cache.
+   * @param texts The texts to draw.
+   */
+  void cAllegro::Draw_Texts(std::vector<sText>& texts) {
     int text_count = texts.size();
     for (int text_index = 0; text_index < text_count; text_index++) {
       sText& text = texts[text_index];
-      al_draw_text(this->font, al_map_rgb(text.color.red, text.color.green, text.color.blue), text.x, text.y, 0, text.string.c_str());
+      sText_Image* image = this->Get_Text_Image(text);
+      if (image) {
+        al_set_target_bitmap(this->screen);
+        al_draw_bitmap(image->bitmap, text.x + image->offset_x, text.y + image->offset_y, 0);
+      }
+    }
+  }
+
+  /**
+   * Gets the pre-rendered image of a text, rendering it on a miss. This is
+   * only called from the render thread so the cache needs no lock.
+   * @param text The text object.
+   * @return The text image or NULL if there is nothing to draw.
+   */
+  sText_Image* cAllegro::Get_Text_Image(sText& text) {
+    int color = (text.color.red << 16) | (text.color.green << 8) | text.color.blue;
+    std::pair<std::string, int> key(text.string, color);
+    std::map<std::pair<std::string, int>, sText_Image>::iterator entry = this->text_cache.find(key);
+    if (entry != this->text_cache.end()) {
+      entry->second.last_used = this->text_tick;
+      return &entry->second;
+    }
+    if (!this->font) {
+      return NULL;
+    }
+    int box_x = 0;
+    int box_y = 0;
+    int box_w = 0;
+    int box_h = 0;
+    al_get_text_dimensions(this->font, text.string.c_str(), &box_x, &box_y, &box_w, &box_h);
+    if ((box_w <= 0) || (box_h <= 0)) {
+      return NULL;
+    }
+    al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
+    ALLEGRO_BITMAP* bitmap = al_create_bitmap(box_w, box_h);
+    if (!bitmap) {
+      return NULL;
+    }
+    // Glyphs are blended onto clear pixels so the image keeps premultiplied alpha.
+    al_set_target_bitmap(bitmap);
+    al_clear_to_color(al_map_rgba(0, 0, 0, 0));
+    al_draw_text(this->font, al_map_rgb(text.color.red, text.color.green, text.color.blue), -box_x, -box_y, 0, text.string.c_str());
+    sText_Image& image = this->text_cache[key];
+    image.bitmap = bitmap;
+    image.offset_x = box_x;
+    image.offset_y = box_y;
+    image.last_used = this->text_tick;
+    return &image;
+  }
+
+  /**
+   * Evicts the least recently used text images over the cache limit. Images
+   * used this frame are kept.
+   */
+  void cAllegro::Trim_Text_Cache() {
+    while (this->text_cache.size() > TEXT_CACHE_MAX) {
+      std::map<std::pair<std::string, int>, sText_Image>::iterator oldest = this->text_cache.end();
+      for (std::map<std::pair<std::string, int>, sText_Image>::iterator i = this->text_cache.begin(); i != this->text_cache.end(); ++i) {
+        if ((i->second.last_used != this->text_tick) && ((oldest == this->text_cache.end()) || (i->second.last_used < oldest->second.last_used))) {
+          oldest = i;
+        }
+      }
+      if (oldest == this->text_cache.end()) {
+        break; // Everything is on screen.
+      }
+      al_destroy_bitmap(oldest->second.bitmap);
+      this->text_cache.erase(oldest);
+    }
+  }
+
+  /**
+   * Frees all of the text images.
+   */
+  void cAllegro::Clear_Text_Cache() {
+    for (std::map<std::pair<std::string, int>, sText_Image>::iterator i = this->text_cache.begin(); i != this->text_cache.end(); ++i) {
+      al_destroy_bitmap(i->second.bitmap);
+    }
+    this->text_cache.clear();
+  }
+  
+  /**
+   * Gets the box that a text covers on the screen.
+   * @param text The text object.
+   * @return The box of left, top, right, bottom. Right and bottom are exclusive.
+   */
+  sBox cAllegro::Get_Text_Bounds(sText& text) {
+    sBox bounds = { text.x, text.y, text.x, text.y };
+    sText_Image* image = this->Get_Text_Image(text);
+    if (image) {
+      bounds.left = text.x + image->offset_x;
+      bounds.top = text.y + image->offset_y;
+      bounds.right = bounds.left + al_get_bitmap_width(image->bitmap) + 1;
+      bounds.bottom = bounds.top + al_get_bitmap_height(image->bitmap) + 1;
+    }
+    return bounds;
+  }
+  
+  /**
+   * Starts the render thread. The display is handed over to it, so the main
+   * thread must not draw to the back buffer after this. If the thread cannot
+   * be created frames are rendered on the main thread instead.
+   */
+  void cAllegro::Start_Renderer() {
+    this->render_mutex = al_create_mutex();
+    this->render_cond = al_create_cond();
+    if (this->render_mutex && this->render_cond) {
+      this->renderer = al_create_thread(cAllegro::Run_Renderer, this);
+    }
+    if (this->renderer) {
+      al_set_target_bitmap(NULL); // Release the display's context.
+      al_start_thread(this->renderer);
+    }
+  }
+  
+  /**
+   * Stops the render thread once it has finished its frame.
+   */
+  void cAllegro::Stop_Renderer() {
+    if (this->renderer) {
+      al_set_thread_should_stop(this->renderer);
+      al_lock_mutex(this->render_mutex);
+      al_broadcast_cond(this->render_cond);
+      al_unlock_mutex(this->render_mutex);
+      al_join_thread(this->renderer, NULL);
+      al_destroy_thread(this->renderer);
+      this->renderer = NULL;
+    }
+    if (this->render_cond) {
+      al_destroy_cond(this->render_cond);
+      this->render_cond = NULL;
+    }
+    if (this->render_mutex) {
+      al_destroy_mutex(this->render_mutex);
+      this->render_mutex = NULL;
     }
   }
   
   /**
-   * Loads resources into the corresponding resource hashes.
+   * This is the render thread. It waits for a frame, renders it and presents
+   * it. The frame pending flag is the only thing shared with the main thread.
+   * @param thread The Allegro thread.
+   * @param data The Allegro object.
+   * @return Nothing.
+   */
+  void* cAllegro::Run_Renderer(ALLEGRO_THREAD* thread, void* data) {
+    cAllegro* allegro = (cAllegro*)data;
+    while (true) {
+      if (!allegro->frame_pending.load(std::memory_order_acquire)) {
+        al_lock_mutex(allegro->render_mutex);
+        while (!allegro->frame_pending.load(std::memory_order_acquire) && !al_get_thread_should_stop(thread)) {
+          al_wait_cond(allegro->render_cond, allegro->render_mutex);
+        }
+        al_unlock_mutex(allegro->render_mutex);
+      }
+      if (al_get_thread_should_stop(thread)) {
+        break;
+      }
+      double start = al_get_time();
+      allegro->Render_Frame(allegro->render_frame);
+      allegro->render_time = (int)((al_get_time() - start) * 1000000.0);
+      // Hand the frame buffer back.
+      allegro->frame_pending.store(false, std::memory_order_release);
+      al_lock_mutex(allegro->render_mutex);
+      al_broadcast_cond(allegro->render_cond);
+      al_unlock_mutex(allegro->render_mutex);
+    }
+    al_set_target_bitmap(NULL); // Release the display's context.
+    return NULL;
+  }
+  
+  /**
+   * Blocks until the render thread has finished the frame it was given.
+   * Resource bitmaps may only be created, packed or freed after this.
+   */
+  void cAllegro::Wait_For_Renderer() {
+    if (this->renderer && this->frame_pending.load(std::memory_order_acquire)) {
+      al_lock_mutex(this->render_mutex);
+      while (this->frame_pending.load(std::memory_order_acquire)) {
+        al_wait_cond(this->render_cond, this->render_mutex);
+      }
+      al_unlock_mutex(this->render_mutex);
+    }
+  }
+  
+  /**
+   * Hands a finished frame to the renderer. The image and text stacks are
+   * swapped with the render buffer and come back empty.
+   * @param layers The image stacks, one per layer.
+   * @param texts The texts.
+   */
+  void cAllegro::Submit_Frame(std::vector<sImage>* layers, std::vector<sText>& texts) {
+    if (!this->render_mutex) {
+      this->Start_Renderer();
+    }
+    this->Wait_For_Renderer();
+    for (int layer_index = 0; layer_index < LAYER_COUNT; layer_index++) {
+      this->render_frame.images[layer_index].swap(layers[layer_index]);
+      layers[layer_index].clear();
+    }
+    this->render_frame.texts.swap(texts);
+    texts.clear();
+    if (this->renderer) {
+      this->frame_pending.store(true, std::memory_order_release);
+      al_lock_mutex(this->render_mutex);
+      al_broadcast_cond(this->render_cond);
+      al_unlock_mutex(this->render_mutex);
+    }
+    else {
+      double start = al_get_time();
+      this->Render_Frame(this->render_frame);
+      this->render_time = (int)((al_get_time() - start) * 1000000.0);
+    }
+  }
+  
+  /**
+   * Renders and presents a frame, either in full or only where it differs
+   * from the last one. In dirty mode nothing is presented if nothing changed.
+   * @param frame The frame to render. It becomes the last frame.
+   */
+  void cAllegro::Render_Frame(sFrame& frame) {
+    this->text_tick++;
+    if (this->dirty_mode) {
+      std::vector<sBox> rects;
+      if (this->full_redraw) {
+        sBox screen = { 0, 0, this->screen_w, this->screen_h };
+        rects.push_back(screen);
+        this->full_redraw = false;
+      }
+      else {
+        this->Find_Dirty_Rects(frame, this->last_frame, rects);
+      }
+      if (this->profiler.overlay) { // The graph changes every frame.
+        this->Add_Dirty_Rect(rects, this->profiler.Get_Overlay_Bounds(this->screen_w, this->screen_h));
+      }
+      this->dirty_rects = rects.size();
+      if (rects.size() > 0) {
+        this->Render_Regions(frame.images, LAYER_COUNT, frame.texts, rects);
+        if (this->profiler.overlay) {
+          this->profiler.Draw_Overlay(this->screen);
+        }
+        // The whole screen is presented because the back buffer is not kept between flips.
+        this->Render_Screen();
+      }
+      else {
+        this->draw_calls = 0;
+        this->draw_batches = 0;
+      }
+    }
+    else {
+      this->Render_Images(frame.images, LAYER_COUNT);
+      this->Output_Texts(frame.texts);
+      if (this->profiler.overlay) {
+        this->profiler.Draw_Overlay(this->screen);
+      }
+      this->Render_Screen();
+    }
+    // Keep this frame around to compare the next one against.
+    for (int layer_index = 0; layer_index < LAYER_COUNT; layer_index++) {
+      this->last_frame.images[layer_index].swap(frame.images[layer_index]);
+    }
+    this->last_frame.texts.swap(frame.texts);
+    this->Trim_Text_Cache();
+  }
+  
+  /**
+   * Compares this frame's images and texts with the last frame's. Anything
+   * that moved, changed, appeared or disappeared marks its old and new boxes
+   * as dirty.
+   * @param frame This frame.
+   * @param last The last frame.
+   * @param rects The list that receives the dirty rectangles.
+   */
+  void cAllegro::Find_Dirty_Rects(sFrame& frame, sFrame& last, std::vector<sBox>& rects) {
+    for (int layer_index = 0; layer_index < LAYER_COUNT; layer_index++) {
+      this->Diff_Images(frame.images[layer_index], last.images[layer_index], rects);
+    }
+    this->Diff_Texts(frame.texts, last.texts, rects);
+  }
+
+  /**
+   * Marks the images of a layer that differ from the last frame's as dirty.
+   * The lists are walked together and an image only matches the same image
+   * at the same place, so one added or removed near the front does not
+   * dirty everything after it. When the lists stop matching, a few images
+   * are looked ahead for where they line up again. The matches keep their
+   * order, so images that were drawn in a different order are dirty too.
+   * @param images This frame's images.
+   * @param last The last frame's images.
+   * @param rects The list that receives the dirty rectangles.
+   */
+  void cAllegro::Diff_Images(std::vector<sImage>& images, std::vector<sImage>& last, std::vector<sBox>& rects) {
+    int image_count = images.size();
+    int last_count = last.size();
+    int image_index = 0;
+    int last_index = 0;
+    while ((image_index < image_count) && (last_index < last_count)) {
+      if (this->Is_Same_Image(images[image_index], last[last_index])) {
+        image_index++;
+        last_index++;
+        continue;
+      }
+      int added = 0;
+      int removed = 0;
+      for (int step = 1; (step <= DIRTY_LOOKAHEAD) && !added && !removed; step++) {
+        if (((image_index + step) < image_count) && this->Is_Same_Image(images[image_index + step], last[last_index])) {
+          added = step;
+        }
+        else if (((last_index + step) < last_count) && this->Is_Same_Image(images[image_index], last[last_index + step])) {
+          removed = step;
+        }
+      }
+      // With neither, the image changed in place.
+      for (int step = 0; (step < (added ? added : 1)) && !removed; step++) {
+        this->Add_Dirty_Rect(rects, this->Get_Image_Bounds(images[image_index++]));
+      }
+      for (int step = 0; (step < (removed ? removed : 1)) && !added; step++) {
+        this->Add_Dirty_Rect(rects, this->Get_Image_Bounds(last[last_index++]));
+      }
+    }
+    for (; image_index < image_count; image_index++) {
+      this->Add_Dirty_Rect(rects, this->Get_Image_Bounds(images[image_index]));
+    }
+    for (; last_index < last_count; last_index++) {
+      this->Add_Dirty_Rect(rects, this->Get_Image_Bounds(last[last_index]));
+    }
+  }
+
+  /**
+   * Marks the texts that differ from the last frame's as dirty. They are
+   * matched the same way as the images in Diff_Images.
+   * @param texts This frame's texts.
+   * @param last The last frame's texts.
+   * @param rects The list that receives the dirty rectangles.
+   */
+  void cAllegro::Diff_Texts(std::vector<sText>& texts, std::vector<sText>& last, std::vector<sBox>& rects) {
+    int text_count = texts.size();
+    int last_count = last.size();
+    int text_index = 0;
+    int last_index = 0;
+    while ((text_index < text_count) && (last_index < last_count)) {
+      if (this->Is_Same_Text(texts[text_index], last[last_index])) {
+        text_index++;
+        last_index++;
+        continue;
+      }
+      int added = 0;
+      int removed = 0;
+      for (int step = 1; (step <= DIRTY_LOOKAHEAD) && !added && !removed; step++) {
+        if (((text_index + step) < text_count) && this->Is_Same_Text(texts[text_index + step], last[last_index])) {
+          added = step;
+        }
+        else if (((last_index + step) < last_count) && this->Is_Same_Text(texts[text_index], last[last_index + step])) {
+          removed = step;
+        }
+      }
+      for (int step = 0; (step < (added ? added : 1)) && !removed; step++) {
+        this->Add_Dirty_Rect(rects, this->Get_Text_Bounds(texts[text_index++]));
+      }
+      for (int step = 0; (step < (removed ? removed : 1)) && !added; step++) {
+        this->Add_Dirty_Rect(rects, this->Get_Text_Bounds(last[last_index++]));
+      }
+    }
+    for (; text_index < text_count; text_index++) {
+      this->Add_Dirty_Rect(rects, this->Get_Text_Bounds(texts[text_index]));
+    }
+    for (; last_index < last_count; last_index++) {
+      this->Add_Dirty_Rect(rects, this->Get_Text_Bounds(last[last_index]));
+    }
+  }
+  
+  /**
+   * Adds a rectangle to the dirty list. It is clipped to the screen and merged
+   * into a rectangle that it overlaps. Too many rectangles collapse into one.
+   * @param rects The list of dirty rectangles.
+   * @param rect The rectangle to add.
+   */
+  void cAllegro::Add_Dirty_Rect(std::vector<sBox>& rects, sBox rect) {
+    rect.left = (rect.left < 0) ? 0 : rect.left;
+    rect.top = (rect.top < 0) ? 0 : rect.top;
+    rect.right = (rect.right > this->screen_w) ? this->screen_w : rect.right;
+    rect.bottom = (rect.bottom > this->screen_h) ? this->screen_h : rect.bottom;
+    if ((rect.left >= rect.right) || (rect.top >= rect.bottom)) {
+      return; // Off screen.
+    }
+    int rect_count = rects.size();
+    for (int rect_index = 0; rect_index < rect_count; rect_index++) {
+      sBox& other = rects[rect_index];
+      if ((rect.left <= other.right) && (rect.right >= other.left) && (rect.top <= other.bottom) && (rect.bottom >= other.top)) {
+        other.left = (rect.left < other.left) ? rect.left : other.left;
+        other.top = (rect.top < other.top) ? rect.top : other.top;
+        other.right = (rect.right > other.right) ? rect.right : other.right;
+        other.bottom = (rect.bottom > other.bottom) ? rect.bottom : other.bottom;
+        return;
+      }
+    }
+    rects.push_back(rect);
+    if (rects.size() > DIRTY_RECT_MAX) {
+      sBox all = rects[0];
+      rect_count = rects.size();
+      for (int rect_index = 1; rect_index < rect_count; rect_index++) {
+        sBox& other = rects[rect_index];
+        all.left = (other.left < all.left) ? other.left : all.left;
+        all.top = (other.top < all.top) ? other.top : all.top;
+        all.right = (other.right > all.right) ? other.right : all.right;
+        all.bottom = (other.bottom > all.bottom) ? other.bottom : all.bottom;
+      }
+      rects.clear();
+      rects.push_back(all);
+    }
+  }
+  
+  /**
+   * Determines if two queued images draw the same thing.
+   * @param image The image from this frame.
+   * @param other The image from the last frame.
+   * @return True if they are the same.
+   */
+  bool cAllegro::Is_Same_Image(sImage& image, sImage& other) {
+    return ((image.bitmap == other.bitmap) && (image.x == other.x) && (image.y == other.y) &&
+            (image.angle == other.angle) && (image.scale == other.scale) &&
+            (image.flip_x == other.flip_x) && (image.flip_y == other.flip_y));
+  }
+  
+  /**
+   * Determines if two queued texts draw the same thing.
+   * @param text The text from this frame.
+   * @param other The text from the last frame.
+   * @return True if they are the same.
+   */
+  bool cAllegro::Is_Same_Text(sText& text, sText& other) {
+    return ((text.x == other.x) && (text.y == other.y) &&
+            (text.color.red == other.color.red) && (text.color.green == other.color.green) && (text.color.blue == other.color.blue) &&
+            (text.string == other.string));
+  }
+  
+  /**
+   * Queues resources for decoding on the loader threads. Resources that are
+   * already loaded or waiting to be loaded are skipped.
    * @param resources The list of resources to load. These are processed via extensions.
-   * @throws An error if a resource could not be loaded.
    */
   void cAllegro::Load_Resources(std::vector<std::string>& resources) {
+    if (this->loaders.size() == 0) {
+      this->Create_Loaders();
+    }
+    al_lock_mutex(this->load_mutex);
+    if (this->load_count == this->load_total) { // Start a new batch.
+      this->load_total = 0;
+      this->load_count = 0;
+    }
     int resource_count = resources.size();
     for (int res_index = 0; res_index < resource_count; res_index++) {
-      std::string resource = resources[res_index];
-      std::string ext = this->Replace_Token("^\\w+\\.", "", resource);
-      std::string name = this->Replace_Token("\\.\\w+$", "", resource);
-      if (ext == "png") {
-        ALLEGRO_BITMAP* bitmap = al_load_bitmap(std::string(this->root + "/" + resource).c_str());
-        if (bitmap) {
-          this->images[name] = bitmap;
+      sResource resource;
+      resource.file = resources[res_index];
+      resource.ext = this->Replace_Token("^\\w+\\.", "", resource.file);
+      resource.name = this->Replace_Token("\\.\\w+$", "", resource.file);
+      resource.bitmap = NULL;
+      resource.sample = NULL;
+      resource.loaded = false;
+      if ((resource.ext == "png") || (resource.ext == "wav") || (resource.ext == "mp3")) {
+        // Images, sounds and tracks may share a name so both checks go by type.
+        if (!this->Is_Resource_Loaded(resource.name, resource.ext) && (this->load_pending.find(resource.file) == this->load_pending.end())) {
+          this->load_pending[resource.file] = true;
+          this->load_queue.push_back(resource);
+          this->load_total++;
+        }
+      }
+    }
+    al_broadcast_cond(this->load_cond);
+    al_unlock_mutex(this->load_mutex);
+  }
+  
+  /**
+   * Starts the loader threads. One thread is left for the interpreter.
+   * @throws An error if the threads could not be created.
+   */
+  void cAllegro::Create_Loaders() {
+    this->load_mutex = al_create_mutex();
+    this->load_cond = al_create_cond();
+    if (!this->load_mutex || !this->load_cond) {
+      throw std::string("Could not create loader lock.");
+    }
+    int loader_count = al_get_cpu_count() - 1;
+    if (loader_count < 1) {
+      loader_count = 1;
+    }
+    else if (loader_count > LOADER_MAX) {
+      loader_count = LOADER_MAX;
+    }
+    for (int loader_index = 0; loader_index < loader_count; loader_index++) {
+      ALLEGRO_THREAD* loader = al_create_thread(cAllegro::Run_Loader, this);
+      if (!loader) {
+        throw std::string("Could not create loader thread.");
+      }
+      this->loaders.push_back(loader);
+      al_start_thread(loader);
+    }
+  }
+  
+  /**
+   * Stops the loader threads and frees anything that was never handed off.
+   */
+  void cAllegro::Destroy_Loaders() {
+    int loader_count = this->loaders.size();
+    for (int loader_index = 0; loader_index < loader_count; loader_index++) {
+      al_set_thread_should_stop(this->loaders[loader_index]);
+    }
+    if (this->load_mutex) {
+      al_lock_mutex(this->load_mutex);
+      al_broadcast_cond(this->load_cond);
+      al_unlock_mutex(this->load_mutex);
+    }
+    for (int loader_index = 0; loader_index < loader_count; loader_index++) {
+      al_join_thread(this->loaders[loader_index], NULL);
+      al_destroy_thread(this->loaders[loader_index]);
+    }
+    this->loaders.clear();
+    int result_count = this->load_results.size();
+    for (int result_index = 0; result_index < result_count; result_index++) {
+      sResource& resource = this->load_results[result_index];
+      if (resource.bitmap) {
+        al_destroy_bitmap(resource.bitmap);
+      }
+      if (resource.sample) {
+        al_destroy_sample(resource.sample);
+      }
+    }
+    this->load_results.clear();
+    this->load_queue.clear();
+    if (this->load_cond) {
+      al_destroy_cond(this->load_cond);
+      this->load_cond = NULL;
+    }
+    if (this->load_mutex) {
+      al_destroy_mutex(this->load_mutex);
+      this->load_mutex = NULL;
+    }
+  }
+  
+  /**
+   * This is the loader thread. It decodes queued resources until it is told to stop.
+   * @param thread The Allegro thread.
+   * @param data The Allegro object.
+   * @return Nothing.
+   */
+  void* cAllegro::Run_Loader(ALLEGRO_THREAD* thread, void* data) {
+    cAllegro* allegro = (cAllegro*)data;
+    // Bitmap flags are per thread. The screen is a memory bitmap so the images are too.
+    al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
+    al_lock_mutex(allegro->load_mutex);
+    while (!al_get_thread_should_stop(thread)) {
+      if (allegro->load_queue.size() > 0) {
+        sResource resource = allegro->load_queue.front();
+        allegro->load_queue.pop_front();
+        // Decode without holding the lock.
+        al_unlock_mutex(allegro->load_mutex);
+        allegro->Decode_Resource(resource);
+        al_lock_mutex(allegro->load_mutex);
+        allegro->load_results.push_back(resource);
+      }
+      else {
+        al_wait_cond(allegro->load_cond, allegro->load_mutex);
+      }
+    }
+    al_unlock_mutex(allegro->load_mutex);
+    return NULL;
+  }
+  
+  /**
+   * Decodes a single resource. This is called from the loader threads.
+   * @param resource The resource to decode.
+   */
+  void cAllegro::Decode_Resource(sResource& resource) {
+    std::string path = this->root + "/" + resource.file;
+    if (resource.ext == "png") {
+      resource.bitmap = al_load_bitmap(path.c_str());
+      resource.loaded = (resource.bitmap != NULL);
+    }
+    else if (resource.ext == "wav") {
+      resource.sample = al_load_sample(path.c_str());
+      resource.loaded = (resource.sample != NULL);
+    }
+    else if (resource.ext == "mp3") {
+      // Tracks are streamed when played. Just make sure there is a file.
+      std::ifstream file(path.c_str());
+      resource.loaded = file.good();
+    }
+  }
+  
+  /**
+   * Hands decoded resources over to the resource hashes. This must be called
+   * from the main thread.
+   * @throws An error if a resource could not be loaded.
+   */
+  void cAllegro::Finish_Resources() {
+    if (!this->load_mutex) {
+      return; // Nothing was ever uploaded.
+    }
+    std::vector<sResource> results;
+    al_lock_mutex(this->load_mutex);
+    results.swap(this->load_results);
+    al_unlock_mutex(this->load_mutex);
+    if (results.size() > 0) {
+      this->Wait_For_Renderer(); // Bitmaps cannot change under the render thread.
+    }
+    // Tallest first packs the atlas shelves tighter.
+    std::sort(results.begin(), results.end(), cAllegro::Compare_Resource_Height);
+    std::string error = "";
+    int result_count = results.size();
+    for (int result_index = 0; result_index < result_count; result_index++) {
+      sResource& resource = results[result_index];
+      if (!resource.loaded) {
+        if (resource.ext == "png") {
+          error = "Could not load image " + resource.name + ".";
+        }
+        else if (resource.ext == "wav") {
+          error = "Could not load sound " + resource.name + ".";
         }
         else {
-          throw std::string("Could not load image " + name + ".");
+          error = "Could not load track " + resource.name + ".";
         }
       }
-      else if (ext == "wav") {
-        ALLEGRO_SAMPLE* sound = al_load_sample(std::string(this->root + "/" + resource).c_str());
-        if (sound) {
-          this->sounds[name] = sound;
+      else if (this->Is_Resource_Loaded(resource.name, resource.ext)) {
+        // Reloaded on demand in the meantime. Queued draws may point at that copy.
+        if (resource.bitmap) {
+          al_destroy_bitmap(resource.bitmap);
         }
-        else {
-          throw std::string("Could not load sound " + name + ".");
+        if (resource.sample) {
+          al_destroy_sample(resource.sample);
         }
       }
-      else if (ext == "mp3") {
-        ALLEGRO_AUDIO_STREAM* track = al_load_audio_stream(std::string(this->root + "/" + resource).c_str(), 50, 50);
-        if (track) {
-          ALLEGRO_MIXER* mixer = al_create_mixer(48000, ALLEGRO_AUDIO_DEPTH_FLOAT32, ALLEGRO_CHANNEL_CONF_2);
-          if (mixer) {
-            al_attach_audio_stream_to_mixer(track, mixer);
-            this->mixers[name] = mixer;
-          }
-          else {
-            throw std::string("Could not create mixer for " + name + ".");
+      else if (resource.bitmap || resource.sample) {
+        this->Store_Resource(resource);
+      }
+      else {
+        this->tracks[resource.name] = resource.file;
+      }
+      al_lock_mutex(this->load_mutex);
+      this->load_pending.erase(resource.file);
+      this->load_count++;
+      al_unlock_mutex(this->load_mutex);
+    }
+    if (error.length() > 0) {
+      throw error;
+    }
+  }
+  
+  /**
+   * Determines if a resource has already been handed off. Only resources of
+   * the same type are looked at, so an image and a sound may share a name.
+   * @param name The name of the resource without the extension.
+   * @param ext The extension, which gives the type.
+   * @return True if the resource is loaded, false otherwise.
+   */
+  bool cAllegro::Is_Resource_Loaded(std::string name, std::string ext) {
+    if (ext == "png") {
+      return (this->images.find(name) != this->images.end());
+    }
+    else if (ext == "wav") {
+      return (this->sounds.find(name) != this->sounds.end());
+    }
+    return (this->tracks.find(name) != this->tracks.end());
+  }
+  
+  /**
+   * Stores a decoded bitmap or sample in the resource hashes and records it in
+   * the cache. A resource of the same type and name is freed first.
+   * @param resource The decoded resource.
+   */
+  void cAllegro::Store_Resource(sResource& resource) {
+    int type = resource.bitmap ? ASSET_IMAGE : ASSET_SOUND;
+    this->Evict_Resource(resource.name, type); // Reloading must not leak the old one.
+    std::map<std::string, sAsset>& assets = this->assets[type];
+    sAsset asset;
+    asset.file = resource.file;
+    asset.ext = resource.ext;
+    asset.refs = 0;
+    asset.bytes = 0;
+    asset.last_used = this->cache_tick;
+    asset.width = 0;
+    asset.height = 0;
+    std::map<std::string, sAsset>::iterator old = assets.find(resource.name);
+    if (old != assets.end()) {
+      asset.refs = old->second.refs; // Keep references across reloads.
+    }
+    if (resource.bitmap) {
+      asset.width = al_get_bitmap_width(resource.bitmap);
+      asset.height = al_get_bitmap_height(resource.bitmap);
+      asset.bytes = (long long)asset.width * asset.height * 4;
+      this->images[resource.name] = this->Pack_Image(resource.name, resource.bitmap);
+    }
+    else if (resource.sample) {
+      int channels = al_get_channel_count(al_get_sample_channels(resource.sample));
+      int depth = al_get_audio_depth_size(al_get_sample_depth(resource.sample));
+      asset.bytes = (long long)al_get_sample_length(resource.sample) * channels * depth;
+      this->sounds[resource.name] = resource.sample;
+    }
+    this->cache_bytes += asset.bytes;
+    assets[resource.name] = asset;
+  }
+  
+  /**
+   * Gets an image from the cache. An evicted image is reloaded.
+   * @param name The name of the image.
+   * @return The bitmap or NULL if there is no such image.
+   * @throws An error if an evicted image could not be reloaded.
+   */
+  ALLEGRO_BITMAP* cAllegro::Get_Image(std::string name) {
+    ALLEGRO_BITMAP* bitmap = NULL;
+    std::map<std::string, ALLEGRO_BITMAP*>::iterator image = this->images.find(name);
+    if (image != this->images.end()) {
+      bitmap = image->second;
+      this->cache_hits++;
+      this->assets[ASSET_IMAGE][name].last_used = this->cache_tick;
+    }
+    else if (this->Reload_Resource(name, ASSET_IMAGE)) {
+      image = this->images.find(name);
+      bitmap = (image != this->images.end()) ? image->second : NULL;
+    }
+    return bitmap;
+  }
+  
+  /**
+   * Gets the size of an image without loading it. The size is kept after the
+   * image is evicted.
+   * @param name The name of the image.
+   * @param width The width of the image.
+   * @param height The height of the image.
+   * @return True if the image was ever loaded, false otherwise.
+   */
+  bool cAllegro::Get_Image_Size(std::string name, int& width, int& height) {
+    std::map<std::string, sAsset>::iterator asset = this->assets[ASSET_IMAGE].find(name);
+    if (asset == this->assets[ASSET_IMAGE].end()) {
+      return false;
+    }
+    width = asset->second.width;
+    height = asset->second.height;
+    return true;
+  }
+  
+  /**
+   * Gets a sound from the cache. An evicted sound is reloaded.
+   * @param name The name of the sound.
+   * @return The sample or NULL if there is no such sound.
+   * @throws An error if an evicted sound could not be reloaded.
+   */
+  ALLEGRO_SAMPLE* cAllegro::Get_Sound(std::string name) {
+    ALLEGRO_SAMPLE* sample = NULL;
+    std::map<std::string, ALLEGRO_SAMPLE*>::iterator sound = this->sounds.find(name);
+    if (sound != this->sounds.end()) {
+      sample = sound->second;
+      this->cache_hits++;
+      this->assets[ASSET_SOUND][name].last_used = this->cache_tick;
+    }
+    else if (this->Reload_Resource(name, ASSET_SOUND)) {
+      sound = this->sounds.find(name);
+      sample = (sound != this->sounds.end()) ? sound->second : NULL;
+    }
+    return sample;
+  }
+  
+  /**
+   * Reloads an evicted resource on the main thread. Only a resource of the
+   * type asked for is reloaded.
+   * @param name The name of the resource.
+   * @param type The type of the resource. Possible values are ASSET_IMAGE and ASSET_SOUND.
+   * @return True if the resource was reloaded, false if it was never loaded.
+   * @throws An error if the resource could not be reloaded.
+   */
+  bool cAllegro::Reload_Resource(std::string name, int type) {
+    std::map<std::string, sAsset>::iterator asset = this->assets[type].find(name);
+    if ((asset == this->assets[type].end()) || (asset->second.ext != ((type == ASSET_IMAGE) ? "png" : "wav"))) {
+      return false;
+    }
+    this->Wait_For_Renderer(); // Packing draws into atlas pages the renderer may be reading.
+    sResource resource;
+    resource.name = name;
+    resource.file = asset->second.file;
+    resource.ext = asset->second.ext;
+    resource.bitmap = NULL;
+    resource.sample = NULL;
+    resource.loaded = false;
+    this->Decode_Resource(resource);
+    if (!resource.loaded) {
+      throw std::string("Could not reload " + name + ".");
+    }
+    this->Store_Resource(resource);
+    this->cache_misses++;
+    return true;
+  }
+  
+  /**
+   * Adds a reference to a resource. Referenced resources are not evicted.
+   * @param name The name of the resource.
+   * @param type The type of the resource.
+   */
+  void cAllegro::Retain_Resource(std::string name, int type) {
+    std::map<std::string, sAsset>::iterator asset = this->assets[type].find(name);
+    if (asset != this->assets[type].end()) {
+      asset->second.refs++;
+    }
+  }
+  
+  /**
+   * Removes a reference from a resource.
+   * @param name The name of the resource.
+   * @param type The type of the resource.
+   */
+  void cAllegro::Release_Resource(std::string name, int type) {
+    std::map<std::string, sAsset>::iterator asset = this->assets[type].find(name);
+    if ((asset != this->assets[type].end()) && (asset->second.refs > 0)) {
+      asset->second.refs--;
+    }
+  }
+  
+  /**
+   * Frees the bitmap or sample of a resource. The resource can still be
+   * reloaded by name.
+   * @param name The name of the resource.
+   * @param type The type of the resource.
+   */
+  void cAllegro::Evict_Resource(std::string name, int type) {
+    if (type == ASSET_IMAGE) {
+      std::map<std::string, ALLEGRO_BITMAP*>::iterator image = this->images.find(name);
+      if (image == this->images.end()) {
+        return; // Not resident.
+      }
+      al_destroy_bitmap(image->second);
+      this->images.erase(image);
+      this->Unpack_Image(name);
+      this->full_redraw = true; // Last frame's draws may point at the freed bitmap.
+    }
+    else {
+      std::map<std::string, ALLEGRO_SAMPLE*>::iterator sound = this->sounds.find(name);
+      if (sound == this->sounds.end()) {
+        return;
+      }
+      this->Release_Voices(sound->second);
+      al_destroy_sample(sound->second);
+      this->sounds.erase(sound);
+    }
+    this->cache_bytes -= this->assets[type][name].bytes;
+  }
+  
+  /**
+   * Evicts the least recently used resources until the cache fits into its
+   * budget. Resources that are referenced or were used this frame are kept.
+   * This is called once at the end of every frame.
+   */
+  void cAllegro::Trim_Cache() {
+    while ((this->cache_budget > 0) && (this->cache_bytes > this->cache_budget)) {
+      std::string oldest = "";
+      int oldest_type = ASSET_IMAGE;
+      int oldest_tick = this->cache_tick;
+      for (int type = 0; type < ASSET_TYPE_COUNT; type++) {
+        std::map<std::string, sAsset>& assets = this->assets[type];
+        for (std::map<std::string, sAsset>::iterator i = assets.begin(); i != assets.end(); ++i) {
+          sAsset& asset = i->second;
+          bool resident = (type == ASSET_IMAGE) ? (this->images.find(i->first) != this->images.end()) : (this->sounds.find(i->first) != this->sounds.end());
+          if (resident && (asset.refs == 0) && (asset.last_used < oldest_tick)) {
+            oldest = i->first;
+            oldest_type = type;
+            oldest_tick = asset.last_used;
           }
         }
-        else {
-          throw std::string("Could not load track " + name + ".");
-        }
+      }
+      if (oldest.length() == 0) {
+        break; // Everything left is in use.
+      }
+      this->Evict_Resource(oldest, oldest_type);
+      this->cache_evictions++;
+    }
+    this->cache_tick++;
+  }
+  
+  /**
+   * Orders resources so that the tallest bitmaps come first.
+   * @param a The first resource.
+   * @param b The second resource.
+   * @return True if a is taller than b.
+   */
+  bool cAllegro::Compare_Resource_Height(const sResource& a, const sResource& b) {
+    int a_height = a.bitmap ? al_get_bitmap_height(a.bitmap) : 0;
+    int b_height = b.bitmap ? al_get_bitmap_height(b.bitmap) : 0;
+    return (a_height > b_height);
+  }
+  
+  /**
+   * Copies a bitmap into an atlas page using shelf packing. The bitmap is
+   * freed and replaced with a sub-bitmap of the page. Large bitmaps are left
+   * alone.
+   * @param name The name of the image.
+   * @param bitmap The decoded bitmap.
+   * @return The bitmap to draw the image with.
+   * @throws An error if an atlas page could not be created.
+   */
+  ALLEGRO_BITMAP* cAllegro::Pack_Image(std::string name, ALLEGRO_BITMAP* bitmap) {
+    int width = al_get_bitmap_width(bitmap);
+    int height = al_get_bitmap_height(bitmap);
+    if ((width > ATLAS_IMAGE_MAX) || (height > ATLAS_IMAGE_MAX)) {
+      return bitmap;
+    }
+    ALLEGRO_BITMAP* target = al_get_target_bitmap();
+    int slot_w = width + ATLAS_PADDING;
+    int slot_h = height + ATLAS_PADDING;
+    int page_count = this->atlas.size();
+    int page_index = 0;
+    int free_index = -1;
+    for (; page_index < page_count; page_index++) {
+      sAtlas_Page& page = this->atlas[page_index];
+      if (!page.bitmap) {
+        free_index = (free_index == -1) ? page_index : free_index;
+        continue;
+      }
+      if ((page.shelf_x + slot_w > ATLAS_SIZE) && (page.shelf_y + page.shelf_h + slot_h <= ATLAS_SIZE)) {
+        // Start a new shelf.
+        page.shelf_y += page.shelf_h;
+        page.shelf_x = 0;
+        page.shelf_h = 0;
+      }
+      if ((page.shelf_x + slot_w <= ATLAS_SIZE) && (page.shelf_y + slot_h <= ATLAS_SIZE)) {
+        break;
+      }
+    }
+    if (page_index == page_count) { // Need a new page.
+      sAtlas_Page page;
+      page.bitmap = al_create_bitmap(ATLAS_SIZE, ATLAS_SIZE);
+      if (!page.bitmap) {
+        throw std::string("Could not create atlas page for " + name + ".");
+      }
+      page.shelf_x = 0;
+      page.shelf_y = 0;
+      page.shelf_h = 0;
+      page.image_count = 0;
+      al_set_target_bitmap(page.bitmap);
+      al_clear_to_color(al_map_rgba(0, 0, 0, 0));
+      if (free_index != -1) {
+        page_index = free_index;
+        this->atlas[page_index] = page;
+      }
+      else {
+        this->atlas.push_back(page);
+      }
+    }
+    sAtlas_Page& page = this->atlas[page_index];
+    int x = page.shelf_x;
+    int y = page.shelf_y;
+    // Copy the pixels exactly, alpha included.
+    int op, src, dst;
+    al_get_blender(&op, &src, &dst);
+    al_set_target_bitmap(page.bitmap);
+    al_set_blender(ALLEGRO_ADD, ALLEGRO_ONE, ALLEGRO_ZERO);
+    al_draw_bitmap(bitmap, x, y, 0);
+    al_set_blender(op, src, dst);
+    al_set_target_bitmap(target);
+    ALLEGRO_BITMAP* sub_bitmap = al_create_sub_bitmap(page.bitmap, x, y, width, height);
+    if (!sub_bitmap) {
+      return bitmap;
+    }
+    al_destroy_bitmap(bitmap);
+    page.shelf_x += slot_w;
+    page.shelf_h = (slot_h > page.shelf_h) ? slot_h : page.shelf_h;
+    page.image_count++;
+    this->atlas_slots[name] = page_index;
+    return sub_bitmap;
+  }
+  
+  /**
+   * Releases an image's slot in the atlas. A page is freed once all of its
+   * images are gone. The sub-bitmap must already be destroyed.
+   * @param name The name of the image.
+   */
+  void cAllegro::Unpack_Image(std::string name) {
+    if (this->atlas_slots.find(name) != this->atlas_slots.end()) {
+      sAtlas_Page& page = this->atlas[this->atlas_slots[name]];
+      this->atlas_slots.erase(name);
+      page.image_count--;
+      if (page.image_count == 0) {
+        al_destroy_bitmap(page.bitmap);
+        page.bitmap = NULL;
       }
     }
   }
@@ -295,6 +1835,12 @@ namespace Codeloader {
   void cAllegro::Load_Font(std::string name) {
     ALLEGRO_FONT* font = al_load_font(std::string(this->root + "/" + name).c_str(), FONT_SIZE, 0);
     if (font) {
+      // Text images were rendered with the old font.
+      this->Wait_For_Renderer();
+      this->Clear_Text_Cache();
+      if (this->font) {
+        al_destroy_font(this->font);
+      }
       this->font = font;
     }
     else {
@@ -447,29 +1993,28 @@ namespace Codeloader {
   void cAllegro::Process_Control_Pad(ALLEGRO_EVENT& event, cConsole* console) {
     if (this->gamepads.find(event.joystick.id) != this->gamepads.end()) {
       int input_id = this->gamepads[event.joystick.id];
-      sInput& input = console->inputs[input_id];
       if (event.joystick.axis == AXIS_X) {
         if (event.joystick.pos < 0) {
-          input.left = true;
+          console->Push_Input(input_id, BUTTON_LEFT, true);
         }
         else if (event.joystick.pos > 0) {
-          input.right = true;
+          console->Push_Input(input_id, BUTTON_RIGHT, true);
         }
         else {
-          input.left = false;
-          input.right = false;
+          console->Push_Input(input_id, BUTTON_LEFT, false);
+          console->Push_Input(input_id, BUTTON_RIGHT, false);
         }
       }
       else if (event.joystick.axis == AXIS_Y) {
         if (event.joystick.pos < 0) {
-          input.up = true;
+          console->Push_Input(input_id, BUTTON_UP, true);
         }
         else if (event.joystick.pos > 0) {
-          input.down = true;
+          console->Push_Input(input_id, BUTTON_DOWN, true);
         }
         else {
-          input.up = false;
-          input.down = false;
+          console->Push_Input(input_id, BUTTON_UP, false);
+          console->Push_Input(input_id, BUTTON_DOWN, false);
         }
       }
     }
@@ -484,13 +2029,11 @@ namespace Codeloader {
   void cAllegro::Process_Gamepad(ALLEGRO_EVENT& event, cConsole* console, bool down) {
     if (this->gamepads.find(event.joystick.id) != this->gamepads.end()) {
       int input_id = this->gamepads[event.joystick.id];
-      sInput& input = console->inputs[input_id];
       int button_count = this->button_map.size();
       for (int button_index = 0; button_index < button_count; button_index++) {
         int button = this->button_map[button_index];
         if (event.joystick.button == button) {
-          bool* buttons = (bool*)(&input + BUTTONS_START); // Assuming dealing with bytes.
-          buttons[button_index] = down;
+          console->Push_Input(input_id, BUTTONS_START + button_index, down);
           break;
         }
       }
@@ -504,45 +2047,48 @@ namespace Codeloader {
    * @param down If a key was pressed down.
    */
   void cAllegro::Process_Keyboard(ALLEGRO_EVENT& event, cConsole* console, bool down) {
-    sInput& input = console->inputs[KEYBOARD_CTRL];
+    int button = -1;
     switch (event.keyboard.keycode) {
       case ALLEGRO_KEY_LEFT:
-        input.left = down;
+        button = BUTTON_LEFT;
         break;
       case ALLEGRO_KEY_RIGHT:
-        input.right = down;
+        button = BUTTON_RIGHT;
         break;
       case ALLEGRO_KEY_UP:
-        input.up = down;
+        button = BUTTON_UP;
         break;
       case ALLEGRO_KEY_DOWN:
-        input.down = down;
+        button = BUTTON_DOWN;
         break;
       case ALLEGRO_KEY_Z:
-        input.action = down;
+        button = BUTTON_ACTION;
         break;
       case ALLEGRO_KEY_X:
-        input.fire_1 = down;
+        button = BUTTON_FIRE_1;
         break;
       case ALLEGRO_KEY_C:
-        input.fire_2 = down;
+        button = BUTTON_FIRE_2;
         break;
       case ALLEGRO_KEY_V:
-        input.fire_3 = down;
+        button = BUTTON_FIRE_3;
         break;
       case ALLEGRO_KEY_ENTER:
-        input.start = down;
+        button = BUTTON_START;
         break;
       case ALLEGRO_KEY_RSHIFT:
-        input.select = down;
+        button = BUTTON_SELECT;
         break;
       case ALLEGRO_KEY_A:
-        input.l_button = down;
+        button = BUTTON_L;
         break;
       case ALLEGRO_KEY_S:
-        input.r_button = down;
+        button = BUTTON_R;
         break;
     }
+    if (button != -1) {
+      console->Push_Input(KEYBOARD_CTRL, button, down);
+    }
   }
   
   /**
@@ -619,12 +2165,72 @@ namespace Codeloader {
    * Renders the screen.
    */
   void cAllegro::Render_Screen() {
+    this->Upscale_Screen();
+    // Timed on its own so the upscale shows up separately.
+    double start = this->profiler.Start_Timer();
+    al_flip_display();
+    this->profiler.Stop_Timer(cProfiler::STAGE_RENDER_SCREEN, start);
+  }
+
+  /**
+   * Scales the screen onto the backbuffer. Nearest mode falls back to the
+   * filtered stretch if the window is smaller than the screen.
+   */
+  void cAllegro::Upscale_Screen() {
+    cScope_Timer timer(&this->profiler, cProfiler::STAGE_UPSCALE);
     ALLEGRO_BITMAP* backbuffer = al_get_backbuffer(this->display);
     al_set_target_bitmap(backbuffer);
+    if ((this->scale_mode == SCALE_NEAREST) && this->Upscale_Nearest(backbuffer)) {
+      return;
+    }
     int width = al_get_bitmap_width(backbuffer);
     int height = al_get_bitmap_height(backbuffer);
     al_draw_scaled_bitmap(this->screen, 0, 0, this->screen_w, this->screen_h, 0, 0, width, height, 0);
-    al_flip_display();
+  }
+
+  /**
+   * Scales the screen by the largest whole number that fits the backbuffer,
+   * centered with black bars. Each row is widened once and then copied down.
+   * @param backbuffer The backbuffer. It must be the target.
+   * @return True if the screen was drawn.
+   */
+  bool cAllegro::Upscale_Nearest(ALLEGRO_BITMAP* backbuffer) {
+    int width = al_get_bitmap_width(backbuffer);
+    int height = al_get_bitmap_height(backbuffer);
+    int scale_x = width / this->screen_w;
+    int scale_y = height / this->screen_h;
+    int scale = (scale_x < scale_y) ? scale_x : scale_y;
+    if (scale < 1) {
+      return false;
+    }
+    int format = al_get_bitmap_format(this->screen);
+    if ((format != ALLEGRO_PIXEL_FORMAT_ARGB_8888) && (format != ALLEGRO_PIXEL_FORMAT_ABGR_8888)) {
+      return false;
+    }
+    int scaled_w = this->screen_w * scale;
+    int scaled_h = this->screen_h * scale;
+    al_clear_to_color(al_map_rgb(0, 0, 0));
+    ALLEGRO_LOCKED_REGION* dest = al_lock_bitmap_region(backbuffer, (width - scaled_w) / 2, (height - scaled_h) / 2, scaled_w, scaled_h, format, ALLEGRO_LOCK_WRITEONLY);
+    if (!dest) {
+      return false;
+    }
+    ALLEGRO_LOCKED_REGION* source = al_lock_bitmap(this->screen, format, ALLEGRO_LOCK_READONLY);
+    if (!source) {
+      al_unlock_bitmap(backbuffer);
+      return false;
+    }
+    this->scale_row.resize(scaled_w);
+    int row_bytes = scaled_w * sizeof(uint32_t);
+    for (int y = 0; y < this->screen_h; y++) {
+      const uint32_t* pixels = (const uint32_t*)((const char*)source->data + (y * source->pitch));
+      cCompositor::Scale_Row(&this->scale_row[0], pixels, this->screen_w, scale);
+      for (int copy = 0; copy < scale; copy++) {
+        std::memcpy((char*)dest->data + (((y * scale) + copy) * dest->pitch), &this->scale_row[0], row_bytes);
+      }
+    }
+    al_unlock_bitmap(this->screen);
+    al_unlock_bitmap(backbuffer);
+    return true;
   }
   
   /**
@@ -0,0 +1,969 @@
+#include "C_Lesh.hpp"
+
+namespace Codeloader {
+
+  /**
+   * Creates the benchmark suite with a headless Allegro subsystem and an
+   * interpreter to run on it.
+   * @param root The directory where the scripts and files are written.
+   * @param min_time The number of seconds each benchmark runs for.
+   * @throws An error if Allegro could not be initialized.
+   */
+  cBench::cBench(std::string root, double min_time) : cUtility() {
+    this->min_time = min_time;
+    this->start = 0.0;
+    this->Set_Root(root);
+    this->allegro = new cAllegro(true);
+    this->allegro->Set_Root(root);
+    this->c_lesh = new cC_Lesh(MEMORY_SIZE, this->allegro);
+    this->c_lesh->Set_Root(root);
+  }
+
+  /**
+   * Frees up the interpreter and Allegro.
+   */
+  cBench::~cBench() {
+    delete this->c_lesh;
+    delete this->allegro;
+  }
+
+  /**
+   * Runs every benchmark. The scripts each one needs are written to the root
+   * first.
+   * @throws An error if a benchmark could not be set up.
+   */
+  void cBench::Run() {
+    this->Bench_Compile();
+    this->Bench_Expressions();
+    this->Bench_Memory();
+    this->Bench_Dispatch();
+    this->Check_Collision();
+    this->Bench_Collision();
+    this->Bench_Collide_All(1000);
+    this->Bench_Collide_All(10000);
+    this->Bench_Camera();
+    this->Bench_Files();
+    this->Bench_Pixels();
+    this->Check_Blits();
+    this->Bench_Blits();
+    this->Bench_Atlas();
+  }
+
+  /**
+   * Checks if the running benchmark still has time left. The clock starts at
+   * the last record.
+   * @return True if there is time left, false otherwise.
+   */
+  bool cBench::Is_Running() {
+    return ((al_get_time() - this->start) < this->min_time);
+  }
+
+  /**
+   * Records the rate of a benchmark and restarts the clock for the next one.
+   * @param name The name of the benchmark.
+   * @param operations The number of operations done since the clock started.
+   */
+  void cBench::Record(std::string name, long long operations) {
+    double now = al_get_time();
+    double elapsed = now - this->start;
+    sBench_Result result;
+    result.name = name;
+    result.rate = (elapsed > 0.0) ? ((double)operations / elapsed) : 0.0;
+    result.baseline = 0.0;
+    this->results.push_back(result);
+    std::cout << std::left << std::setw(24) << name << " " << std::right << std::setw(16) << std::fixed << std::setprecision(1) << result.rate << " ops/s" << std::endl;
+    this->start = al_get_time();
+  }
+
+  /**
+   * Times tokenizing and compiling a generated script. The rate is in source
+   * lines.
+   * @throws An error if the script did not compile.
+   */
+  void cBench::Bench_Compile() {
+    std::vector<std::string> lines;
+    lines.push_back("var counter");
+    lines.push_back("var total");
+    lines.push_back("list items alloc 16");
+    int group_count = SCRIPT_LINES / 5;
+    for (int group_index = 0; group_index < group_count; group_index++) {
+      std::string label = "top_" + this->To_String(group_index);
+      lines.push_back("label " + label);
+      lines.push_back("set #[counter] to #[counter] + 1 * 3");
+      lines.push_back("set #[items]:[counter]:x to \"text\" cat #[total]");
+      lines.push_back("test #[counter] lt 100 and #[total] ge 0");
+      lines.push_back("move [" + label + "]");
+    }
+    lines.push_back("stop");
+    this->Write_Script("Bench_Compile.clsh", lines);
+    int line_count = lines.size();
+    long long operations = 0;
+    this->start = al_get_time();
+    while (this->Is_Running()) {
+      this->c_lesh->compiled = false;
+      this->c_lesh->Compile("Bench_Compile.clsh");
+      if (!this->c_lesh->compiled) {
+        throw std::string("Benchmark script did not compile.");
+      }
+      operations += line_count;
+    }
+    this->Record("compile_lines", operations);
+  }
+
+  /**
+   * Times evaluating an expression of each operand type, and one with a chain
+   * of operators. The expressions come out of a compiled script so they are
+   * what the interpreter would see.
+   * @throws An error if the script did not compile.
+   */
+  void cBench::Bench_Expressions() {
+    static const char* const names[] = {
+      "eval_number",
+      "eval_string",
+      "eval_value",
+      "eval_field",
+      "eval_list",
+      "eval_hash",
+      "eval_operators"
+    };
+    std::vector<std::string> lines;
+    lines.push_back("var value");
+    lines.push_back("var index");
+    lines.push_back("var key");
+    lines.push_back("var object");
+    lines.push_back("list items alloc 8");
+    lines.push_back("label eval_number");
+    lines.push_back("set #[value] to 42");
+    lines.push_back("label eval_string");
+    lines.push_back("set #[value] to \"text\"");
+    lines.push_back("label eval_value");
+    lines.push_back("set #[value] to #[index]");
+    lines.push_back("label eval_field");
+    lines.push_back("set #[value] to #[object]:x");
+    lines.push_back("label eval_list");
+    lines.push_back("set #[value] to #[items]:[index]:x");
+    lines.push_back("label eval_hash");
+    lines.push_back("set #[value] to #[object]:[key]");
+    lines.push_back("label eval_operators");
+    lines.push_back("set #[value] to #[index] + 3 * 2 - 1 rem 5");
+    lines.push_back("stop");
+    this->Write_Script("Bench_Eval.clsh", lines);
+    this->c_lesh->compiled = false;
+    this->c_lesh->Compile("Bench_Eval.clsh");
+    if (!this->c_lesh->compiled) {
+      throw std::string("Expression script did not compile.");
+    }
+    int index = this->c_lesh->symtab["index"].number;
+    int key = this->c_lesh->symtab["key"].number;
+    int object = this->c_lesh->symtab["object"].number;
+    int items = this->c_lesh->symtab["items"].number;
+    this->Set_Number(this->c_lesh->memory[index].value, 3);
+    this->Set_String(this->c_lesh->memory[key].value, "x");
+    this->Set_Field_Number(this->c_lesh->memory[object].fields, "x", 7);
+    this->Set_Field_Number(this->c_lesh->memory[items + 3].fields, "x", 9);
+    int name_count = sizeof(names) / sizeof(names[0]);
+    for (int name_index = 0; name_index < name_count; name_index++) {
+      sBlock& block = this->c_lesh->memory[this->c_lesh->symtab[names[name_index]].number];
+      long long operations = 0;
+      this->start = al_get_time();
+      while (this->Is_Running()) {
+        for (int op_index = 0; op_index < BATCH_SIZE; op_index++) {
+          this->c_lesh->Eval_Expression(block, 1);
+        }
+        operations += BATCH_SIZE;
+      }
+      this->Record(names[name_index], operations);
+    }
+  }
+
+  /**
+   * Times memory reads and writes of values, fields, lists and hashes. Lists
+   * and hashes read their index or key first, as the interpreter does.
+   */
+  void cBench::Bench_Memory() {
+    int value = DATA_OFFSET;
+    int index = DATA_OFFSET + 1;
+    int key = DATA_OFFSET + 2;
+    int object = DATA_OFFSET + 3;
+    int list = DATA_OFFSET + 4;
+    std::string none = "";
+    std::string field = "x";
+    this->Set_Number(this->c_lesh->memory[value].value, 1);
+    this->Set_Number(this->c_lesh->memory[index].value, 5);
+    this->Set_String(this->c_lesh->memory[key].value, "x");
+    this->Set_Field_Number(this->c_lesh->memory[object].fields, "x", 2);
+    this->Set_Field_Number(this->c_lesh->memory[object].fields, "y", 3);
+    for (int item_index = 0; item_index < 8; item_index++) {
+      this->Set_Field_Number(this->c_lesh->memory[list + item_index].fields, "x", item_index);
+    }
+    sValue data;
+    sValue var;
+    long long operations = 0;
+    this->start = al_get_time();
+    while (this->Is_Running()) {
+      for (int op_index = 0; op_index < BATCH_SIZE; op_index++) {
+        data.type = TYPE_EMPTY;
+        this->c_lesh->Read_Write_Memory(value, none, data);
+      }
+      operations += BATCH_SIZE;
+    }
+    this->Record("memory_value_read", operations);
+    operations = 0;
+    while (this->Is_Running()) {
+      for (int op_index = 0; op_index < BATCH_SIZE; op_index++) {
+        this->Set_Number(data, op_index);
+        this->c_lesh->Read_Write_Memory(value, none, data);
+      }
+      operations += BATCH_SIZE;
+    }
+    this->Record("memory_value_write", operations);
+    operations = 0;
+    while (this->Is_Running()) {
+      for (int op_index = 0; op_index < BATCH_SIZE; op_index++) {
+        data.type = TYPE_EMPTY;
+        this->c_lesh->Read_Write_Memory(object, field, data);
+      }
+      operations += BATCH_SIZE;
+    }
+    this->Record("memory_field_read", operations);
+    operations = 0;
+    while (this->Is_Running()) {
+      for (int op_index = 0; op_index < BATCH_SIZE; op_index++) {
+        this->Set_Number(data, op_index);
+        this->c_lesh->Read_Write_Memory(object, field, data);
+      }
+      operations += BATCH_SIZE;
+    }
+    this->Record("memory_field_write", operations);
+    operations = 0;
+    while (this->Is_Running()) {
+      for (int op_index = 0; op_index < BATCH_SIZE; op_index++) {
+        var.type = TYPE_EMPTY;
+        this->c_lesh->Read_Write_Memory(index, none, var);
+        data.type = TYPE_EMPTY;
+        this->c_lesh->Read_Write_Memory(list + var.number, field, data);
+      }
+      operations += BATCH_SIZE;
+    }
+    this->Record("memory_list_read", operations);
+    operations = 0;
+    while (this->Is_Running()) {
+      for (int op_index = 0; op_index < BATCH_SIZE; op_index++) {
+        var.type = TYPE_EMPTY;
+        this->c_lesh->Read_Write_Memory(key, none, var);
+        data.type = TYPE_EMPTY;
+        this->c_lesh->Read_Write_Memory(object, var.string, data);
+      }
+      operations += BATCH_SIZE;
+    }
+    this->Record("memory_hash_read", operations);
+  }
+
+  /**
+   * Times the interpreter running a compiled loop, one command at a time.
+   * @throws An error if the script did not compile.
+   */
+  void cBench::Bench_Dispatch() {
+    std::vector<std::string> lines;
+    lines.push_back("var counter");
+    lines.push_back("var total");
+    lines.push_back("label start");
+    lines.push_back("set #[counter] to #[counter] + 1");
+    lines.push_back("set #[total] to #[total] + #[counter] rem 7");
+    lines.push_back("test #[counter] lt 1000000");
+    lines.push_back("move [start]");
+    lines.push_back("set #[counter] to 0");
+    lines.push_back("move [start]");
+    this->Write_Script("Bench_Dispatch.clsh", lines);
+    this->c_lesh->compiled = false;
+    this->c_lesh->Compile("Bench_Dispatch.clsh");
+    if (!this->c_lesh->compiled) {
+      throw std::string("Dispatch script did not compile.");
+    }
+    this->c_lesh->prgm_counter = this->c_lesh->symtab["start"].number;
+    long long operations = 0;
+    this->start = al_get_time();
+    while (this->Is_Running()) {
+      for (int op_index = 0; op_index < BATCH_SIZE; op_index++) {
+        this->c_lesh->Interpret();
+      }
+      operations += BATCH_SIZE;
+    }
+    this->Record("interpret_commands", operations);
+  }
+
+  /**
+   * Times collision detection between two objects. Every other call the
+   * objects overlap.
+   */
+  void cBench::Bench_Collision() {
+    sFields sprite;
+    sFields other;
+    sFields near_other;
+    sFields results;
+    this->Fill_Hitbox(sprite, 100, 100);
+    this->Fill_Hitbox(other, 108, 104);
+    this->Fill_Hitbox(near_other, 300, 300);
+    long long operations = 0;
+    this->start = al_get_time();
+    while (this->Is_Running()) {
+      for (int op_index = 0; op_index < BATCH_SIZE; op_index++) {
+        this->c_lesh->Detect_Collision(sprite, (op_index & 1) ? other : near_other, results);
+      }
+      operations += BATCH_SIZE;
+    }
+    this->Record("detect_collision", operations);
+  }
+
+  /**
+   * Checks Detect_Collision against the version that looked up every field
+   * by name, on random pairs of objects. Boxes may be empty or inverted and
+   * now and then a field is left out. The results and errors must match.
+   * @throws An error if a pair gives different results.
+   */
+  void cBench::Check_Collision() {
+    static const char* const result_names[cConsole::HIT_RESULT_COUNT] = {
+      "left", "top", "right", "bottom", "center", "left_corner", "right_corner", "x", "y"
+    };
+    std::srand(4); // Same pairs every run.
+    int hits = 0;
+    int incomplete = 0;
+    for (int case_index = 0; case_index < CHECK_CASES; case_index++) {
+      sFields sprite;
+      sFields other;
+      this->Fill_Random_Hitbox(sprite);
+      this->Fill_Random_Hitbox(other);
+      sFields sprite_copy = sprite; // The reference adds the fields it reads.
+      sFields other_copy = other;
+      sFields expected;
+      sFields actual;
+      std::string expected_error = "";
+      std::string actual_error = "";
+      try {
+        this->Detect_Collision_Reference(sprite_copy, other_copy, expected);
+      }
+      catch (std::string error) {
+        expected_error = error;
+        incomplete++;
+      }
+      try {
+        this->c_lesh->Detect_Collision(sprite, other, actual);
+      }
+      catch (std::string error) {
+        actual_error = error;
+      }
+      bool match = (actual_error == expected_error) && (actual.size() == expected.size());
+      for (int result_index = 0; match && (result_index < cConsole::HIT_RESULT_COUNT); result_index++) {
+        match = (actual[result_names[result_index]].number == expected[result_names[result_index]].number);
+      }
+      if (!match) {
+        throw std::string("Collision check failed on case " + this->To_String(case_index) + ".");
+      }
+      hits += (expected["left"].number || expected["top"].number || expected["right"].number || expected["bottom"].number);
+    }
+    std::cout << "collision_check: " << CHECK_CASES << " pairs match, " << hits << " hits, " << incomplete << " incomplete." << std::endl;
+  }
+
+  /**
+   * Detects a collision the way Detect_Collision did before the hit boxes
+   * were read in one pass. It is kept to check the current one against.
+   * Missing width and height fields are added as 0.
+   * @param sprite The sprite that is colliding with the other object.
+   * @param other The other sprite.
+   * @param results The results object.
+   * @throws An error if an object is incomplete.
+   */
+  void cBench::Detect_Collision_Reference(sFields& sprite, sFields& other, sFields& results) {
+    this->Set_Field_Number(results, "left", 0);
+    this->Set_Field_Number(results, "top", 0);
+    this->Set_Field_Number(results, "right", 0);
+    this->Set_Field_Number(results, "bottom", 0);
+    this->Set_Field_Number(results, "center", 0);
+    this->Set_Field_Number(results, "left_corner", 0);
+    this->Set_Field_Number(results, "right_corner", 0);
+    this->Set_Field_Number(results, "x", 0);
+    this->Set_Field_Number(results, "y", 0);
+    if (!this->Does_Field_Exist(sprite, "left") ||
+        !this->Does_Field_Exist(sprite, "top") ||
+        !this->Does_Field_Exist(sprite, "right") ||
+        !this->Does_Field_Exist(sprite, "bottom") ||
+        !this->Does_Field_Exist(sprite, "cdelta_x") ||
+        !this->Does_Field_Exist(sprite, "cdelta_y") ||
+        !this->Does_Field_Exist(sprite, "size_x") ||
+        !this->Does_Field_Exist(sprite, "size_y") ||
+        !this->Does_Field_Exist(sprite, "scale")) {
+      throw std::string("Sprite object missing field in collision.");
+    }
+    if (!this->Does_Field_Exist(other, "left") ||
+        !this->Does_Field_Exist(other, "top") ||
+        !this->Does_Field_Exist(other, "right") ||
+        !this->Does_Field_Exist(other, "bottom") ||
+        !this->Does_Field_Exist(other, "x") ||
+        !this->Does_Field_Exist(other, "y") ||
+        !this->Does_Field_Exist(other, "size_x") ||
+        !this->Does_Field_Exist(other, "size_y") ||
+        !this->Does_Field_Exist(other, "scale")) {
+      throw std::string("Other sprite object missing field in collision.");
+    }
+    int hmap_width = sprite["right"].number - sprite["left"].number + 1;
+    int hmap_height = sprite["bottom"].number - sprite["top"].number + 1;
+    int delta_x = (int)((float)hmap_width * ((float)sprite["cdelta_x"].number / 100.0));
+    int delta_y = (int)((float)hmap_height * ((float)sprite["cdelta_y"].number / 100.0));
+    // Create 12 collision points. The middle collision point is important.
+    sPoint t1 = { sprite["left"].number + delta_x, sprite["top"].number };
+    sPoint t2 = { sprite["right"].number - delta_x, sprite["top"].number };
+    sPoint tc = { sprite["left"].number + (int)((float)hmap_width / 2.0), sprite["top"].number };
+    sPoint l1 = { sprite["left"].number, sprite["top"].number + delta_y };
+    sPoint l2 = { sprite["left"].number, sprite["bottom"].number - delta_y };
+    sPoint lc = { sprite["left"].number, sprite["top"].number + (int)((float)hmap_height / 2.0) };
+    sPoint r1 = { sprite["right"].number, sprite["top"].number + delta_y };
+    sPoint r2 = { sprite["right"].number, sprite["bottom"].number - delta_y };
+    sPoint rc = { sprite["right"].number, sprite["top"].number + (int)((float)hmap_height / 2.0) };
+    sPoint b1 = { sprite["left"].number + delta_x, sprite["bottom"].number };
+    sPoint b2 = { sprite["right"].number - delta_x, sprite["bottom"].number };
+    sPoint bc = { sprite["left"].number + (int)((float)hmap_width / 2.0), sprite["bottom"].number };
+    sPoint bl = { sprite["left"].number, sprite["bottom"].number };
+    sPoint br = { sprite["right"].number, sprite["bottom"].number };
+    // Determine which face was hit.
+    sBox other_hmap;
+    other_hmap.left = other["left"].number;
+    other_hmap.top = other["top"].number;
+    other_hmap.right = other["right"].number;
+    other_hmap.bottom = other["bottom"].number;
+    cConsole* console = this->c_lesh;
+    if (console->Point_In_Box(t1, other_hmap) || console->Point_In_Box(t2, other_hmap) || console->Point_In_Box(tc, other_hmap)) {
+      results["top"].number = 1;
+      results["center"].number = (int)console->Point_In_Box(tc, other_hmap);
+      results["y"].number = other["y"].number + (other["height"].number * other["size_y"].number * other["scale"].number);
+    }
+    if (console->Point_In_Box(l1, other_hmap) || console->Point_In_Box(l2, other_hmap) || console->Point_In_Box(lc, other_hmap)) {
+      results["left"].number = 1;
+      results["center"].number = (int)console->Point_In_Box(lc, other_hmap);
+      results["x"].number = other["x"].number + (other["width"].number * other["size_x"].number * other["scale"].number);
+    }
+    if (console->Point_In_Box(r1, other_hmap) || console->Point_In_Box(r2, other_hmap) || console->Point_In_Box(rc, other_hmap)) {
+      results["right"].number = 1;
+      results["center"].number = (int)console->Point_In_Box(rc, other_hmap);
+      results["x"].number = other["x"].number - (sprite["width"].number * sprite["size_x"].number * sprite["scale"].number);
+    }
+    if (console->Point_In_Box(b1, other_hmap) || console->Point_In_Box(b2, other_hmap) || console->Point_In_Box(bc, other_hmap)) {
+      results["bottom"].number = 1;
+      results["center"].number = (int)console->Point_In_Box(bc, other_hmap);
+      results["y"].number = other["y"].number - (sprite["height"].number * sprite["size_y"].number * sprite["scale"].number);
+      // Also detect bottom right and bottom left hit.
+      results["left_corner"].number = (int)console->Point_In_Box(bl, other_hmap);
+      results["right_corner"].number = (int)console->Point_In_Box(br, other_hmap);
+    }
+  }
+
+  /**
+   * Fills an object with random collision fields. One field in forty is left
+   * out, and the boxes are small enough that they often overlap.
+   * @param object The object to fill.
+   */
+  void cBench::Fill_Random_Hitbox(sFields& object) {
+    static const char* const field_names[cConsole::HITBOX_FIELD_COUNT] = {
+      "left", "top", "right", "bottom", "cdelta_x", "cdelta_y", "x", "y",
+      "width", "height", "size_x", "size_y", "scale"
+    };
+    for (int field_index = 0; field_index < cConsole::HITBOX_FIELD_COUNT; field_index++) {
+      if ((std::rand() % 40) != 0) {
+        this->Set_Field_Number(object, field_names[field_index], (std::rand() % 101) - 50);
+      }
+    }
+    if (this->Does_Field_Exist(object, "left") && this->Does_Field_Exist(object, "right")) {
+      object["right"].number = object["left"].number + (std::rand() % 64) - 3; // Sometimes inverted.
+    }
+    if (this->Does_Field_Exist(object, "top") && this->Does_Field_Exist(object, "bottom")) {
+      object["bottom"].number = object["top"].number + (std::rand() % 64) - 3;
+    }
+    if (this->Does_Field_Exist(object, "cdelta_x")) {
+      object["cdelta_x"].number = std::rand() % 61;
+    }
+    if (this->Does_Field_Exist(object, "cdelta_y")) {
+      object["cdelta_y"].number = std::rand() % 61;
+    }
+  }
+
+  /**
+   * Times collision between every pair of a group of objects. They are
+   * scattered so there are about as many neighbors at any count.
+   * @param count The number of objects.
+   */
+  void cBench::Bench_Collide_All(int count) {
+    int span = (int)std::sqrt((double)count) * 24;
+    int results = DATA_OFFSET + count;
+    std::srand(1); // Same layout every run.
+    for (int object_index = 0; object_index < count; object_index++) {
+      sFields& object = this->c_lesh->memory[DATA_OFFSET + object_index].fields;
+      object.clear();
+      this->Fill_Hitbox(object, std::rand() % span, std::rand() % span);
+    }
+    long long operations = 0;
+    this->start = al_get_time();
+    while (this->Is_Running()) {
+      this->c_lesh->Collide_All(this->c_lesh->memory, MEMORY_SIZE, DATA_OFFSET, count, results, count);
+      operations++;
+    }
+    this->Record("collide_all_" + this->To_String(count), operations);
+  }
+
+  /**
+   * Times focusing the camera on a sprite that walks across the level.
+   */
+  void cBench::Bench_Camera() {
+    static const char* const camera_names[] = {
+      "x", "y", "limit_x", "limit_y", "upper_bound", "bkg_x1", "bkg_x2",
+      "bkg_y1", "bkg_y2", "x_speed", "y_speed", "x_direction", "y_direction"
+    };
+    sFields camera;
+    sFields sprite;
+    int name_count = sizeof(camera_names) / sizeof(camera_names[0]);
+    for (int name_index = 0; name_index < name_count; name_index++) {
+      this->Set_Field_Number(camera, camera_names[name_index], 0);
+    }
+    this->Set_Field_Number(camera, "limit_x", 4000);
+    this->Set_Field_Number(camera, "limit_y", 600);
+    this->Set_Field_Number(camera, "bkg_x2", this->c_lesh->screen_w);
+    this->Set_Field_Number(camera, "bkg_y2", this->c_lesh->screen_h);
+    this->Set_Field_Number(camera, "x_speed", 1);
+    this->Set_Field_Number(camera, "y_speed", 1);
+    this->Set_Field_Number(sprite, "x", 0);
+    this->Set_Field_Number(sprite, "y", 200);
+    this->Set_Field_Number(sprite, "width", 16);
+    this->Set_Field_Number(sprite, "height", 16);
+    sValue& sprite_x = sprite["x"];
+    long long operations = 0;
+    this->start = al_get_time();
+    while (this->Is_Running()) {
+      for (int op_index = 0; op_index < BATCH_SIZE; op_index++) {
+        sprite_x.number = (sprite_x.number + 3) % 4000;
+        this->c_lesh->Focus_Camera(camera, sprite);
+      }
+      operations += BATCH_SIZE;
+    }
+    this->Record("focus_camera", operations);
+  }
+
+  /**
+   * Times saving a block of objects to a file and loading it back. The rate is
+   * in records.
+   */
+  void cBench::Bench_Files() {
+    int source = DATA_OFFSET;
+    int dest = DATA_OFFSET + FILE_RECORDS;
+    for (int record_index = 0; record_index < FILE_RECORDS; record_index++) {
+      sFields& object = this->c_lesh->memory[source + record_index].fields;
+      object.clear();
+      this->Fill_Hitbox(object, record_index, record_index * 2);
+      this->Set_Field_String(object, "name", "object_" + this->To_String(record_index));
+    }
+    long long operations = 0;
+    this->start = al_get_time();
+    while (this->Is_Running()) {
+      this->c_lesh->Save_File("Bench_Records.txt", this->c_lesh->memory, MEMORY_SIZE, source, FILE_RECORDS);
+      this->c_lesh->Load_File("Bench_Records.txt", this->c_lesh->memory, MEMORY_SIZE, dest);
+      operations += FILE_RECORDS;
+    }
+    this->Record("file_round_trip", operations);
+  }
+
+  /**
+   * Times the compositor's blend kernels and the upscaler's row stretch. The
+   * rate is in destination pixels.
+   */
+  void cBench::Bench_Pixels() {
+    std::vector<uint32_t> source(PIXEL_COUNT);
+    std::vector<uint32_t> dest(PIXEL_COUNT * 4);
+    for (int pixel_index = 0; pixel_index < PIXEL_COUNT; pixel_index++) {
+      uint32_t alpha = (pixel_index * 7) & 0xFF; // Clear, opaque and in between.
+      uint32_t shade = (alpha * 3) / 4;
+      source[pixel_index] = (alpha << 24) | (shade << 16) | (shade << 8) | shade;
+      dest[pixel_index] = 0xFF204060;
+    }
+    long long operations = 0;
+    this->start = al_get_time();
+    while (this->Is_Running()) {
+      cCompositor::Blend_Row_Scalar(&dest[0], &source[0], PIXEL_COUNT);
+      operations += PIXEL_COUNT;
+    }
+    this->Record("blend_pixels_scalar", operations);
+    operations = 0;
+    while (this->Is_Running()) {
+      this->allegro->compositor.Blend_Row(&dest[0], &source[0], PIXEL_COUNT);
+      operations += PIXEL_COUNT;
+    }
+    this->Record("blend_pixels_" + this->allegro->compositor.Get_Kernel_Name(), operations);
+    for (int scale = 2; scale <= 4; scale++) {
+      operations = 0;
+      while (this->Is_Running()) {
+        cCompositor::Scale_Row(&dest[0], &source[0], PIXEL_COUNT, scale);
+        operations += PIXEL_COUNT * scale;
+      }
+      this->Record("scale_pixels_x" + this->To_String(scale), operations);
+    }
+  }
+
+  /**
+   * Checks that the compositor draws the same pixels as Allegro. Random
+   * sprites, some flipped or doubled, are drawn over the same random screen
+   * twice, once with Allegro and once with cCompositor::Blit, and the bytes
+   * are compared. Allegro blends in floating point so a channel may round
+   * the other way, but never by more than the tolerance.
+   * @throws An error if the screens differ or the bitmaps could not be made.
+   */
+  void cBench::Check_Blits() {
+    if (!this->allegro->compositor.Is_Ready()) {
+      throw std::string("Compositor is not ready for the blit check.");
+    }
+    std::vector<sImage> sprites;
+    this->Create_Sprites(sprites);
+    std::srand(3);
+    ALLEGRO_BITMAP* expected = this->Create_Pixels(SCREEN_W, SCREEN_H);
+    std::srand(3); // Same background.
+    ALLEGRO_BITMAP* actual = this->Create_Pixels(SCREEN_W, SCREEN_H);
+    int blits = 0;
+    if (expected && actual) {
+      this->Draw_Sprites(expected, sprites, false);
+      blits = this->Draw_Sprites(actual, sprites, true);
+    }
+    ALLEGRO_LOCKED_REGION* expected_pixels = expected ? al_lock_bitmap(expected, ALLEGRO_PIXEL_FORMAT_ARGB_8888, ALLEGRO_LOCK_READONLY) : NULL;
+    ALLEGRO_LOCKED_REGION* actual_pixels = actual ? al_lock_bitmap(actual, ALLEGRO_PIXEL_FORMAT_ARGB_8888, ALLEGRO_LOCK_READONLY) : NULL;
+    int differ = 0;
+    int largest = 0;
+    if (expected_pixels && actual_pixels) {
+      for (int y = 0; y < SCREEN_H; y++) {
+        const unsigned char* expected_row = (const unsigned char*)expected_pixels->data + (y * expected_pixels->pitch);
+        const unsigned char* actual_row = (const unsigned char*)actual_pixels->data + (y * actual_pixels->pitch);
+        for (int byte_index = 0; byte_index < (SCREEN_W * 4); byte_index++) {
+          int difference = std::abs((int)expected_row[byte_index] - (int)actual_row[byte_index]);
+          differ += (difference > 0);
+          largest = (difference > largest) ? difference : largest;
+        }
+      }
+    }
+    if (expected_pixels) {
+      al_unlock_bitmap(expected);
+    }
+    if (actual_pixels) {
+      al_unlock_bitmap(actual);
+    }
+    bool locked = (expected_pixels && actual_pixels);
+    if (expected) {
+      al_destroy_bitmap(expected);
+    }
+    if (actual) {
+      al_destroy_bitmap(actual);
+    }
+    this->Destroy_Sprites(sprites);
+    if (!locked) {
+      throw std::string("Could not make the screens for the blit check.");
+    }
+    if (blits != SPRITE_COUNT) {
+      throw std::string("Only " + this->To_String(blits) + " sprites went through the compositor.");
+    }
+    std::cout << "blit_check: " << differ << " of " << (SCREEN_W * SCREEN_H * 4) << " bytes differ by at most " << largest << "." << std::endl;
+    if (largest > BLIT_TOLERANCE) {
+      throw std::string("Compositor does not match Allegro.");
+    }
+  }
+
+  /**
+   * Times drawing random sprites onto a screen with Allegro and with the
+   * compositor. The rate is in sprites.
+   * @throws An error if the bitmaps could not be made.
+   */
+  void cBench::Bench_Blits() {
+    std::vector<sImage> sprites;
+    this->Create_Sprites(sprites);
+    ALLEGRO_BITMAP* screen = this->Create_Pixels(SCREEN_W, SCREEN_H);
+    if (!screen) {
+      this->Destroy_Sprites(sprites);
+      throw std::string("Could not make the screen for the blit benchmark.");
+    }
+    long long operations = 0;
+    this->start = al_get_time();
+    while (this->Is_Running()) {
+      this->Draw_Sprites(screen, sprites, false);
+      operations += SPRITE_COUNT;
+    }
+    this->Record("blit_sprites_allegro", operations);
+    operations = 0;
+    while (this->Is_Running()) {
+      this->Draw_Sprites(screen, sprites, true);
+      operations += SPRITE_COUNT;
+    }
+    this->Record("blit_sprites_" + this->allegro->compositor.Get_Kernel_Name(), operations);
+    al_destroy_bitmap(screen);
+    this->Destroy_Sprites(sprites);
+  }
+
+  /**
+   * Times rendering a scene through Render_Layer, first with the sprite
+   * images as standalone bitmaps and then packed into atlas pages. The scene
+   * draws each image many times over, as a game would. The rate is in frames.
+   * @throws An error if the sprites could not be made or packed.
+   */
+  void cBench::Bench_Atlas() {
+    std::vector<sImage> sprites;
+    this->Create_Sprites(sprites);
+    std::vector<sImage> scene;
+    std::srand(4);
+    for (int scene_index = 0; scene_index < SCENE_SPRITES; scene_index++) {
+      sImage image = sprites[std::rand() % SPRITE_COUNT];
+      image.x = std::rand() % SCREEN_W; // All on the screen so every one is drawn.
+      image.y = std::rand() % SCREEN_H;
+      scene.push_back(image);
+    }
+    this->Render_Scene(scene, "render_standalone");
+    std::map<ALLEGRO_BITMAP*, ALLEGRO_BITMAP*> packed;
+    std::string error = "";
+    try {
+      for (int sprite_index = 0; sprite_index < SPRITE_COUNT; sprite_index++) {
+        ALLEGRO_BITMAP* bitmap = sprites[sprite_index].bitmap;
+        sprites[sprite_index].bitmap = this->allegro->Pack_Image("bench_sprite_" + this->To_String(sprite_index), bitmap);
+        packed[bitmap] = sprites[sprite_index].bitmap;
+      }
+      for (int scene_index = 0; scene_index < SCENE_SPRITES; scene_index++) {
+        scene[scene_index].bitmap = packed[scene[scene_index].bitmap];
+      }
+      this->Render_Scene(scene, "render_atlas");
+    }
+    catch (std::string message) {
+      error = message;
+    }
+    // The sub-bitmaps go before their slots are released.
+    this->Destroy_Sprites(sprites);
+    for (int sprite_index = 0; sprite_index < SPRITE_COUNT; sprite_index++) {
+      this->allegro->Unpack_Image("bench_sprite_" + this->To_String(sprite_index));
+    }
+    if (error.length() > 0) {
+      throw error;
+    }
+  }
+
+  /**
+   * Renders a scene onto the screen until the benchmark runs out of time,
+   * then records it and prints the draw calls, batches and time of a frame.
+   * @param scene The images of the scene, drawn as one layer.
+   * @param name The name of the benchmark.
+   */
+  void cBench::Render_Scene(std::vector<sImage>& scene, std::string name) {
+    sBox clip = { 0, 0, this->allegro->screen_w, this->allegro->screen_h };
+    long long frames = 0;
+    this->start = al_get_time();
+    while (this->Is_Running()) {
+      this->allegro->draw_calls = 0;
+      this->allegro->draw_batches = 0;
+      this->allegro->Clear_Screen();
+      this->allegro->Render_Layer(scene, clip);
+      frames++;
+    }
+    double frame_time = ((al_get_time() - this->start) * 1000000.0) / ((frames > 0) ? frames : 1);
+    this->Record(name, frames);
+    std::cout << name << ": " << this->allegro->draw_calls << " draw calls in " << this->allegro->draw_batches << " batches, " << std::fixed << std::setprecision(1) << frame_time << " us per frame." << std::endl;
+  }
+
+  /**
+   * Makes sprites of random premultiplied pixels scattered over and past the
+   * edges of the screen. Some are flipped or doubled.
+   * @param sprites The list that receives the sprites.
+   * @throws An error if a sprite could not be made.
+   */
+  void cBench::Create_Sprites(std::vector<sImage>& sprites) {
+    std::srand(2); // Same sprites every run.
+    for (int sprite_index = 0; sprite_index < SPRITE_COUNT; sprite_index++) {
+      sImage image;
+      image.width = (std::rand() % SPRITE_SIZE) + 1;
+      image.height = (std::rand() % SPRITE_SIZE) + 1;
+      image.bitmap = this->Create_Pixels(image.width, image.height);
+      if (!image.bitmap) {
+        this->Destroy_Sprites(sprites);
+        throw std::string("Could not make a sprite.");
+      }
+      image.scale = ((std::rand() % 4) == 0) ? 2 : 1;
+      image.x = (std::rand() % (SCREEN_W + (SPRITE_SIZE * 4))) - (SPRITE_SIZE * 2);
+      image.y = (std::rand() % (SCREEN_H + (SPRITE_SIZE * 4))) - (SPRITE_SIZE * 2);
+      image.angle = 0;
+      image.layer = LAYER_CHARACTER;
+      image.flip_x = ((std::rand() % 3) == 0);
+      image.flip_y = ((std::rand() % 3) == 0);
+      sprites.push_back(image);
+    }
+  }
+
+  /**
+   * Frees the sprites made by Create_Sprites.
+   * @param sprites The sprites.
+   */
+  void cBench::Destroy_Sprites(std::vector<sImage>& sprites) {
+    int sprite_count = sprites.size();
+    for (int sprite_index = 0; sprite_index < sprite_count; sprite_index++) {
+      al_destroy_bitmap(sprites[sprite_index].bitmap);
+    }
+    sprites.clear();
+  }
+
+  /**
+   * Makes a memory bitmap of random premultiplied ARGB pixels. A quarter are
+   * clear and a quarter are opaque.
+   * @param width The width of the bitmap.
+   * @param height The height of the bitmap.
+   * @return The bitmap or NULL if it could not be made.
+   */
+  ALLEGRO_BITMAP* cBench::Create_Pixels(int width, int height) {
+    al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
+    al_set_new_bitmap_format(ALLEGRO_PIXEL_FORMAT_ARGB_8888);
+    ALLEGRO_BITMAP* bitmap = al_create_bitmap(width, height);
+    if (!bitmap) {
+      return NULL;
+    }
+    ALLEGRO_LOCKED_REGION* region = al_lock_bitmap(bitmap, ALLEGRO_PIXEL_FORMAT_ARGB_8888, ALLEGRO_LOCK_WRITEONLY);
+    if (!region) {
+      al_destroy_bitmap(bitmap);
+      return NULL;
+    }
+    for (int y = 0; y < height; y++) {
+      uint32_t* pixels = (uint32_t*)((char*)region->data + (y * region->pitch));
+      for (int x = 0; x < width; x++) {
+        int kind = std::rand() % 4;
+        uint32_t alpha = (kind == 0) ? 0 : ((kind == 1) ? 255 : (std::rand() % 256));
+        uint32_t red = std::rand() % (alpha + 1);
+        uint32_t green = std::rand() % (alpha + 1);
+        uint32_t blue = std::rand() % (alpha + 1);
+        pixels[x] = (alpha << 24) | (red << 16) | (green << 8) | blue;
+      }
+    }
+    al_unlock_bitmap(bitmap);
+    return bitmap;
+  }
+
+  /**
+   * Draws sprites onto a screen the way Render_Layer does.
+   * @param target The screen.
+   * @param sprites The sprites.
+   * @param composite True to draw with the compositor, false to draw with Allegro.
+   * @return The number of sprites the compositor handled.
+   */
+  int cBench::Draw_Sprites(ALLEGRO_BITMAP* target, std::vector<sImage>& sprites, bool composite) {
+    sBox clip = { 0, 0, SCREEN_W, SCREEN_H };
+    int blits = 0;
+    al_set_target_bitmap(target);
+    int sprite_count = sprites.size();
+    for (int sprite_index = 0; sprite_index < sprite_count; sprite_index++) {
+      sImage& image = sprites[sprite_index];
+      if (composite) {
+        blits += this->allegro->compositor.Blit(target, image, clip);
+        continue;
+      }
+      int flags = (image.flip_x ? ALLEGRO_FLIP_HORIZONTAL : 0) | (image.flip_y ? ALLEGRO_FLIP_VERTICAL : 0);
+      if (image.scale > 1) {
+        al_draw_scaled_bitmap(image.bitmap, 0, 0, image.width, image.height, image.x, image.y, image.width * image.scale, image.height * image.scale, flags);
+      }
+      else {
+        al_draw_bitmap(image.bitmap, image.x, image.y, flags);
+      }
+    }
+    return blits;
+  }
+
+  /**
+   * Writes a script to the root.
+   * @param name The name of the script.
+   * @param lines The lines of the script.
+   * @throws An error if the script could not be written.
+   */
+  void cBench::Write_Script(std::string name, std::vector<std::string>& lines) {
+    std::ofstream file(std::string(this->root + "/" + name).c_str());
+    if (!file) {
+      throw std::string("Could not write script " + name + ".");
+    }
+    int line_count = lines.size();
+    for (int line_index = 0; line_index < line_count; line_index++) {
+      file << lines[line_index] << "\n";
+    }
+  }
+
+  /**
+   * Gives an object every field a hit box is read from. The box is 16 pixels
+   * on a side.
+   * @param object The object to fill.
+   * @param x The x coordinate of the object.
+   * @param y The y coordinate of the object.
+   */
+  void cBench::Fill_Hitbox(sFields& object, int x, int y) {
+    this->Set_Field_Number(object, "x", x);
+    this->Set_Field_Number(object, "y", y);
+    this->Set_Field_Number(object, "left", x);
+    this->Set_Field_Number(object, "top", y);
+    this->Set_Field_Number(object, "right", x + 16);
+    this->Set_Field_Number(object, "bottom", y + 16);
+    this->Set_Field_Number(object, "width", 16);
+    this->Set_Field_Number(object, "height", 16);
+    this->Set_Field_Number(object, "cdelta_x", 8);
+    this->Set_Field_Number(object, "cdelta_y", 8);
+    this->Set_Field_Number(object, "size_x", 16);
+    this->Set_Field_Number(object, "size_y", 16);
+    this->Set_Field_Number(object, "scale", 1);
+  }
+
+  /**
+   * Writes the results as JSON. The file can be used as a baseline later.
+   * @param name The name of the results file.
+   * @throws An error if the file could not be written.
+   */
+  void cBench::Write_Results(std::string name) {
+    std::ofstream file(name.c_str());
+    if (!file) {
+      throw std::string("Could not write results " + name + ".");
+    }
+    file << "{\"benchmarks\":[";
+    int result_count = this->results.size();
+    for (int result_index = 0; result_index < result_count; result_index++) {
+      sBench_Result& result = this->results[result_index];
+      file << ((result_index > 0) ? "," : "") << "\n{\"name\":\"" << result.name << "\",\"rate\":" << std::fixed << std::setprecision(1) << result.rate << "}";
+    }
+    file << "\n]}\n";
+  }
+
+  /**
+   * Compares the results against a baseline written by an earlier run. A
+   * benchmark regresses when its rate falls more than the threshold below the
+   * baseline. Benchmarks the baseline does not have are skipped.
+   * @param name The name of the baseline file.
+   * @param threshold The allowed slowdown in percent.
+   * @return The number of benchmarks that regressed.
+   * @throws An error if the baseline could not be read.
+   */
+  int cBench::Compare_Baseline(std::string name, int threshold) {
+    std::ifstream file(name.c_str());
+    if (!file) {
+      throw std::string("Could not read baseline " + name + ".");
+    }
+    std::map<std::string, double> baseline;
+    std::string pattern = "^.*\"name\":\"(\\w+)\",\"rate\":([0-9.]+).*$";
+    std::string line = "";
+    while (std::getline(file, line)) {
+      if (this->Match(pattern, line)) {
+        baseline[this->Replace_Token(pattern, "$1", line)] = std::atof(this->Replace_Token(pattern, "$2", line).c_str());
+      }
+    }
+    int regressions = 0;
+    int result_count = this->results.size();
+    for (int result_index = 0; result_index < result_count; result_index++) {
+      sBench_Result& result = this->results[result_index];
+      if (baseline.find(result.name) == baseline.end() || (baseline[result.name] <= 0.0)) {
+        continue;
+      }
+      result.baseline = baseline[result.name];
+      double change = ((result.rate - result.baseline) * 100.0) / result.baseline;
+      bool regressed = (change < -threshold);
+      if (regressed) {
+        regressions++;
+      }
+      std::cout << std::left << std::setw(24) << result.name << " " << std::right << std::showpos << std::setw(8) << std::fixed << std::setprecision(1) << change << std::noshowpos << "%" << (regressed ? "  REGRESSED" : "") << std::endl;
+    }
+    return regressions;
+  }
+
+}
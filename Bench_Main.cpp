@@ -0,0 +1,36 @@
+#include "C_Lesh.hpp"
+
+int main(int argc, char** argv) {
+  Codeloader::cBench* bench = NULL;
+  int status = 0;
+  if ((argc >= 3) && (argc <= 6)) {
+    std::string root = argv[1];
+    std::string results = argv[2];
+    int threshold = (argc >= 5) ? std::atoi(argv[4]) : 10;
+    double seconds = (argc == 6) ? std::atof(argv[5]) : 0.5;
+    try {
+      bench = new Codeloader::cBench(root, seconds);
+      bench->Run();
+      bench->Write_Results(results);
+      if (argc >= 4) {
+        int regressions = bench->Compare_Baseline(argv[3], threshold);
+        if (regressions > 0) {
+          std::cout << regressions << " benchmarks regressed more than " << threshold << "%." << std::endl;
+          status = 1;
+        }
+      }
+    }
+    catch (std::string error) {
+      std::cout << "Error: " << error.c_str() << std::endl;
+      status = 2;
+    }
+    if (bench) {
+      delete bench;
+    }
+  }
+  else {
+    std::cout << "Usage: " << argv[0] << " <root> <results> [baseline] [threshold] [seconds]" << std::endl;
+    status = 2;
+  }
+  return status;
+}
@@ -24,6 +24,7 @@ namespace Codeloader {
     { "rand", OPER_RANDOM },
     { "cos", OPER_COSINE },
     { "sin", OPER_SINE },
+    { "bit", OPER_BIT },
     { "e", TYPE_EMPTY },
     { "n", TYPE_NUMBER },
     { "s", TYPE_STRING },
@@ -53,18 +54,31 @@ namespace Codeloader {
     { "update", { CMD_UPDATE, "" } },
     { "timeout", { CMD_TIMEOUT, "<e>" } },
     { "resource", { CMD_RESOURCE, "<e>" } },
-    { "upload", { CMD_UPLOAD, "" } }
+    { "upload", { CMD_UPLOAD, "" } },
+    { "progress", { CMD_PROGRESS, "<e>" } },
+    { "cache", { CMD_CACHE, "<e>" } },
+    { "stats", { CMD_STATS, "<e>" } },
+    { "redraw", { CMD_REDRAW, "<e>" } },
+    { "tilemap", { CMD_TILEMAP, "<e> width <e> height <e> tile <e> camera <e> layer <e>" } },
+    { "draw-batch", { CMD_DRAW_BATCH, "<e> count <e>" } },
+    { "profile", { CMD_PROFILE, "<e>" } },
+    { "trace", { CMD_TRACE, "<e>" } },
+    { "compositor", { CMD_COMPOSITOR, "<e>" } },
+    { "raster", { CMD_RASTER, "<e>" } },
+    { "scaling", { CMD_SCALING, "<e>" } },
+    { "collide-all", { CMD_COLLIDE_ALL, "<e> count <e> results <e> max <e> found <e>" } },
+    { "tile-grid", { CMD_TILE_GRID, "<e> width <e> height <e> tile <e>" } },
+    { "collide-tiles", { CMD_COLLIDE_TILES, "<e> results <e>" } },
+    { "bind-camera", { CMD_BIND_CAMERA, "<e> layers <e> count <e>" } },
+    { "music-stream", { CMD_MUSIC_STREAM, "<e> samples <e> fade <e>" } },
+    { "input-mask", { CMD_INPUT_MASK, "<e> player <e>" } },
+    { "free", { CMD_FREE, "<e> count <e>" } },
+    { "persist", { CMD_PERSIST, "<e> at <e> count <e>" } }
   }),
   cConsole(allegro) {
-    // Initialize blocks.
-    this->memory = new sBlock[memory_size];
+    // Blocks are created a page at a time when first used.
+    this->memory.Resize(memory_size);
     this->memory_size = memory_size; // Record size of memory.
-    for (int block_index = 0; block_index < memory_size; block_index++) {
-      sBlock& block = this->memory[block_index];
-      block.code = 0;
-      block.value.number = 0;
-      block.value.type = this->code_table["n"];
-    }
     this->compiled = false;
     this->prgm_counter = 0;
     this->time = 0;
@@ -75,12 +89,18 @@ namespace Codeloader {
   }
 
   /**
-   * Frees up the C-Lesh object.
+   * Frees up the C-Lesh object. Persistent blocks written since the last
+   * update are committed first. Clearing the memory drops each page with its
+   * arena, so it costs a few deletes per page rather than one per field.
    */
   cC_Lesh::~cC_Lesh() {
-    if (this->memory) {
-      delete[] this->memory;
+    try {
+      this->memory.Flush();
+    }
+    catch (std::string error) {
+      // Nothing can be thrown from here. The region keeps its last commit.
     }
+    this->memory.Clear();
   }
 
   /**
@@ -88,6 +108,7 @@ namespace Codeloader {
    * @param name The of the source file.
    */
   void cC_Lesh::Compile(std::string name) {
+    cScope_Timer timer(&this->allegro->profiler, cProfiler::STAGE_COMPILE);
     // Do some cleanup.
     this->symtab.clear();
     this->tokens.clear();
@@ -351,7 +372,10 @@ namespace Codeloader {
       else { // Possible commands.
         if (this->parse_table.find(code.token) != this->parse_table.end()) {
           sParse_Obj command = this->parse_table[code.token];
-          sBlock block = this->memory[this->prgm_counter++];
+          sBlock& block = this->memory[this->prgm_counter++];
+          if (this->prgm_counter > this->memory.code_end) { // Pages with code are not dropped whole.
+            this->memory.code_end = this->prgm_counter;
+          }
           // Clear out the block.
           this->Clear_Block(block);
           // Assign block code.
@@ -509,7 +533,7 @@ namespace Codeloader {
    */
   bool cC_Lesh::Is_Operator() {
     sToken token = this->Peek_Token();
-    return this->Match("^(\\+|\\-|\\*|\\/|rem|cat|rand|cos|sin)$", token.token);
+    return this->Match("^(\\+|\\-|\\*|\\/|rem|cat|rand|cos|sin|bit)$", token.token);
   }
 
   /**
@@ -763,7 +787,7 @@ namespace Codeloader {
    * Replaces all symbols in the source file.
    */
   void cC_Lesh::Replace_Symbols() {
-    for (int cmd_index = 0; cmd_index <= this->prgm_counter; cmd_index++) {
+    for (int cmd_index = 0; cmd_index < this->prgm_counter; cmd_index++) {
       sBlock& block = this->memory[cmd_index];
       // Replace symbols in expressions.
       int exp_count = block.expressions.size();
@@ -821,11 +845,11 @@ namespace Codeloader {
     this->Set_Number(this->symtab["SCREEN_W"], this->screen_w);
     this->Set_Number(this->symtab["SCREEN_H"], this->screen_h);
     // Layers
-    this->Set_Number(this->symtab["BACKGROUND"],  1);
-    this->Set_Number(this->symtab["PLATFORM"], 2);
-    this->Set_Number(this->symtab["CHARACTER"], 3);
-    this->Set_Number(this->symtab["FOREGROUND"], 4);
-    this->Set_Number(this->symtab["OVERLAY"], 5);
+    this->Set_Number(this->symtab["BACKGROUND"], LAYER_BACKGROUND);
+    this->Set_Number(this->symtab["PLATFORM"], LAYER_PLATFORM);
+    this->Set_Number(this->symtab["CHARACTER"], LAYER_CHARACTER);
+    this->Set_Number(this->symtab["FOREGROUND"], LAYER_FOREGROUND);
+    this->Set_Number(this->symtab["OVERLAY"], LAYER_OVERLAY);
     // Input Signals
     this->Set_Number(this->symtab["NONE"], 0);
     this->Set_Number(this->symtab["PRESSED"], 1);
@@ -993,7 +1017,7 @@ namespace Codeloader {
       color.red = (unsigned char)red.number;
       color.green = (unsigned char)green.number;
       color.blue = (unsigned char)blue.number;
-      std::string value = (data.type == TYPE_NUMBER) ? this->To_String(data.number) : data.string;
+      std::string value = (data.type == TYPE_NUMBER) ? this->To_String(data.number) : (std::string)data.string;
       this->Output_Text(value, x.number, y.number, color);
     }
     else if (block.code == CMD_LOAD) { // load <address> from <string>
@@ -1016,7 +1040,7 @@ namespace Codeloader {
       sValue layer = this->Eval_Expression(block, 5);
       sValue flip_x = this->Eval_Expression(block, 6);
       sValue flip_y = this->Eval_Expression(block, 7);
-      this->Draw_Image(name.string, x.number, y.number, scale.number, angle.number, (bool)flip_x.number, (bool)flip_y.number, layer.string);
+      this->Draw_Image(name.string, x.number, y.number, scale.number, angle.number, (bool)flip_x.number, (bool)flip_y.number, layer.number);
     }
     else if (block.code == CMD_PLAY) { // play <string> mode <string>
       sValue name = this->Eval_Expression(block, 0);
@@ -1031,14 +1055,25 @@ namespace Codeloader {
     else if (block.code == CMD_INPUT) { // input <address> player <number>
       sValue address = this->Eval_Expression(block, 0);
       sValue player = this->Eval_Expression(block, 1);
-      if (this->Valid_Address(address.number)) {
+      if (!this->Valid_Address(address.number)) {
         this->Generate_Error("Invalid memory read.");
       }
-      if (this->inputs.find(player.number) != this->inputs.end()) {
+      if (this->inputs.find(player.number) == this->inputs.end()) {
         this->Generate_Error("Player number is out of bounds.");
       }
       this->Read_Input(player.number, this->memory, this->memory_size, address.number);
     }
+    else if (block.code == CMD_INPUT_MASK) { // input-mask <address> player <number>
+      sValue address = this->Eval_Expression(block, 0);
+      sValue player = this->Eval_Expression(block, 1);
+      if (!this->Valid_Address(address.number) || !this->Valid_Address(address.number + 2)) {
+        this->Generate_Error("Invalid memory read.");
+      }
+      if (this->inputs.find(player.number) == this->inputs.end()) {
+        this->Generate_Error("Player number is out of bounds.");
+      }
+      this->Read_Input_Mask(player.number, this->memory, this->memory_size, address.number);
+    }
     else if (block.code == CMD_COLLISION) { // collision <address> other <address> results <address>
       sValue sprite_addr = this->Eval_Expression(block, 0);
       sValue other_addr = this->Eval_Expression(block, 1);
@@ -1046,9 +1081,9 @@ namespace Codeloader {
       if (!this->Valid_Address(sprite_addr.number) || !this->Valid_Address(other_addr.number) || !this->Valid_Address(results_addr.number)) {
         this->Generate_Error("Collision detection invalid memory access.");
       }
-      std::map<std::string, sValue>& sprite = this->memory[sprite_addr.number].fields;
-      std::map<std::string, sValue>& other = this->memory[other_addr.number].fields;
-      std::map<std::string, sValue>& results = this->memory[results_addr.number].fields;
+      const sFields& sprite = this->memory.Peek(sprite_addr.number).fields;
+      const sFields& other = this->memory.Peek(other_addr.number).fields;
+      sFields& results = this->memory[results_addr.number].fields;
       this->Detect_Collision(sprite, other, results);
     }
     else if (block.code == CMD_FOCUS) { // focus <address> sprite <address>
@@ -1057,12 +1092,19 @@ namespace Codeloader {
       if (!this->Valid_Address(sprite_addr.number) || !this->Valid_Address(camera_addr.number)) {
         this->Generate_Error("Camera invalid memory access.");
       }
-      std::map<std::string, sValue>& sprite = this->memory[sprite_addr.number].fields;
-      std::map<std::string, sValue>& camera = this->memory[camera_addr.number].fields;
+      const sFields& sprite = this->memory.Peek(sprite_addr.number).fields;
+      sFields& camera = this->memory[camera_addr.number].fields;
       this->Focus_Camera(camera, sprite);
+      if (&camera == this->backdrop_camera) { // The backdrops were scrolled through their slots.
+        int backdrop_count = this->backdrop_slots.size();
+        for (int backdrop_index = 0; backdrop_index < backdrop_count; backdrop_index++) {
+          this->memory.Mark(this->backdrop_layers + backdrop_index);
+        }
+      }
     }
     else if (block.code == CMD_UPDATE) { // update
       this->Update_Output();
+      this->memory.Flush();
     }
     else if (block.code == CMD_TIMEOUT) { // timeout <number>
       sValue timeout = this->Eval_Expression(block, 0);
@@ -1075,6 +1117,143 @@ namespace Codeloader {
     else if (block.code == CMD_UPLOAD) { // upload
       this->Upload_Resources();
     }
+    else if (block.code == CMD_PROGRESS) { // progress <address>
+      sValue address = this->Eval_Expression(block, 0);
+      this->Read_Progress(this->memory, this->memory_size, address.number);
+    }
+    else if (block.code == CMD_CACHE) { // cache <kilobytes>
+      sValue budget = this->Eval_Expression(block, 0);
+      this->allegro->cache_budget = (budget.number > 0) ? ((long long)budget.number * 1024) : 0;
+    }
+    else if (block.code == CMD_STATS) { // stats <address>
+      sValue address = this->Eval_Expression(block, 0);
+      this->Read_Stats(this->memory, this->memory_size, address.number);
+    }
+    else if (block.code == CMD_REDRAW) { // redraw <string>
+      sValue mode = this->Eval_Expression(block, 0);
+      if ((mode.string != "dirty") && (mode.string != "full")) {
+        this->Generate_Error("Redraw mode must be dirty or full.");
+      }
+      this->allegro->Wait_For_Renderer();
+      this->allegro->dirty_mode = (mode.string == "dirty");
+      this->allegro->full_redraw = true;
+    }
+    else if (block.code == CMD_TILEMAP) { // tilemap <address> width <number> height <number> tile <number> camera <address> layer <number>
+      sValue map_addr = this->Eval_Expression(block, 0);
+      sValue width = this->Eval_Expression(block, 1);
+      sValue height = this->Eval_Expression(block, 2);
+      sValue tile = this->Eval_Expression(block, 3);
+      sValue camera_addr = this->Eval_Expression(block, 4);
+      sValue layer = this->Eval_Expression(block, 5);
+      if (!this->Valid_Address(camera_addr.number)) {
+        this->Generate_Error("Tile map invalid camera access.");
+      }
+      sFields& camera = this->memory[camera_addr.number].fields;
+      this->Draw_Tilemap(this->memory, this->memory_size, map_addr.number, width.number, height.number, tile.number, camera, layer.number);
+    }
+    else if (block.code == CMD_DRAW_BATCH) { // draw-batch <address> count <number>
+      sValue address = this->Eval_Expression(block, 0);
+      sValue count = this->Eval_Expression(block, 1);
+      this->Draw_Batch(this->memory, this->memory_size, address.number, count.number);
+    }
+    else if (block.code == CMD_PROFILE) { // profile <string>
+      sValue mode = this->Eval_Expression(block, 0);
+      if ((mode.string != "on") && (mode.string != "off") && (mode.string != "overlay")) {
+        this->Generate_Error("Profile mode must be on, off, or overlay.");
+      }
+      this->allegro->Wait_For_Renderer();
+      this->allegro->profiler.Enable(mode.string != "off", mode.string == "overlay");
+      this->allegro->full_redraw = true; // Clear away the graph.
+    }
+    else if (block.code == CMD_TRACE) { // trace <string>
+      sValue file = this->Eval_Expression(block, 0);
+      this->allegro->profiler.Set_Root(this->root);
+      this->allegro->profiler.Export_Trace(file.string);
+    }
+    else if (block.code == CMD_COMPOSITOR) { // compositor <string>
+      sValue mode = this->Eval_Expression(block, 0);
+      if ((mode.string != "on") && (mode.string != "off")) {
+        this->Generate_Error("Compositor mode must be on or off.");
+      }
+      this->allegro->Wait_For_Renderer();
+      this->allegro->compositor.enabled = (mode.string == "on");
+    }
+    else if (block.code == CMD_RASTER) { // raster <number>
+      sValue threads = this->Eval_Expression(block, 0);
+      if ((threads.number < 1) || (threads.number > cAllegro::RASTER_MAX)) {
+        this->Generate_Error("Raster threads must be 1 through " + this->To_String(cAllegro::RASTER_MAX) + ".");
+      }
+      // The render thread brings up the new workers on its next frame.
+      this->allegro->Wait_For_Renderer();
+      this->allegro->Destroy_Rasterizers();
+      this->allegro->raster_threads = threads.number;
+    }
+    else if (block.code == CMD_SCALING) { // scaling <string>
+      sValue mode = this->Eval_Expression(block, 0);
+      if ((mode.string != "nearest") && (mode.string != "filtered")) {
+        this->Generate_Error("Scaling mode must be nearest or filtered.");
+      }
+      this->allegro->Wait_For_Renderer();
+      this->allegro->scale_mode = (mode.string == "nearest") ? cAllegro::SCALE_NEAREST : cAllegro::SCALE_FILTERED;
+    }
+    else if (block.code == CMD_COLLIDE_ALL) { // collide-all <address> count <number> results <address> max <number> found <address>
+      sValue sprites_addr = this->Eval_Expression(block, 0);
+      sValue count = this->Eval_Expression(block, 1);
+      sValue results_addr = this->Eval_Expression(block, 2);
+      sValue max = this->Eval_Expression(block, 3);
+      sValue found_addr = this->Eval_Expression(block, 4);
+      if (!this->Valid_Address(found_addr.number)) {
+        this->Generate_Error("Collision invalid memory access.");
+      }
+      int found = this->Collide_All(this->memory, this->memory_size, sprites_addr.number, count.number, results_addr.number, max.number);
+      this->Set_Number(this->memory[found_addr.number].value, found);
+    }
+    else if (block.code == CMD_TILE_GRID) { // tile-grid <address> width <number> height <number> tile <number>
+      sValue map_addr = this->Eval_Expression(block, 0);
+      sValue width = this->Eval_Expression(block, 1);
+      sValue height = this->Eval_Expression(block, 2);
+      sValue tile = this->Eval_Expression(block, 3);
+      this->Build_Tile_Grid(this->memory, this->memory_size, map_addr.number, width.number, height.number, tile.number);
+    }
+    else if (block.code == CMD_COLLIDE_TILES) { // collide-tiles <address> results <address>
+      sValue sprite_addr = this->Eval_Expression(block, 0);
+      sValue results_addr = this->Eval_Expression(block, 1);
+      if (!this->Valid_Address(sprite_addr.number) || !this->Valid_Address(results_addr.number)) {
+        this->Generate_Error("Collision detection invalid memory access.");
+      }
+      const sFields& sprite = this->memory.Peek(sprite_addr.number).fields;
+      sFields& results = this->memory[results_addr.number].fields;
+      this->Collide_Tiles(sprite, results);
+    }
+    else if (block.code == CMD_BIND_CAMERA) { // bind-camera <address> layers <address> count <number>
+      sValue camera_addr = this->Eval_Expression(block, 0);
+      sValue layers_addr = this->Eval_Expression(block, 1);
+      sValue count = this->Eval_Expression(block, 2);
+      this->Bind_Camera(this->memory, this->memory_size, camera_addr.number, layers_addr.number, count.number);
+    }
+    else if (block.code == CMD_MUSIC_STREAM) { // music-stream <number> samples <number> fade <number>
+      sValue buffers = this->Eval_Expression(block, 0);
+      sValue samples = this->Eval_Expression(block, 1);
+      sValue fade = this->Eval_Expression(block, 2);
+      if ((buffers.number < 2) || (samples.number < 256) || (fade.number < 0)) {
+        this->Generate_Error("Music needs at least 2 buffers of 256 samples and a fade of 0 or more.");
+      }
+      // Takes effect on the next track that starts.
+      this->allegro->music_buffers = buffers.number;
+      this->allegro->music_samples = samples.number;
+      this->allegro->music_fade = fade.number;
+    }
+    else if (block.code == CMD_FREE) { // free <address> count <number>
+      sValue address = this->Eval_Expression(block, 0);
+      sValue count = this->Eval_Expression(block, 1);
+      this->Free_Blocks(this->memory, this->memory_size, address.number, count.number);
+    }
+    else if (block.code == CMD_PERSIST) { // persist <string> at <address> count <number>
+      sValue file = this->Eval_Expression(block, 0);
+      sValue offset = this->Eval_Expression(block, 1);
+      sValue count = this->Eval_Expression(block, 2);
+      this->memory.Persist(this->root + "/" + (std::string)file.string, offset.number, count.number);
+    }
     else {
       this->Generate_Error("Invalid code executed.");
     }
@@ -1097,18 +1276,19 @@ namespace Codeloader {
    */
   void cC_Lesh::Read_Write_Memory(int address, std::string field, sValue& data) {
     if (this->Valid_Address(address)) {
-      sBlock& block = this->memory[address];
       if (data.type == TYPE_EMPTY) { // Read
+        const sBlock& block = this->memory.Peek(address); // Reading does not create a page.
         if (field.length() == 0) { // Read value.
           data.string = block.value.string;
           data.number = block.value.number;
           data.type = block.value.type;
         }
         else { // Read field.
-          if (block.fields.find(field) != block.fields.end()) {
-            data.string = block.fields[field].string;
-            data.number = block.fields[field].number;
-            data.type = block.fields[field].type;
+          sFields::const_iterator entry = block.fields.find(field);
+          if (entry != block.fields.end()) {
+            data.string = entry->second.string;
+            data.number = entry->second.number;
+            data.type = entry->second.type;
           }
           else { // Field not defined.
             data.string = "null";
@@ -1118,24 +1298,17 @@ namespace Codeloader {
         }
       }
       else { // Write
+        sBlock& block = this->memory[address];
         if (field.length() == 0) { // Write value.
           block.value.string = data.string;
           block.value.number = data.number;
           block.value.type = data.type;
         }
         else { // Write field.
-          if (block.fields.find(field) != block.fields.end()) {
-            block.fields[field].string = data.string;
-            block.fields[field].number = data.number;
-            block.fields[field].type = data.type;
-          }
-          else {
-            sValue value;
-            value.type = data.type;
-            value.string = data.string;
-            value.number = data.number;
-            block.fields[field] = value;
-          }
+          sValue& value = block.fields[field]; // Added if it is not there.
+          value.string = data.string;
+          value.number = data.number;
+          value.type = data.type;
         }
       }
     }
@@ -1198,10 +1371,10 @@ namespace Codeloader {
       }
       else if (oper.code == OPER_CONCAT) { // Concatenate
         if (op_result.type == TYPE_NUMBER) {
-          result.string = result.string + this->To_String(op_result.number);
+          result.string += this->To_String(op_result.number).c_str();
         }
         else if (op_result.type == TYPE_STRING) {
-          result.string = result.string + op_result.string;
+          result.string += op_result.string;
         }
         result.type = TYPE_STRING;
       }
@@ -1217,6 +1390,10 @@ namespace Codeloader {
         result.number = (int)((double)result.number * std::sin((double)op_result.number * (this->pi / 180.0)));
         result.type = TYPE_NUMBER;
       }
+      else if (oper.code == OPER_BIT) { // Bit test, for input masks.
+        result.number = ((op_result.number >= 0) && (op_result.number < 31)) ? ((result.number >> op_result.number) & 1) : 0;
+        result.type = TYPE_NUMBER;
+      }
       part_index = part_index + 2;
     }
     return result;
@@ -4,6 +4,7 @@
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <iomanip>
 #include <map>
 #include <vector>
 #include <cctype>
@@ -11,6 +12,14 @@
 #include <ctime>
 #include <cmath>
 #include <stack>
+#include <deque>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <new>
+#include <utility>
 
 #include <boost/regex.hpp>
 #include <boost/algorithm/string/join.hpp>
@@ -27,7 +36,10 @@ namespace Codeloader {
 
   struct sOperand;
   struct sCondition;
+  struct sString;
+  struct sString_Less;
   struct sValue;
+  struct sFields;
   struct sBlock;
   struct sToken;
   struct sParse_Obj;
@@ -38,13 +50,37 @@ namespace Codeloader {
   struct sImage;
   struct sSound;
   struct sInput;
+  struct sInput_Event;
   struct sPoint;
   struct sBox;
   struct sColor;
+  struct sResource;
+  struct sAsset;
+  struct sAtlas_Page;
+  struct sText_Image;
+  struct sVoice;
+  struct sMusic;
+  struct sRaster_Item;
+  struct sCell_Entry;
+  struct sHitbox;
+  struct sTile_Grid;
+  struct sField_Slots;
+  struct sRaster_Worker;
+  struct sLarge_Block;
+  struct sFrame;
+  struct sSample;
+  struct sBench_Result;
   class cUtility;
   class cC_Lesh;
   class cConsole;
   class cAllegro;
+  class cProfiler;
+  class cPool;
+  class cMemory;
+  class cPersist;
+  class cCompositor;
+  class cScope_Timer;
+  class cBench;
   
   struct sColor {
     unsigned char red;
@@ -52,6 +88,215 @@ namespace Codeloader {
     unsigned char blue;
   };
 
+  struct sLarge_Block {
+    sLarge_Block* prev;
+    sLarge_Block* next;
+  };
+
+  class cPool {
+
+    public:
+      enum Settings {
+        PAGE_SIZE = 65536,
+        CLASS_SIZE = 16,
+        CLASS_COUNT = 16
+      };
+
+      std::vector<char*> pages;
+      void* free_lists[CLASS_COUNT];
+      char* page_top;
+      char* page_end;
+      sLarge_Block* large_blocks;
+      long long bytes_used;
+      long long bytes_large;
+      static cPool* current;
+      static long long used_total;
+      static long long reserved_total;
+      static int allocations;
+      static int frame_allocations;
+
+      cPool();
+      ~cPool();
+      void* Allocate(std::size_t bytes);
+      void Free(void* block, std::size_t bytes);
+      void Reset();
+      long long Get_Reserved();
+      static int Get_Fragmentation();
+      static cPool& Get_Shared();
+
+  };
+
+  template <class T>
+  class cPool_Allocator {
+
+    public:
+      typedef T value_type;
+
+      cPool* pool;
+
+      cPool_Allocator() {
+        this->pool = cPool::current; // NULL is the shared pool.
+      }
+
+      template <class U>
+      cPool_Allocator(const cPool_Allocator<U>& other) {
+        this->pool = other.pool;
+      }
+
+      T* allocate(std::size_t count) {
+        cPool* pool = this->pool ? this->pool : &cPool::Get_Shared();
+        return (T*)pool->Allocate(count * sizeof(T));
+      }
+
+      void deallocate(T* block, std::size_t count) {
+        cPool* pool = this->pool ? this->pool : &cPool::Get_Shared();
+        pool->Free(block, count * sizeof(T));
+      }
+
+      // The strings of a field are built while its node's pool is current,
+      // so they come from the same pool as the node.
+      template <class U, class... Args>
+      void construct(U* block, Args&&... args) {
+        cPool* outer = cPool::current;
+        cPool::current = this->pool;
+        try {
+          ::new((void*)block) U(std::forward<Args>(args)...);
+        }
+        catch (...) {
+          cPool::current = outer;
+          throw;
+        }
+        cPool::current = outer;
+      }
+
+      // A copy lives in the pool where it is made, not where it came from.
+      cPool_Allocator select_on_container_copy_construction() const {
+        return cPool_Allocator();
+      }
+
+  };
+
+  template <class T, class U>
+  bool operator==(const cPool_Allocator<T>& a, const cPool_Allocator<U>& b) {
+    return (a.pool == b.pool);
+  }
+
+  template <class T, class U>
+  bool operator!=(const cPool_Allocator<T>& a, const cPool_Allocator<U>& b) {
+    return (a.pool != b.pool);
+  }
+
+  // A string whose characters come from the current pool, so that field
+  // names and values are freed along with the rest of their page.
+  struct sString : public std::basic_string<char, std::char_traits<char>, cPool_Allocator<char> > {
+    typedef std::basic_string<char, std::char_traits<char>, cPool_Allocator<char> > tString;
+
+    sString() : tString() {
+    }
+
+    sString(const char* string) : tString(string, cPool_Allocator<char>()) {
+    }
+
+    sString(const std::string& string) : tString(string.data(), string.length(), cPool_Allocator<char>()) {
+    }
+
+    sString(const tString& other) : tString(other, cPool_Allocator<char>()) {
+    }
+
+    sString(const sString& other) : tString(other, cPool_Allocator<char>()) {
+    }
+
+    sString(sString&& other) : tString(std::move(other), cPool_Allocator<char>()) {
+    }
+
+    sString& operator=(const sString& other) {
+      tString::operator=(other);
+      return *this;
+    }
+
+    sString& operator=(const tString& other) {
+      tString::operator=(other);
+      return *this;
+    }
+
+    sString& operator=(const std::string& string) {
+      this->assign(string.data(), string.length());
+      return *this;
+    }
+
+    sString& operator=(const char* string) {
+      this->assign(string);
+      return *this;
+    }
+
+    operator std::string() const {
+      return std::string(this->data(), this->length());
+    }
+  };
+
+  inline bool operator==(const sString& a, const sString& b) {
+    return (a.compare(b) == 0);
+  }
+
+  inline bool operator==(const sString& a, const std::string& b) {
+    return (a.length() == b.length()) && (std::char_traits<char>::compare(a.data(), b.data(), a.length()) == 0);
+  }
+
+  inline bool operator==(const std::string& a, const sString& b) {
+    return (b == a);
+  }
+
+  inline bool operator==(const sString& a, const char* b) {
+    return (a.compare(b) == 0);
+  }
+
+  inline bool operator!=(const sString& a, const sString& b) {
+    return !(a == b);
+  }
+
+  inline bool operator!=(const sString& a, const std::string& b) {
+    return !(a == b);
+  }
+
+  inline bool operator!=(const std::string& a, const sString& b) {
+    return !(b == a);
+  }
+
+  inline bool operator!=(const sString& a, const char* b) {
+    return !(a == b);
+  }
+
+  // Orders field names. Names given as plain strings are compared as they
+  // are instead of being copied into the pool for every lookup.
+  struct sString_Less {
+    typedef void is_transparent;
+
+    static bool Less(const char* a, std::size_t a_length, const char* b, std::size_t b_length) {
+      int order = std::char_traits<char>::compare(a, b, (a_length < b_length) ? a_length : b_length);
+      return (order < 0) || ((order == 0) && (a_length < b_length));
+    }
+
+    bool operator()(const sString& a, const sString& b) const {
+      return Less(a.data(), a.length(), b.data(), b.length());
+    }
+
+    bool operator()(const sString& a, const std::string& b) const {
+      return Less(a.data(), a.length(), b.data(), b.length());
+    }
+
+    bool operator()(const std::string& a, const sString& b) const {
+      return Less(a.data(), a.length(), b.data(), b.length());
+    }
+
+    bool operator()(const sString& a, const char* b) const {
+      return Less(a.data(), a.length(), b, std::strlen(b));
+    }
+
+    bool operator()(const char* a, const sString& b) const {
+      return Less(a, std::strlen(a), b.data(), b.length());
+    }
+  };
+
   struct sOperand {
     std::string string;
     int number;
@@ -75,16 +320,62 @@ namespace Codeloader {
   };
 
   struct sValue {
-    std::string string;
+    sString string;
     int number;
     int type;
   };
 
+  struct sFields : public std::map<sString, sValue, sString_Less, cPool_Allocator< std::pair<const sString, sValue> > > {
+    typedef std::map<sString, sValue, sString_Less, cPool_Allocator< std::pair<const sString, sValue> > > tMap;
+
+    // Changes whenever fields could have been destroyed, so that cached
+    // references to them can tell they are stale.
+    unsigned int stamp;
+    static unsigned int stamps;
+
+    sFields() : tMap() {
+      this->stamp = ++stamps;
+    }
+
+    sFields(const sFields& other) : tMap(other) {
+      this->stamp = ++stamps;
+    }
+
+    sFields& operator=(const sFields& other) {
+      tMap::operator=(other);
+      this->stamp = ++stamps;
+      return *this;
+    }
+
+    void clear() {
+      tMap::clear();
+      this->stamp = ++stamps;
+    }
+
+    sValue& operator[](const std::string& key) {
+      iterator field = this->lower_bound(key);
+      if ((field == this->end()) || (field->first != key)) {
+        field = this->insert(field, value_type(key, sValue()));
+      }
+      return field->second;
+    }
+
+    size_type erase(const std::string& key) {
+      this->stamp = ++stamps;
+      return tMap::erase(key);
+    }
+
+    void erase(iterator field) {
+      this->stamp = ++stamps;
+      tMap::erase(field);
+    }
+  };
+
   struct sBlock {
     int code;
     std::vector< std::vector<sOperand> > expressions;
     std::vector<sCondition> conditional;
-    std::map<std::string, sValue> fields;
+    sFields fields;
     sValue value;
     std::vector<std::string> strings;
   };
@@ -129,13 +420,13 @@ namespace Codeloader {
   };
 
   struct sImage {
-    std::string name;
+    ALLEGRO_BITMAP* bitmap;
     int x;
     int y;
     int angle;
     int scale;
     int opacity;
-    std::string layer;
+    int layer;
     int width;
     int height;
     bool flip_x;
@@ -148,18 +439,16 @@ namespace Codeloader {
   };
 
   struct sInput {
-    bool left;
-    bool right;
-    bool up;
+    int buttons;
+    int pressed;
+    int released;
+  };
+
+  struct sInput_Event {
+    int input;
+    int button;
     bool down;
-    bool action;
-    bool fire_1;
-    bool fire_2;
-    bool fire_3;
-    bool start;
-    bool select;
-    bool l_button;
-    bool r_button;
+    double time;
   };
 
   struct sPoint {
@@ -174,6 +463,115 @@ namespace Codeloader {
     int bottom;
   };
 
+  struct sResource {
+    std::string name;
+    std::string file;
+    std::string ext;
+    ALLEGRO_BITMAP* bitmap;
+    ALLEGRO_SAMPLE* sample;
+    bool loaded;
+  };
+
+  struct sAsset {
+    std::string file;
+    std::string ext;
+    int refs;
+    long long bytes;
+    int last_used;
+    int width;
+    int height;
+  };
+
+  struct sAtlas_Page {
+    ALLEGRO_BITMAP* bitmap;
+    int shelf_x;
+    int shelf_y;
+    int shelf_h;
+    int image_count;
+  };
+
+  struct sVoice {
+    ALLEGRO_SAMPLE_INSTANCE* instance;
+    std::string name;
+    int priority;
+    int started;
+  };
+
+  struct sMusic {
+    ALLEGRO_AUDIO_STREAM* stream;
+    std::string name;
+    float gain;
+    float target;
+  };
+
+  struct sText_Image {
+    ALLEGRO_BITMAP* bitmap;
+    int offset_x;
+    int offset_y;
+    int last_used;
+  };
+
+  struct sHitbox {
+    int left;
+    int top;
+    int right;
+    int bottom;
+    int cdelta_x;
+    int cdelta_y;
+    int x;
+    int y;
+    int width;
+    int height;
+    int size_x;
+    int size_y;
+    int scale;
+  };
+
+  struct sTile_Grid {
+    std::vector<unsigned char> cells;
+    int width;
+    int height;
+    int tile;
+  };
+
+  struct sField_Slots {
+    sFields* fields;
+    unsigned int stamp;
+    int field_count;
+    std::vector<sValue*> slots;
+  };
+
+  struct sCell_Entry {
+    long long key;
+    int index;
+  };
+
+  struct sRaster_Item {
+    sImage* image;
+    ALLEGRO_LOCKED_REGION* source;
+    int source_x;
+    int source_y;
+  };
+
+  struct sRaster_Worker {
+    ALLEGRO_THREAD* thread;
+    cAllegro* allegro;
+    int generation;
+    std::vector<uint32_t> row;
+  };
+
+  struct sSample {
+    int stage;
+    double start;
+    double end;
+  };
+
+  struct sBench_Result {
+    std::string name;
+    double rate;
+    double baseline;
+  };
+
   class cUtility {
 
     public:
@@ -186,6 +584,30 @@ namespace Codeloader {
         TYPE_LIST,
         TYPE_HASH
       };
+      enum Layers {
+        LAYER_NONE,
+        LAYER_BACKGROUND,
+        LAYER_PLATFORM,
+        LAYER_CHARACTER,
+        LAYER_FOREGROUND,
+        LAYER_OVERLAY,
+        LAYER_COUNT
+      };
+      enum Buttons {
+        BUTTON_LEFT,
+        BUTTON_RIGHT,
+        BUTTON_UP,
+        BUTTON_DOWN,
+        BUTTON_ACTION,
+        BUTTON_FIRE_1,
+        BUTTON_FIRE_2,
+        BUTTON_FIRE_3,
+        BUTTON_START,
+        BUTTON_SELECT,
+        BUTTON_L,
+        BUTTON_R,
+        BUTTON_COUNT
+      };
       
       double pi;
       std::string root;
@@ -202,45 +624,323 @@ namespace Codeloader {
       bool Match(std::string pattern, std::string string);
       void Set_Number(sValue& value, int number);
       void Set_String(sValue& value, std::string string);
-      void Set_Field_Number(std::map<std::string, sValue>& object, std::string field, int number);
-      void Set_Field_String(std::map<std::string, sValue>& object, std::string field, std::string string);
-      bool Does_Field_Exist(std::map<std::string, sValue>& object, std::string field);
+      void Set_Field_Number(sFields& object, const std::string& field, int number);
+      void Set_Field_String(sFields& object, std::string field, std::string string);
+      bool Does_Field_Exist(sFields& object, std::string field);
       std::string Trim(std::string string);
       void Set_Root(std::string root);
       void Timeout(int timeout);
-      std::string Write_Object(std::map<std::string, sValue>& object);
+      std::string Write_Object(const sFields& object);
+      sBox Get_Image_Bounds(sImage& image);
+
+  };
+
+  class cPersist: public cUtility {
+
+    public:
+      enum Settings {
+        HEADER_SIZE = 16,
+        SLOT_SIZE = 512,
+        KEY_MAX = 255,
+        STRING_MAX = 65535
+      };
+
+      std::string path;
+      int offset;
+      int count;
+      int file;
+      char* map;
+      long long map_size;
+      std::vector<unsigned char> dirty;
+      std::vector<int> dirty_list;
+      int last_commit;
+
+      cPersist();
+      ~cPersist();
+      bool Open(std::string path, int offset, int count);
+      void Close();
+      bool Contains(int address);
+      void Mark(int address);
+      bool Load_Block(int address, sBlock& block);
+      void Store_Block(int address, const sBlock& block, std::vector<char>& journal);
+      void Commit(std::vector<char>& journal, int count);
+      void Sync_Slots(std::vector<int>& addresses);
+      bool Sync_Directory();
+      void Replay_Journal();
+
+  };
+
+  class cMemory {
+
+    public:
+      enum Settings {
+        PAGE_BITS = 10,
+        PAGE_BLOCKS = 1 << PAGE_BITS
+      };
+
+      std::vector<sBlock*> pages;
+      std::vector<cPool*> arenas;
+      int size;
+      int page_count;
+      int code_end;
+      sBlock zero;
+      cPersist persist;
+
+      cMemory();
+      ~cMemory();
+      void Resize(int size);
+      sBlock& operator[](int address);
+      const sBlock& Peek(int address);
+      void Mark(int address);
+      sBlock* Create_Page(int page_index);
+      bool Drop_Page(int page_index);
+      void Free_Page(int page_index);
+      void Clear();
+      void Persist(std::string path, int offset, int count);
+      void Flush();
+
+  };
+
+  struct sFrame {
+    std::vector<sImage> images[cUtility::LAYER_COUNT];
+    std::vector<sText> texts;
+  };
+
+  class cProfiler: public cUtility {
+
+    public:
+      enum Stages {
+        STAGE_EXECUTE,
+        STAGE_RENDER_IMAGES,
+        STAGE_OUTPUT_SOUNDS,
+        STAGE_OUTPUT_TEXTS,
+        STAGE_RENDER_SCREEN,
+        STAGE_COMPILE,
+        STAGE_LOAD,
+        STAGE_SAVE,
+        STAGE_UPLOAD,
+        STAGE_UPSCALE,
+        STAGE_CAMERA,
+        STAGE_COUNT
+      };
+      enum Settings {
+        HISTORY_MAX = 120,
+        SAMPLE_MAX = 65536,
+        GRAPH_H = 60,
+        GRAPH_SPAN = 33333 // Microseconds shown by the full graph height.
+      };
+
+      std::atomic<bool> enabled;
+      bool overlay;
+      ALLEGRO_MUTEX* mutex;
+      std::vector<sSample> samples;
+      int frame_totals[STAGE_COUNT];
+      int history[HISTORY_MAX][STAGE_COUNT];
+      int history_index;
+      int history_count;
+      double epoch;
+
+      cProfiler();
+      ~cProfiler();
+      void Enable(bool enabled, bool overlay);
+      double Start_Timer();
+      void Stop_Timer(int stage, double start);
+      void Next_Frame();
+      sBox Get_Overlay_Bounds(int width, int height);
+      void Draw_Overlay(ALLEGRO_BITMAP* target);
+      void Export_Trace(std::string name);
+      std::string Get_Stage_Name(int stage);
+
+  };
+
+  class cScope_Timer {
+
+    public:
+      cProfiler* profiler;
+      int stage;
+      double start;
+
+      cScope_Timer(cProfiler* profiler, int stage);
+      ~cScope_Timer();
+
+  };
+
+  class cCompositor: public cUtility {
+
+    public:
+      enum Kernels {
+        KERNEL_SCALAR,
+        KERNEL_SSE2,
+        KERNEL_AVX2
+      };
+
+      int kernel;
+      bool enabled;
+      int blits;
+      std::vector<uint32_t> row;
+
+      cCompositor();
+      std::string Get_Kernel_Name();
+      bool Is_Ready();
+      bool Blit(ALLEGRO_BITMAP* target, sImage& image, sBox clip);
+      void Blit_Pixels(ALLEGRO_LOCKED_REGION* dest, int dest_x, int dest_y, ALLEGRO_LOCKED_REGION* source, int source_x, int source_y, sImage& image, sBox box, std::vector<uint32_t>& row);
+      void Blend_Row(uint32_t* dest, const uint32_t* source, int count);
+      static void Blend_Row_Scalar(uint32_t* dest, const uint32_t* source, int count);
+      static void Blend_Row_SSE2(uint32_t* dest, const uint32_t* source, int count);
+      static void Blend_Row_AVX2(uint32_t* dest, const uint32_t* source, int count);
+      static void Scale_Row(uint32_t* dest, const uint32_t* source, int count, int scale);
 
   };
 
   class cConsole: public cUtility {
 
     public:
+      enum Settings {
+        COLLISION_CELL_MIN = 8,
+        COLLISION_SPAN_MAX = 4,
+        INPUT_RING_SIZE = 256
+      };
+      enum Hitbox_Fields {
+        HITBOX_LEFT,
+        HITBOX_TOP,
+        HITBOX_RIGHT,
+        HITBOX_BOTTOM,
+        HITBOX_CDELTA_X,
+        HITBOX_CDELTA_Y,
+        HITBOX_X,
+        HITBOX_Y,
+        HITBOX_WIDTH,
+        HITBOX_HEIGHT,
+        HITBOX_SIZE_X,
+        HITBOX_SIZE_Y,
+        HITBOX_SCALE,
+        HITBOX_FIELD_COUNT
+      };
+      enum Camera_Fields {
+        CAMERA_X,
+        CAMERA_Y,
+        CAMERA_LIMIT_X,
+        CAMERA_LIMIT_Y,
+        CAMERA_UPPER_BOUND,
+        CAMERA_BKG_X1,
+        CAMERA_BKG_X2,
+        CAMERA_BKG_Y1,
+        CAMERA_BKG_Y2,
+        CAMERA_X_SPEED,
+        CAMERA_Y_SPEED,
+        CAMERA_X_DIRECTION,
+        CAMERA_Y_DIRECTION,
+        CAMERA_FIELD_COUNT
+      };
+      enum Focus_Fields {
+        FOCUS_X,
+        FOCUS_Y,
+        FOCUS_WIDTH,
+        FOCUS_HEIGHT,
+        FOCUS_FIELD_COUNT
+      };
+      enum Backdrop_Fields {
+        BACKDROP_X1,
+        BACKDROP_X2,
+        BACKDROP_Y1,
+        BACKDROP_Y2,
+        BACKDROP_X_SPEED,
+        BACKDROP_Y_SPEED,
+        BACKDROP_FIELD_COUNT
+      };
+      enum Hitbox_Masks {
+        HITBOX_SPRITE = (1 << HITBOX_LEFT) | (1 << HITBOX_TOP) | (1 << HITBOX_RIGHT) | (1 << HITBOX_BOTTOM) |
+                        (1 << HITBOX_CDELTA_X) | (1 << HITBOX_CDELTA_Y) | (1 << HITBOX_SIZE_X) | (1 << HITBOX_SIZE_Y) | (1 << HITBOX_SCALE),
+        HITBOX_OTHER = (1 << HITBOX_LEFT) | (1 << HITBOX_TOP) | (1 << HITBOX_RIGHT) | (1 << HITBOX_BOTTOM) |
+                       (1 << HITBOX_X) | (1 << HITBOX_Y) | (1 << HITBOX_SIZE_X) | (1 << HITBOX_SIZE_Y) | (1 << HITBOX_SCALE)
+      };
+      enum Hit_Results {
+        HIT_LEFT,
+        HIT_TOP,
+        HIT_RIGHT,
+        HIT_BOTTOM,
+        HIT_CENTER,
+        HIT_LEFT_CORNER,
+        HIT_RIGHT_CORNER,
+        HIT_X,
+        HIT_Y,
+        HIT_RESULT_COUNT
+      };
       std::map<int, sInput> inputs;
       std::vector<sText> texts;
-      std::vector<sImage> images;
+      std::vector<sImage> images[LAYER_COUNT];
       std::vector<sSound> sounds;
       std::vector<sSound> tracks;
       std::vector<std::string> resources;
       bool ready;
       int screen_w;
       int screen_h;
+      int cull_count;
+      int frame_culls;
+      std::vector<sHitbox> collision_boxes;
+      std::vector<int> collision_fields;
+      std::vector<int> collision_large;
+      std::vector<sCell_Entry> collision_cells;
+      int collision_pairs;
+      sInput_Event input_ring[INPUT_RING_SIZE];
+      std::atomic<unsigned int> input_head;
+      std::atomic<unsigned int> input_tail;
+      int input_overflows;
+      int input_count;
+      int input_latency_max;
+      int frame_input_events;
+      int frame_input_latency;
+      int frame_field_allocs;
+      int frame_draw_calls;
+      int frame_draw_batches;
+      int frame_dirty_rects;
+      int frame_blits;
+      int frame_texts_cached;
+      sTile_Grid tile_grid;
+      sField_Slots camera_slots;
+      sField_Slots focus_slots;
+      sFields* backdrop_camera;
+      int camera_address;
+      int backdrop_layers;
+      std::vector<sField_Slots> backdrop_slots;
       cAllegro* allegro;
 
       cConsole(cAllegro* allegro);
       void Output_Text(std::string text, int x, int y, sColor color);
-      void Load_File(std::string file, sBlock* memory, int memory_size, int offset);
-      void Save_File(std::string name, sBlock* memory, int memory_size, int offset, int count);
-      void Draw_Image(std::string name, int x, int y, int scale, int angle, bool flip_x, bool flip_y, std::string layer);
+      void Load_File(std::string file, cMemory& memory, int memory_size, int offset);
+      void Save_File(std::string name, cMemory& memory, int memory_size, int offset, int count);
+      void Draw_Image(std::string name, int x, int y, int scale, int angle, bool flip_x, bool flip_y, int layer);
       void Play_Sound(std::string name, std::string mode);
       void Play_Track(std::string name, std::string mode);
-      void Detect_Collision(std::map<std::string, sValue>& sprite, std::map<std::string, sValue>& other, std::map<std::string, sValue>& results);
-      void Focus_Camera(std::map<std::string, sValue>& camera, std::map<std::string, sValue>& sprite);
+      void Detect_Collision(const sFields& sprite, const sFields& other, sFields& results);
+      int Read_Hitbox(const sFields& object, sHitbox& hitbox);
+      void Collide_Hitboxes(sHitbox& sprite, sHitbox& other, int* hits);
+      void Build_Tile_Grid(cMemory& memory, int memory_size, int offset, int width, int height, int tile);
+      void Collide_Tiles(const sFields& sprite, sFields& results);
+      void Write_Hits(sFields& results, int* hits);
+      int Collide_All(cMemory& memory, int memory_size, int offset, int count, int results, int max);
+      int Collide_Pair(cMemory& memory, int offset, int a, int b, int results, int max);
+      static bool Compare_Cell_Entry(const sCell_Entry& a, const sCell_Entry& b);
+      void Focus_Camera(sFields& camera, const sFields& sprite);
+      void Bind_Camera(cMemory& memory, int memory_size, int camera, int layers, int count);
+      bool Bind_Slots(sField_Slots& slots, sFields& fields, const char* const* names, int count);
+      void Scroll_Backdrop(int& first, int& second, int step, int span);
       void Update_Output();
       void Load_Resource(std::string resource);
       void Clear_Input(sInput& input);
       bool Point_In_Box(sPoint point, sBox box);
+      void Queue_Image(ALLEGRO_BITMAP* bitmap, int x, int y, int scale, int angle, bool flip_x, bool flip_y, int layer);
+      void Draw_Batch(cMemory& memory, int memory_size, int offset, int count);
+      bool Is_Image_Visible(sImage& image);
+      void Draw_Tilemap(cMemory& memory, int memory_size, int offset, int width, int height, int tile_size, sFields& camera, int layer);
       void Upload_Resources();
-      void Read_Input(int input, sBlock* memory, int memory_size, int offset);
+      void Read_Input(int input, cMemory& memory, int memory_size, int offset);
+      void Read_Input_Mask(int input, cMemory& memory, int memory_size, int offset);
+      void Free_Blocks(cMemory& memory, int memory_size, int offset, int count);
+      void Push_Input(int input, int button, bool down);
+      void Drain_Inputs();
+      void Read_Progress(cMemory& memory, int memory_size, int offset);
+      void Read_Stats(cMemory& memory, int memory_size, int offset);
 
   };
 
@@ -270,7 +970,26 @@ namespace Codeloader {
         CMD_UPDATE,
         CMD_TIMEOUT,
         CMD_RESOURCE,
-        CMD_UPLOAD
+        CMD_UPLOAD,
+        CMD_PROGRESS,
+        CMD_CACHE,
+        CMD_STATS,
+        CMD_REDRAW,
+        CMD_TILEMAP,
+        CMD_DRAW_BATCH,
+        CMD_PROFILE,
+        CMD_TRACE,
+        CMD_COMPOSITOR,
+        CMD_RASTER,
+        CMD_SCALING,
+        CMD_COLLIDE_ALL,
+        CMD_TILE_GRID,
+        CMD_COLLIDE_TILES,
+        CMD_BIND_CAMERA,
+        CMD_MUSIC_STREAM,
+        CMD_INPUT_MASK,
+        CMD_FREE,
+        CMD_PERSIST
       };
       enum Operators {
         OPER_ADD = 1,
@@ -281,7 +1000,8 @@ namespace Codeloader {
         OPER_CONCAT,
         OPER_RANDOM,
         OPER_COSINE,
-        OPER_SINE
+        OPER_SINE,
+        OPER_BIT
       };
       enum Conditions {
         COND_EQ = 1,
@@ -297,7 +1017,7 @@ namespace Codeloader {
       };
 
       std::map<std::string, sValue> symtab;
-      sBlock* memory;
+      cMemory memory;
       int memory_size;
       std::stack<int> stack;
       int prgm_counter;
@@ -376,40 +1096,181 @@ namespace Codeloader {
         KEYBOARD_CTRL = -1,
         WINDOW_W = 400,
         WINDOW_H = 300,
-        FONT_SIZE = 24
+        FONT_SIZE = 24,
+        LOADER_MAX = 4,
+        ATLAS_SIZE = 1024,
+        ATLAS_IMAGE_MAX = 256,
+        ATLAS_PADDING = 1,
+        DIRTY_RECT_MAX = 16,
+        DIRTY_LOOKAHEAD = 8,
+        TEXT_CACHE_MAX = 256,
+        RASTER_MAX = 8,
+        BAND_H = 32,
+        VOICE_MAX = 32,
+        AUDIO_FREQUENCY = 44100,
+        MUSIC_BUFFERS = 4,
+        MUSIC_SAMPLES = 4096,
+        MUSIC_FADE = 1000
+      };
+      enum Asset_Types {
+        ASSET_IMAGE,
+        ASSET_SOUND,
+        ASSET_TYPE_COUNT
+      };
+      enum Voice_Priorities {
+        PRIORITY_EFFECT,
+        PRIORITY_LOOP
+      };
+      enum Scale_Modes {
+        SCALE_FILTERED,
+        SCALE_NEAREST
       };
       const float RADIAN = 0.01745329;
       
       ALLEGRO_BITMAP* screen;
       ALLEGRO_DISPLAY* display;
+      bool headless;
       ALLEGRO_FONT* font;
       ALLEGRO_EVENT_QUEUE* event_queue;
       int screen_w;
       int screen_h;
       std::map<std::string, ALLEGRO_BITMAP*> images;
       std::map<std::string, ALLEGRO_SAMPLE*> sounds;
-      std::map<std::string, ALLEGRO_SAMPLE_ID*> sound_ids;
-      std::map<std::string, ALLEGRO_AUDIO_STREAM*> tracks;
-      std::map<std::string, ALLEGRO_MIXER*> mixers;
+      ALLEGRO_VOICE* audio_voice;
+      ALLEGRO_MIXER* audio_mixer;
+      std::vector<sVoice> voices;
+      int voice_tick;
+      int voice_steals;
+      int voice_drops;
+      std::map<std::string, std::string> tracks;
+      std::vector<sMusic> music;
+      int music_buffers;
+      int music_samples;
+      int music_fade;
+      double music_stamp;
       std::map<ALLEGRO_JOYSTICK*, int> gamepads;
       std::vector<int> button_map;
       std::vector<std::string> button_names;
       bool button_map_loaded;
       int button_index;
       int button_count;
+      std::vector<ALLEGRO_THREAD*> loaders;
+      ALLEGRO_MUTEX* load_mutex;
+      ALLEGRO_COND* load_cond;
+      std::deque<sResource> load_queue;
+      std::vector<sResource> load_results;
+      std::map<std::string, bool> load_pending;
+      int load_total;
+      int load_count;
+      std::map<std::string, sAsset> assets[ASSET_TYPE_COUNT];
+      long long cache_budget;
+      long long cache_bytes;
+      int cache_hits;
+      int cache_misses;
+      int cache_evictions;
+      int cache_tick;
+      std::vector<sAtlas_Page> atlas;
+      std::map<std::string, int> atlas_slots;
+      int draw_calls;
+      int draw_batches;
+      int frame_time;
+      bool dirty_mode;
+      bool full_redraw;
+      int dirty_rects;
+      ALLEGRO_THREAD* renderer;
+      ALLEGRO_MUTEX* render_mutex;
+      ALLEGRO_COND* render_cond;
+      std::atomic<bool> frame_pending;
+      sFrame render_frame;
+      sFrame last_frame;
+      double frame_stamp;
+      int render_time;
+      int script_busy;
+      int render_busy;
+      cProfiler profiler;
+      cCompositor compositor;
+      std::map<std::pair<std::string, int>, sText_Image> text_cache;
+      int text_tick;
+      std::vector<sRaster_Worker> raster_workers;
+      ALLEGRO_MUTEX* raster_mutex;
+      ALLEGRO_COND* raster_cond;
+      int raster_threads;
+      int raster_generation;
+      int raster_finished;
+      std::atomic<int> raster_next;
+      std::vector< std::vector<sRaster_Item> > raster_bins;
+      std::map<ALLEGRO_BITMAP*, ALLEGRO_LOCKED_REGION*> raster_locks;
+      ALLEGRO_LOCKED_REGION* raster_target;
+      int scale_mode;
+      std::vector<uint32_t> scale_row;
     
       cAllegro();
+      cAllegro(bool headless);
       ~cAllegro();
       void Create_Screen(int width, int height);
-      void Render_Images(std::vector<sImage>& images);
-      void Render_Layer(std::vector<sImage>& images, std::string layer);
+      void Render_Images(std::vector<sImage>* layers, int layer_count);
+      void Render_Layer(std::vector<sImage>& images, sBox clip);
+      bool Render_Parallel(std::vector<sImage>* layers, int layer_count);
+      void Raster_Bands(std::vector<uint32_t>& row);
+      void Unlock_Raster();
+      void Create_Rasterizers();
+      void Destroy_Rasterizers();
+      static void* Run_Rasterizer(ALLEGRO_THREAD* thread, void* data);
+      void Render_Regions(std::vector<sImage>* layers, int layer_count, std::vector<sText>& texts, std::vector<sBox>& rects);
+      sBox Get_Text_Bounds(sText& text);
+      void Start_Renderer();
+      void Stop_Renderer();
+      static void* Run_Renderer(ALLEGRO_THREAD* thread, void* data);
+      void Wait_For_Renderer();
+      void Submit_Frame(std::vector<sImage>* layers, std::vector<sText>& texts);
+      void Render_Frame(sFrame& frame);
+      void Find_Dirty_Rects(sFrame& frame, sFrame& last, std::vector<sBox>& rects);
+      void Diff_Images(std::vector<sImage>& images, std::vector<sImage>& last, std::vector<sBox>& rects);
+      void Diff_Texts(std::vector<sText>& texts, std::vector<sText>& last, std::vector<sBox>& rects);
+      void Add_Dirty_Rect(std::vector<sBox>& rects, sBox rect);
+      bool Is_Same_Image(sImage& image, sImage& other);
+      bool Is_Same_Text(sText& text, sText& other);
       void Output_Sounds(std::vector<sSound>& sounds);
       void Output_Tracks(std::vector<sSound>& tracks);
+      void Start_Music(std::string name, bool loop);
+      void Fade_Music(std::string name);
+      void Release_Music(int index);
       void Output_Texts(std::vector<sText>& texts);
+      void Draw_Texts(std::vector<sText>& texts);
+      sText_Image* Get_Text_Image(sText& text);
+      void Trim_Text_Cache();
+      void Clear_Text_Cache();
       void Load_Resources(std::vector<std::string>& resources);
+      void Create_Loaders();
+      void Destroy_Loaders();
+      static void* Run_Loader(ALLEGRO_THREAD* thread, void* data);
+      void Decode_Resource(sResource& resource);
+      void Finish_Resources();
+      bool Is_Resource_Loaded(std::string name, std::string ext);
+      void Store_Resource(sResource& resource);
+      ALLEGRO_BITMAP* Get_Image(std::string name);
+      bool Get_Image_Size(std::string name, int& width, int& height);
+      ALLEGRO_SAMPLE* Get_Sound(std::string name);
+      void Create_Voices();
+      void Destroy_Voices();
+      int Find_Voice(int priority);
+      void Start_Voice(std::string name, ALLEGRO_SAMPLE* sample, int priority);
+      void Stop_Voices(std::string name);
+      void Release_Voices(ALLEGRO_SAMPLE* sample);
+      int Count_Busy_Voices();
+      bool Reload_Resource(std::string name, int type);
+      void Retain_Resource(std::string name, int type);
+      void Release_Resource(std::string name, int type);
+      void Evict_Resource(std::string name, int type);
+      void Trim_Cache();
+      static bool Compare_Resource_Height(const sResource& a, const sResource& b);
+      ALLEGRO_BITMAP* Pack_Image(std::string name, ALLEGRO_BITMAP* bitmap);
+      void Unpack_Image(std::string name);
       void Load_Font(std::string name);
       void Clear_Screen();
       void Render_Screen();
+      void Upscale_Screen();
+      bool Upscale_Nearest(ALLEGRO_BITMAP* backbuffer);
       void Create_Inputs(cConsole* console);
       void Delete_Inputs(cConsole* console);
       void Create_Keyboard_Input(cConsole* console);
@@ -425,6 +1286,63 @@ namespace Codeloader {
   
   };
 
+  class cBench: public cUtility {
+
+    public:
+      enum Settings {
+        MEMORY_SIZE = 65536,
+        DATA_OFFSET = 8192,
+        BATCH_SIZE = 256,
+        SCRIPT_LINES = 1000,
+        FILE_RECORDS = 256,
+        PIXEL_COUNT = 400,
+        SPRITE_COUNT = 200,
+        SPRITE_SIZE = 48,
+        SCENE_SPRITES = 5000,
+        SCREEN_W = 400,
+        SCREEN_H = 300,
+        BLIT_TOLERANCE = 1,
+        CHECK_CASES = 100000
+      };
+
+      cAllegro* allegro;
+      cC_Lesh* c_lesh;
+      double min_time;
+      double start;
+      std::vector<sBench_Result> results;
+
+      cBench(std::string root, double min_time);
+      ~cBench();
+      void Run();
+      bool Is_Running();
+      void Record(std::string name, long long operations);
+      void Bench_Compile();
+      void Bench_Expressions();
+      void Bench_Memory();
+      void Bench_Collision();
+      void Check_Collision();
+      void Detect_Collision_Reference(sFields& sprite, sFields& other, sFields& results);
+      void Fill_Random_Hitbox(sFields& object);
+      void Bench_Collide_All(int count);
+      void Bench_Camera();
+      void Bench_Files();
+      void Bench_Dispatch();
+      void Bench_Pixels();
+      void Check_Blits();
+      void Bench_Blits();
+      void Bench_Atlas();
+      void Render_Scene(std::vector<sImage>& scene, std::string name);
+      void Create_Sprites(std::vector<sImage>& sprites);
+      void Destroy_Sprites(std::vector<sImage>& sprites);
+      ALLEGRO_BITMAP* Create_Pixels(int width, int height);
+      int Draw_Sprites(ALLEGRO_BITMAP* target, std::vector<sImage>& sprites, bool composite);
+      void Write_Script(std::string name, std::vector<std::string>& lines);
+      void Fill_Hitbox(sFields& object, int x, int y);
+      void Write_Results(std::string name);
+      int Compare_Baseline(std::string name, int threshold);
+  
+  };
+
 }
 
 #endif
@@ -0,0 +1,304 @@
+#include "C_Lesh.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define COMPOSITOR_X86 1
+#include <immintrin.h>
+#endif
+
+namespace Codeloader {
+
+  /**
+   * Creates the compositor and picks the widest blending kernel the CPU has.
+   */
+  cCompositor::cCompositor() : cUtility() {
+    this->kernel = KERNEL_SCALAR;
+    this->enabled = true;
+    this->blits = 0;
+#ifdef COMPOSITOR_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      this->kernel = KERNEL_AVX2;
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+      this->kernel = KERNEL_SSE2;
+    }
+#endif
+  }
+
+  /**
+   * Gets the name of the kernel in use.
+   * @return The kernel name.
+   */
+  std::string cCompositor::Get_Kernel_Name() {
+    if (!this->enabled) {
+      return "allegro";
+    }
+    else if (this->kernel == KERNEL_AVX2) {
+      return "avx2";
+    }
+    else if (this->kernel == KERNEL_SSE2) {
+      return "sse2";
+    }
+    return "scalar";
+  }
+
+  /**
+   * Determines if the compositor can stand in for Allegro with the current
+   * blender. Only the default premultiplied alpha blender is handled.
+   * @return True if the compositor may be used.
+   */
+  bool cCompositor::Is_Ready() {
+    if (!this->enabled) {
+      return false;
+    }
+    int op = 0;
+    int src = 0;
+    int dst = 0;
+    int alpha_op = 0;
+    int alpha_src = 0;
+    int alpha_dst = 0;
+    al_get_separate_blender(&op, &src, &dst, &alpha_op, &alpha_src, &alpha_dst);
+    return ((op == ALLEGRO_ADD) && (src == ALLEGRO_ONE) && (dst == ALLEGRO_INVERSE_ALPHA) &&
+            (alpha_op == ALLEGRO_ADD) && (alpha_src == ALLEGRO_ONE) && (alpha_dst == ALLEGRO_INVERSE_ALPHA));
+  }
+
+  /**
+   * Blits an unrotated image straight into the target's pixels. The image
+   * may be flipped and scaled by a whole number.
+   * @param target The memory bitmap being drawn on.
+   * @param image The image object.
+   * @param clip The part of the target being drawn.
+   * @return True if the image was handled, false if Allegro has to draw it.
+   */
+  bool cCompositor::Blit(ALLEGRO_BITMAP* target, sImage& image, sBox clip) {
+    if (image.angle > 0) {
+      return false;
+    }
+    int format = al_get_bitmap_format(target);
+    if ((al_get_bitmap_format(image.bitmap) != format) ||
+        ((format != ALLEGRO_PIXEL_FORMAT_ARGB_8888) && (format != ALLEGRO_PIXEL_FORMAT_ABGR_8888))) {
+      return false; // Alpha has to be the top byte of both.
+    }
+    int scale = (image.scale > 1) ? image.scale : 1;
+    int left = (image.x > clip.left) ? image.x : clip.left;
+    int top = (image.y > clip.top) ? image.y : clip.top;
+    int right = image.x + (image.width * scale);
+    int bottom = image.y + (image.height * scale);
+    right = (right < clip.right) ? right : clip.right;
+    bottom = (bottom < clip.bottom) ? bottom : clip.bottom;
+    int target_w = al_get_bitmap_width(target);
+    int target_h = al_get_bitmap_height(target);
+    left = (left > 0) ? left : 0;
+    top = (top > 0) ? top : 0;
+    right = (right < target_w) ? right : target_w;
+    bottom = (bottom < target_h) ? bottom : target_h;
+    if ((right <= left) || (bottom <= top)) {
+      return true; // Nothing lands in the clip.
+    }
+    ALLEGRO_LOCKED_REGION* dest = al_lock_bitmap_region(target, left, top, right - left, bottom - top, format, ALLEGRO_LOCK_READWRITE);
+    if (!dest) {
+      return false;
+    }
+    ALLEGRO_LOCKED_REGION* source = al_lock_bitmap(image.bitmap, format, ALLEGRO_LOCK_READONLY);
+    if (!source) {
+      al_unlock_bitmap(target);
+      return false;
+    }
+    sBox box = { left, top, right, bottom };
+    this->Blit_Pixels(dest, left, top, source, 0, 0, image, box, this->row);
+    al_unlock_bitmap(image.bitmap);
+    al_unlock_bitmap(target);
+    this->blits++;
+    return true;
+  }
+
+  /**
+   * Blits an image between regions that are already locked. This touches no
+   * Allegro state so several threads may call it on separate parts of a target.
+   * @param dest The locked target.
+   * @param dest_x The x coordinate in the target where the locked region starts.
+   * @param dest_y The y coordinate in the target where the locked region starts.
+   * @param source The locked image or the atlas page it lives on.
+   * @param source_x The x coordinate of the image in the locked source.
+   * @param source_y The y coordinate of the image in the locked source.
+   * @param image The image object.
+   * @param box The part of the target to draw. It must be inside the image and the locked region.
+   * @param row A scratch row owned by the calling thread.
+   */
+  void cCompositor::Blit_Pixels(ALLEGRO_LOCKED_REGION* dest, int dest_x, int dest_y, ALLEGRO_LOCKED_REGION* source, int source_x, int source_y, sImage& image, sBox box, std::vector<uint32_t>& row) {
+    int scale = (image.scale > 1) ? image.scale : 1;
+    int left = box.left;
+    int top = box.top;
+    int right = box.right;
+    int bottom = box.bottom;
+    int count = right - left;
+    if ((scale > 1) || image.flip_x) {
+      row.resize(count);
+    }
+    for (int y = top; y < bottom; y++) {
+      int image_y = (y - image.y) / scale;
+      if (image.flip_y) {
+        image_y = image.height - 1 - image_y;
+      }
+      const uint32_t* source_row = (const uint32_t*)((const char*)source->data + ((source_y + image_y) * source->pitch)) + source_x;
+      uint32_t* dest_row = (uint32_t*)((char*)dest->data + ((y - dest_y) * dest->pitch)) + (left - dest_x);
+      const uint32_t* pixels = source_row + (left - image.x);
+      if ((scale > 1) || image.flip_x) {
+        // Spread the source row out to the destination's pixels.
+        for (int x = left; x < right; x++) {
+          int image_x = (x - image.x) / scale;
+          if (image.flip_x) {
+            image_x = image.width - 1 - image_x;
+          }
+          row[x - left] = source_row[image_x];
+        }
+        pixels = &row[0];
+      }
+      this->Blend_Row(dest_row, pixels, count);
+    }
+  }
+
+  /**
+   * Blends a row of premultiplied pixels over another with the selected kernel.
+   * @param dest The destination pixels.
+   * @param source The source pixels.
+   * @param count The number of pixels.
+   */
+  void cCompositor::Blend_Row(uint32_t* dest, const uint32_t* source, int count) {
+#ifdef COMPOSITOR_X86
+    if (this->kernel == KERNEL_AVX2) {
+      cCompositor::Blend_Row_AVX2(dest, source, count);
+      return;
+    }
+    else if (this->kernel == KERNEL_SSE2) {
+      cCompositor::Blend_Row_SSE2(dest, source, count);
+      return;
+    }
+#endif
+    cCompositor::Blend_Row_Scalar(dest, source, count);
+  }
+
+  /**
+   * Blends pixels one at a time. Every channel gets d = s + d * (255 - sa) / 255
+   * with the division rounded. The vector kernels give the same bytes.
+   * @param dest The destination pixels.
+   * @param source The source pixels.
+   * @param count The number of pixels.
+   */
+  void cCompositor::Blend_Row_Scalar(uint32_t* dest, const uint32_t* source, int count) {
+    for (int pixel_index = 0; pixel_index < count; pixel_index++) {
+      uint32_t s = source[pixel_index];
+      uint32_t inverse = 255 - (s >> 24);
+      if (inverse == 0) { // Opaque.
+        dest[pixel_index] = s;
+      }
+      else if (s != 0) { // Not fully clear.
+        uint32_t d = dest[pixel_index];
+        uint32_t result = 0;
+        for (int shift = 0; shift < 32; shift += 8) {
+          uint32_t blend = (((d >> shift) & 0xFF) * inverse) + 128;
+          blend = (blend + (blend >> 8)) >> 8;
+          uint32_t channel = ((s >> shift) & 0xFF) + blend;
+          result |= ((channel < 255) ? channel : 255) << shift;
+        }
+        dest[pixel_index] = result;
+      }
+    }
+  }
+
+  /**
+   * Stretches a row of pixels by a whole number by repeating each one. Doubling
+   * and quadrupling are done with SSE2 on x86.
+   * @param dest The destination row. It holds count * scale pixels.
+   * @param source The source row.
+   * @param count The number of source pixels.
+   * @param scale The scale factor.
+   */
+  void cCompositor::Scale_Row(uint32_t* dest, const uint32_t* source, int count, int scale) {
+    int pixel_index = 0;
+#ifdef COMPOSITOR_X86
+    if (scale == 2) {
+      for (; pixel_index + 4 <= count; pixel_index += 4) {
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(source + pixel_index));
+        _mm_storeu_si128((__m128i*)(dest + (pixel_index * 2)), _mm_unpacklo_epi32(pixels, pixels));
+        _mm_storeu_si128((__m128i*)(dest + (pixel_index * 2) + 4), _mm_unpackhi_epi32(pixels, pixels));
+      }
+    }
+    else if (scale == 4) {
+      for (; pixel_index + 4 <= count; pixel_index += 4) {
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(source + pixel_index));
+        uint32_t* out = dest + (pixel_index * 4);
+        _mm_storeu_si128((__m128i*)out, _mm_shuffle_epi32(pixels, 0x00));
+        _mm_storeu_si128((__m128i*)(out + 4), _mm_shuffle_epi32(pixels, 0x55));
+        _mm_storeu_si128((__m128i*)(out + 8), _mm_shuffle_epi32(pixels, 0xAA));
+        _mm_storeu_si128((__m128i*)(out + 12), _mm_shuffle_epi32(pixels, 0xFF));
+      }
+    }
+#endif
+    for (; pixel_index < count; pixel_index++) {
+      std::fill(dest + (pixel_index * scale), dest + ((pixel_index + 1) * scale), source[pixel_index]);
+    }
+  }
+
+#ifdef COMPOSITOR_X86
+  /**
+   * Blends four pixels at a time with SSE2.
+   * @param dest The destination pixels.
+   * @param source The source pixels.
+   * @param count The number of pixels.
+   */
+  void cCompositor::Blend_Row_SSE2(uint32_t* dest, const uint32_t* source, int count) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i full = _mm_set1_epi32(255);
+    const __m128i round = _mm_set1_epi16(128);
+    int pixel_index = 0;
+    for (; pixel_index + 4 <= count; pixel_index += 4) {
+      __m128i s = _mm_loadu_si128((const __m128i*)(source + pixel_index));
+      __m128i d = _mm_loadu_si128((const __m128i*)(dest + pixel_index));
+      // Put 255 - alpha in both 16 bit halves of each pixel.
+      __m128i inverse = _mm_sub_epi32(full, _mm_srli_epi32(s, 24));
+      inverse = _mm_or_si128(inverse, _mm_slli_epi32(inverse, 16));
+      __m128i inverse_lo = _mm_unpacklo_epi32(inverse, inverse);
+      __m128i inverse_hi = _mm_unpackhi_epi32(inverse, inverse);
+      __m128i blend_lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), inverse_lo), round);
+      __m128i blend_hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), inverse_hi), round);
+      blend_lo = _mm_srli_epi16(_mm_add_epi16(blend_lo, _mm_srli_epi16(blend_lo, 8)), 8);
+      blend_hi = _mm_srli_epi16(_mm_add_epi16(blend_hi, _mm_srli_epi16(blend_hi, 8)), 8);
+      __m128i result = _mm_adds_epu8(s, _mm_packus_epi16(blend_lo, blend_hi));
+      _mm_storeu_si128((__m128i*)(dest + pixel_index), result);
+    }
+    cCompositor::Blend_Row_Scalar(dest + pixel_index, source + pixel_index, count - pixel_index);
+  }
+
+  /**
+   * Blends eight pixels at a time with AVX2. The unpacks and packs stay in
+   * their 128 bit lanes so the pixel order comes back out unchanged.
+   * @param dest The destination pixels.
+   * @param source The source pixels.
+   * @param count The number of pixels.
+   */
+  __attribute__((target("avx2")))
+  void cCompositor::Blend_Row_AVX2(uint32_t* dest, const uint32_t* source, int count) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i full = _mm256_set1_epi32(255);
+    const __m256i round = _mm256_set1_epi16(128);
+    int pixel_index = 0;
+    for (; pixel_index + 8 <= count; pixel_index += 8) {
+      __m256i s = _mm256_loadu_si256((const __m256i*)(source + pixel_index));
+      __m256i d = _mm256_loadu_si256((const __m256i*)(dest + pixel_index));
+      __m256i inverse = _mm256_sub_epi32(full, _mm256_srli_epi32(s, 24));
+      inverse = _mm256_or_si256(inverse, _mm256_slli_epi32(inverse, 16));
+      __m256i inverse_lo = _mm256_unpacklo_epi32(inverse, inverse);
+      __m256i inverse_hi = _mm256_unpackhi_epi32(inverse, inverse);
+      __m256i blend_lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), inverse_lo), round);
+      __m256i blend_hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), inverse_hi), round);
+      blend_lo = _mm256_srli_epi16(_mm256_add_epi16(blend_lo, _mm256_srli_epi16(blend_lo, 8)), 8);
+      blend_hi = _mm256_srli_epi16(_mm256_add_epi16(blend_hi, _mm256_srli_epi16(blend_hi, 8)), 8);
+      __m256i result = _mm256_adds_epu8(s, _mm256_packus_epi16(blend_lo, blend_hi));
+      _mm256_storeu_si256((__m256i*)(dest + pixel_index), result);
+    }
+    cCompositor::Blend_Row_SSE2(dest + pixel_index, source + pixel_index, count - pixel_index);
+  }
+#endif
+
+}
@@ -10,31 +10,259 @@ namespace Codeloader {
     this->ready = false;
     this->screen_w = 400;
     this->screen_h = 300;
+    this->cull_count = 0;
+    this->frame_culls = 0;
+    this->collision_pairs = 0;
+    this->input_head = 0;
+    this->input_tail = 0;
+    this->input_overflows = 0;
+    this->input_count = 0;
+    this->input_latency_max = 0;
+    this->frame_input_events = 0;
+    this->frame_input_latency = 0;
+    this->frame_field_allocs = 0;
+    this->frame_draw_calls = 0;
+    this->frame_draw_batches = 0;
+    this->frame_dirty_rects = 0;
+    this->frame_blits = 0;
+    this->frame_texts_cached = 0;
+    this->tile_grid.width = 0;
+    this->tile_grid.height = 0;
+    this->tile_grid.tile = 1;
+    this->camera_slots.fields = NULL;
+    this->camera_slots.stamp = 0;
+    this->camera_slots.field_count = 0;
+    this->focus_slots.fields = NULL;
+    this->focus_slots.stamp = 0;
+    this->focus_slots.field_count = 0;
+    this->backdrop_camera = NULL;
+    this->camera_address = 0;
+    this->backdrop_layers = 0;
     this->allegro = allegro;
     this->allegro->Create_Inputs(this);
     this->allegro->Create_Screen(this->screen_w, this->screen_h);
   }
 
   /**
-   * Draws an image to the image stack.
+   * Draws an image to the image stack of its layer. The bitmap is looked up
+   * here so that rendering does not have to. Images that are entirely off
+   * screen are culled, before the lookup if the image's size is known, so an
+   * evicted image is not reloaded only to be thrown away.
    * @param name The name of the image.
    * @param x The x coordinate of the image.
    * @param y The y coordinate of the image.
    * @param scale The scale of the image.
    * @param angle The angle of rotation in degrees.
-   * @param layer The image layer. Possible values are "overlay", "foreground", "character", "platform", or "background".
+   * @param layer The image layer. Possible values are LAYER_BACKGROUND through LAYER_OVERLAY.
+   * @throws An error if the layer is invalid.
    */
-  void cConsole::Draw_Image(std::string name, int x, int y, int scale, int angle, bool flip_x, bool flip_y, std::string layer) {
+  void cConsole::Draw_Image(std::string name, int x, int y, int scale, int angle, bool flip_x, bool flip_y, int layer) {
+    if ((layer <= LAYER_NONE) || (layer >= LAYER_COUNT)) {
+      throw std::string("Invalid layer for image " + name + ".");
+    }
+    sImage image;
+    if (this->allegro->Get_Image_Size(name, image.width, image.height)) {
+      image.x = x;
+      image.y = y;
+      image.scale = scale;
+      image.angle = angle;
+      if (!this->Is_Image_Visible(image)) {
+        this->cull_count++;
+        return;
+      }
+    }
+    ALLEGRO_BITMAP* bitmap = this->allegro->Get_Image(name);
+    if (bitmap) {
+      this->Queue_Image(bitmap, x, y, scale, angle, flip_x, flip_y, layer);
+    }
+  }
+
+  /**
+   * Queues a bitmap onto the image stack of its layer unless it is entirely
+   * off screen. The layer must already be valid.
+   * @param bitmap The bitmap to draw.
+   * @param x The x coordinate of the image.
+   * @param y The y coordinate of the image.
+   * @param scale The scale of the image.
+   * @param angle The angle of rotation in degrees.
+   * @param flip_x Whether the image is flipped horizontally.
+   * @param flip_y Whether the image is flipped vertically.
+   * @param layer The image layer.
+   */
+  void cConsole::Queue_Image(ALLEGRO_BITMAP* bitmap, int x, int y, int scale, int angle, bool flip_x, bool flip_y, int layer) {
     sImage image;
-    image.name = name;
+    image.bitmap = bitmap;
     image.x = x;
     image.y = y;
     image.scale = scale;
     image.angle = angle;
     image.layer = layer;
+    image.width = al_get_bitmap_width(bitmap);
+    image.height = al_get_bitmap_height(bitmap);
     image.flip_x = flip_x;
     image.flip_y = flip_y;
-    this->images.push_back(image);
+    if (this->Is_Image_Visible(image)) {
+      this->images[layer].push_back(image);
+    }
+    else {
+      this->cull_count++;
+    }
+  }
+
+  /**
+   * Draws a range of sprite objects without evaluating any expressions. Each
+   * block is read as an object with the following fields:
+   * %
+   * {
+   *   image: "name", // Sprites without an image or with "null" are skipped.
+   *   x: 0,
+   *   y: 0,
+   *   layer: 0,
+   *   scale: 1, // Optional.
+   *   angle: 0, // Optional.
+   *   flip_x: 0, // Optional.
+   *   flip_y: 0 // Optional.
+   * }
+   * %
+   * @param memory The memory holding the sprites.
+   * @param memory_size The size of the memory.
+   * @param offset The address of the first sprite.
+   * @param count The number of sprites.
+   * @throws An error if the range is outside of memory or a sprite is missing a field.
+   */
+  void cConsole::Draw_Batch(cMemory& memory, int memory_size, int offset, int count) {
+    static const std::string IMAGE = "image";
+    static const std::string X = "x";
+    static const std::string Y = "y";
+    static const std::string LAYER = "layer";
+    static const std::string SCALE = "scale";
+    static const std::string ANGLE = "angle";
+    static const std::string FLIP_X = "flip_x";
+    static const std::string FLIP_Y = "flip_y";
+    if ((offset < 0) || (count < 0) || ((long long)offset + count > memory_size)) {
+      throw std::string("Sprite batch is outside of memory.");
+    }
+    std::string last_name = "";
+    ALLEGRO_BITMAP* last_bitmap = NULL;
+    for (int sprite_index = 0; sprite_index < count; sprite_index++) {
+      const sFields& sprite = memory.Peek(offset + sprite_index).fields;
+      sFields::const_iterator image = sprite.find(IMAGE);
+      if ((image == sprite.end()) || (image->second.type != TYPE_STRING) || (image->second.string == "null")) {
+        continue; // Nothing to draw.
+      }
+      sFields::const_iterator x = sprite.find(X);
+      sFields::const_iterator y = sprite.find(Y);
+      sFields::const_iterator layer = sprite.find(LAYER);
+      if ((x == sprite.end()) || (y == sprite.end()) || (layer == sprite.end())) {
+        throw std::string("Sprite is missing field in batch.");
+      }
+      int layer_id = layer->second.number;
+      if ((layer_id <= LAYER_NONE) || (layer_id >= LAYER_COUNT)) {
+        throw std::string("Invalid layer for image " + (std::string)image->second.string + ".");
+      }
+      // Sprites in a batch are usually the same kind so skip the lookup.
+      if ((image->second.string != last_name) || !last_bitmap) {
+        last_name = image->second.string;
+        last_bitmap = this->allegro->Get_Image(last_name);
+      }
+      if (last_bitmap) {
+        sFields::const_iterator scale = sprite.find(SCALE);
+        sFields::const_iterator angle = sprite.find(ANGLE);
+        sFields::const_iterator flip_x = sprite.find(FLIP_X);
+        sFields::const_iterator flip_y = sprite.find(FLIP_Y);
+        this->Queue_Image(last_bitmap, x->second.number, y->second.number,
+                          (scale != sprite.end()) ? scale->second.number : 1,
+                          (angle != sprite.end()) ? angle->second.number : 0,
+                          (flip_x != sprite.end()) ? (bool)flip_x->second.number : false,
+                          (flip_y != sprite.end()) ? (bool)flip_y->second.number : false,
+                          layer_id);
+      }
+    }
+  }
+
+  /**
+   * Determines if any part of an image lands on the screen.
+   * @param image The image object.
+   * @return True if the image is at least partly on the screen.
+   */
+  bool cConsole::Is_Image_Visible(sImage& image) {
+    sBox bounds = this->Get_Image_Bounds(image);
+    return ((bounds.right > 0) && (bounds.left < this->screen_w) && (bounds.bottom > 0) && (bounds.top < this->screen_h));
+  }
+
+  /**
+   * Draws the visible part of a tile map. The map is a list of blocks laid out
+   * row by row. Each tile names its image in the "image" field, or in the
+   * block's value when there is no such field. Tiles without an image are
+   * left blank. Only the tiles under the camera are read, so the cost depends
+   * on the screen size and not on the size of the map.
+   * @param memory The memory holding the map.
+   * @param memory_size The size of the memory.
+   * @param offset The address of the first tile.
+   * @param width The number of tiles across.
+   * @param height The number of tiles down.
+   * @param tile_size The size of a tile in pixels.
+   * @param camera The camera object with the x and y fields.
+   * @param layer The image layer. Possible values are LAYER_BACKGROUND through LAYER_OVERLAY.
+   * @throws An error if the map does not fit in memory or the parameters are invalid.
+   */
+  void cConsole::Draw_Tilemap(cMemory& memory, int memory_size, int offset, int width, int height, int tile_size, sFields& camera, int layer) {
+    if ((layer <= LAYER_NONE) || (layer >= LAYER_COUNT)) {
+      throw std::string("Invalid layer for tile map.");
+    }
+    if ((width <= 0) || (height <= 0) || (tile_size <= 0)) {
+      throw std::string("Tile map dimensions must be positive.");
+    }
+    if ((offset < 0) || ((long long)offset + ((long long)width * height) > memory_size)) {
+      throw std::string("Tile map does not fit in memory.");
+    }
+    if (!this->Does_Field_Exist(camera, "x") || !this->Does_Field_Exist(camera, "y")) {
+      throw std::string("Camera is missing field in tile map.");
+    }
+    int camera_x = camera["x"].number;
+    int camera_y = camera["y"].number;
+    // Find the window of tiles under the screen.
+    int left = (camera_x > 0) ? (camera_x / tile_size) : 0;
+    int top = (camera_y > 0) ? (camera_y / tile_size) : 0;
+    int right = (camera_x + this->screen_w + tile_size - 1) / tile_size;
+    int bottom = (camera_y + this->screen_h + tile_size - 1) / tile_size;
+    right = (right < width) ? right : width;
+    bottom = (bottom < height) ? bottom : height;
+    int visible = ((right > left) && (bottom > top)) ? ((right - left) * (bottom - top)) : 0;
+    this->cull_count += (width * height) - visible;
+    std::vector<sImage>& layer_images = this->images[layer];
+    std::string last_name = "";
+    ALLEGRO_BITMAP* last_bitmap = NULL;
+    for (int row = top; row < bottom; row++) {
+      int row_start = offset + (row * width);
+      for (int col = left; col < right; col++) {
+        const sBlock& tile = memory.Peek(row_start + col); // Rows can cross memory pages.
+        sFields::const_iterator field = tile.fields.find("image");
+        const sValue& value = (field != tile.fields.end()) ? field->second : tile.value;
+        if ((value.type != TYPE_STRING) || (value.string.length() == 0) || (value.string == "null")) {
+          continue; // Blank tile.
+        }
+        // Neighboring tiles usually share an image so skip the lookup.
+        if ((value.string != last_name) || !last_bitmap) {
+          last_name = value.string;
+          last_bitmap = this->allegro->Get_Image(last_name);
+        }
+        if (last_bitmap) {
+          sImage image;
+          image.bitmap = last_bitmap;
+          image.x = (col * tile_size) - camera_x;
+          image.y = (row * tile_size) - camera_y;
+          image.scale = 1;
+          image.angle = 0;
+          image.layer = layer;
+          image.width = al_get_bitmap_width(last_bitmap);
+          image.height = al_get_bitmap_height(last_bitmap);
+          image.flip_x = false;
+          image.flip_y = false;
+          layer_images.push_back(image);
+        }
+      }
+    }
   }
 
   /**
@@ -82,18 +310,9 @@ namespace Codeloader {
    * @param input The input to clear.
    */
   void cConsole::Clear_Input(sInput& input) {
-    input.left = false;
-    input.right = false;
-    input.up = false;
-    input.down = false;
-    input.action = false;
-    input.fire_1 = false;
-    input.fire_2 = false;
-    input.fire_3 = false;
-    input.start = false;
-    input.select = false;
-    input.l_button = false;
-    input.r_button = false;
+    input.buttons = 0;
+    input.pressed = 0;
+    input.released = 0;
   }
 
   /**
@@ -147,86 +366,470 @@ namespace Codeloader {
    * @param results The results object.
    * @throws An error if an object is incomplete.
    */
-  void cConsole::Detect_Collision(std::map<std::string, sValue>& sprite, std::map<std::string, sValue>& other, std::map<std::string, sValue>& results) {
-    this->Set_Field_Number(results, "left", 0);
-    this->Set_Field_Number(results, "top", 0);
-    this->Set_Field_Number(results, "right", 0);
-    this->Set_Field_Number(results, "bottom", 0);
-    this->Set_Field_Number(results, "center", 0);
-    this->Set_Field_Number(results, "left_corner", 0);
-    this->Set_Field_Number(results, "right_corner", 0);
-    this->Set_Field_Number(results, "x", 0);
-    this->Set_Field_Number(results, "y", 0);
-    if (!this->Does_Field_Exist(sprite, "left") ||
-        !this->Does_Field_Exist(sprite, "top") ||
-        !this->Does_Field_Exist(sprite, "right") ||
-        !this->Does_Field_Exist(sprite, "bottom") ||
-        !this->Does_Field_Exist(sprite, "cdelta_x") ||
-        !this->Does_Field_Exist(sprite, "cdelta_y") ||
-        !this->Does_Field_Exist(sprite, "size_x") || 
-        !this->Does_Field_Exist(sprite, "size_y") ||
-        !this->Does_Field_Exist(sprite, "scale")) {
+  void cConsole::Detect_Collision(const sFields& sprite, const sFields& other, sFields& results) {
+    sHitbox sprite_box;
+    sHitbox other_box;
+    int sprite_fields = this->Read_Hitbox(sprite, sprite_box);
+    int other_fields = this->Read_Hitbox(other, other_box);
+    int hits[HIT_RESULT_COUNT] = { 0 };
+    bool complete = ((sprite_fields & HITBOX_SPRITE) == HITBOX_SPRITE) && ((other_fields & HITBOX_OTHER) == HITBOX_OTHER);
+    if (complete) {
+      this->Collide_Hitboxes(sprite_box, other_box, hits);
+    }
+    this->Write_Hits(results, hits);
+    if ((sprite_fields & HITBOX_SPRITE) != HITBOX_SPRITE) {
       throw std::string("Sprite object missing field in collision.");
     }
-    if (!this->Does_Field_Exist(other, "left") ||
-        !this->Does_Field_Exist(other, "top") ||
-        !this->Does_Field_Exist(other, "right") ||
-        !this->Does_Field_Exist(other, "bottom") ||
-        !this->Does_Field_Exist(other, "x") ||
-        !this->Does_Field_Exist(other, "y") ||
-        !this->Does_Field_Exist(other, "size_x") || 
-        !this->Does_Field_Exist(other, "size_y") ||
-        !this->Does_Field_Exist(other, "scale")) {
+    if ((other_fields & HITBOX_OTHER) != HITBOX_OTHER) {
       throw std::string("Other sprite object missing field in collision.");
     }
-    int hmap_width = sprite["right"].number - sprite["left"].number + 1;
-    int hmap_height = sprite["bottom"].number - sprite["top"].number + 1;
-    int delta_x = (int)((float)hmap_width * ((float)sprite["cdelta_x"].number / 100.0));
-    int delta_y = (int)((float)hmap_height * ((float)sprite["cdelta_y"].number / 100.0));
-    // Create 12 collision points. The middle collision point is important.
-    sPoint t1 = { sprite["left"].number + delta_x, sprite["top"].number };
-    sPoint t2 = { sprite["right"].number - delta_x, sprite["top"].number };
-    sPoint tc = { sprite["left"].number + (int)((float)hmap_width / 2.0), sprite["top"].number };
-    sPoint l1 = { sprite["left"].number, sprite["top"].number + delta_y };
-    sPoint l2 = { sprite["left"].number, sprite["bottom"].number - delta_y };
-    sPoint lc = { sprite["left"].number, sprite["top"].number + (int)((float)hmap_height / 2.0) };
-    sPoint r1 = { sprite["right"].number, sprite["top"].number + delta_y };
-    sPoint r2 = { sprite["right"].number, sprite["bottom"].number - delta_y };
-    sPoint rc = { sprite["right"].number, sprite["top"].number + (int)((float)hmap_height / 2.0) };
-    sPoint b1 = { sprite["left"].number + delta_x, sprite["bottom"].number };
-    sPoint b2 = { sprite["right"].number - delta_x, sprite["bottom"].number };
-    sPoint bc = { sprite["left"].number + (int)((float)hmap_width / 2.0), sprite["bottom"].number };
-    sPoint bl = { sprite["left"].number, sprite["bottom"].number };
-    sPoint br = { sprite["right"].number, sprite["bottom"].number };
-    // Determine which face was hit.
-    sBox other_hmap;
-    other_hmap.left = other["left"].number;
-    other_hmap.top = other["top"].number;
-    other_hmap.right = other["right"].number;
-    other_hmap.bottom = other["bottom"].number;
-    if (this->Point_In_Box(t1, other_hmap) || this->Point_In_Box(t2, other_hmap) || this->Point_In_Box(tc, other_hmap)) {
-      results["top"].number = 1;
-      results["center"].number = (int)this->Point_In_Box(tc, other_hmap);
-      results["y"].number = other["y"].number + (other["height"].number * other["size_y"].number * other["scale"].number);
-    }
-    if (this->Point_In_Box(l1, other_hmap) || this->Point_In_Box(l2, other_hmap) || this->Point_In_Box(lc, other_hmap)) {
-      results["left"].number = 1;
-      results["center"].number = (int)this->Point_In_Box(lc, other_hmap);
-      results["x"].number = other["x"].number + (other["width"].number * other["size_x"].number * other["scale"].number);
-    }
-    if (this->Point_In_Box(r1, other_hmap) || this->Point_In_Box(r2, other_hmap) || this->Point_In_Box(rc, other_hmap)) {
-      results["right"].number = 1;
-      results["center"].number = (int)this->Point_In_Box(rc, other_hmap);
-      results["x"].number = other["x"].number - (sprite["width"].number * sprite["size_x"].number * sprite["scale"].number);
-    }
-    if (this->Point_In_Box(b1, other_hmap) || this->Point_In_Box(b2, other_hmap) || this->Point_In_Box(bc, other_hmap)) {
-      results["bottom"].number = 1;
-      results["center"].number = (int)this->Point_In_Box(bc, other_hmap);
-      results["y"].number = other["y"].number - (sprite["height"].number * sprite["size_y"].number * sprite["scale"].number);
-      // Also detect bottom right and bottom left hit.
-      results["left_corner"].number = (int)this->Point_In_Box(bl, other_hmap);
-      results["right_corner"].number = (int)this->Point_In_Box(br, other_hmap);
+  }
+
+  /**
+   * Writes collision results to a results object.
+   * @param results The results object.
+   * @param hits The results, indexed by the HIT_ values.
+   */
+  void cConsole::Write_Hits(sFields& results, int* hits) {
+    static const std::string result_names[HIT_RESULT_COUNT] = {
+      "left",
+      "top",
+      "right",
+      "bottom",
+      "center",
+      "left_corner",
+      "right_corner",
+      "x",
+      "y"
+    };
+    for (int result_index = 0; result_index < HIT_RESULT_COUNT; result_index++) {
+      this->Set_Field_Number(results, result_names[result_index], hits[result_index]);
+    }
+  }
+
+  /**
+   * Reads the collision fields of an object with one lookup each. Missing
+   * fields read as 0.
+   * @param object The sprite object.
+   * @param hitbox The hit box that receives the fields.
+   * @return A mask of the fields that were present, one bit per HITBOX_ field.
+   */
+  int cConsole::Read_Hitbox(const sFields& object, sHitbox& hitbox) {
+    static const std::string field_names[HITBOX_FIELD_COUNT] = {
+      "left",
+      "top",
+      "right",
+      "bottom",
+      "cdelta_x",
+      "cdelta_y",
+      "x",
+      "y",
+      "width",
+      "height",
+      "size_x",
+      "size_y",
+      "scale"
+    };
+    int* fields[HITBOX_FIELD_COUNT] = {
+      &hitbox.left,
+      &hitbox.top,
+      &hitbox.right,
+      &hitbox.bottom,
+      &hitbox.cdelta_x,
+      &hitbox.cdelta_y,
+      &hitbox.x,
+      &hitbox.y,
+      &hitbox.width,
+      &hitbox.height,
+      &hitbox.size_x,
+      &hitbox.size_y,
+      &hitbox.scale
+    };
+    int present = 0;
+    for (int field_index = 0; field_index < HITBOX_FIELD_COUNT; field_index++) {
+      sFields::const_iterator entry = object.find(field_names[field_index]);
+      if (entry != object.end()) {
+        *fields[field_index] = entry->second.number;
+        present |= (1 << field_index);
+      }
+      else {
+        *fields[field_index] = 0;
+      }
+    }
+    return present;
+  }
+
+  /**
+   * Collides a sprite's hit box against another's. Twelve points around the
+   * sprite's hit box plus its two bottom corners are tested against the other
+   * hit box without branches, then the faces are decided from the bits.
+   * @param sprite The sprite's hit box.
+   * @param other The other sprite's hit box.
+   * @param hits The results, indexed by the HIT_ values.
+   */
+  void cConsole::Collide_Hitboxes(sHitbox& sprite, sHitbox& other, int* hits) {
+    enum Points {
+      POINT_T1, POINT_T2, POINT_TC,
+      POINT_L1, POINT_L2, POINT_LC,
+      POINT_R1, POINT_R2, POINT_RC,
+      POINT_B1, POINT_B2, POINT_BC,
+      POINT_BL, POINT_BR,
+      POINT_COUNT = 16 // Padded for the vectorizer.
+    };
+    int hmap_width = sprite.right - sprite.left + 1;
+    int hmap_height = sprite.bottom - sprite.top + 1;
+    int delta_x = (int)((float)hmap_width * ((float)sprite.cdelta_x / 100.0));
+    int delta_y = (int)((float)hmap_height * ((float)sprite.cdelta_y / 100.0));
+    int center_x = sprite.left + (int)((float)hmap_width / 2.0);
+    int center_y = sprite.top + (int)((float)hmap_height / 2.0);
+    int xs[POINT_COUNT] = {
+      sprite.left + delta_x, sprite.right - delta_x, center_x,
+      sprite.left, sprite.left, sprite.left,
+      sprite.right, sprite.right, sprite.right,
+      sprite.left + delta_x, sprite.right - delta_x, center_x,
+      sprite.left, sprite.right,
+      sprite.left, sprite.left
+    };
+    int ys[POINT_COUNT] = {
+      sprite.top, sprite.top, sprite.top,
+      sprite.top + delta_y, sprite.bottom - delta_y, center_y,
+      sprite.top + delta_y, sprite.bottom - delta_y, center_y,
+      sprite.bottom, sprite.bottom, sprite.bottom,
+      sprite.bottom, sprite.bottom,
+      sprite.top, sprite.top
+    };
+    int inside[POINT_COUNT];
+    for (int point_index = 0; point_index < POINT_COUNT; point_index++) {
+      inside[point_index] = (xs[point_index] >= other.left) & (xs[point_index] <= other.right) & (ys[point_index] >= other.top) & (ys[point_index] <= other.bottom);
+    }
+    int top = inside[POINT_T1] | inside[POINT_T2] | inside[POINT_TC];
+    int left = inside[POINT_L1] | inside[POINT_L2] | inside[POINT_LC];
+    int right = inside[POINT_R1] | inside[POINT_R2] | inside[POINT_RC];
+    int bottom = inside[POINT_B1] | inside[POINT_B2] | inside[POINT_BC];
+    hits[HIT_TOP] = top;
+    hits[HIT_LEFT] = left;
+    hits[HIT_RIGHT] = right;
+    hits[HIT_BOTTOM] = bottom;
+    // Later faces win, as they always have.
+    hits[HIT_CENTER] = bottom ? inside[POINT_BC] : (right ? inside[POINT_RC] : (left ? inside[POINT_LC] : (top ? inside[POINT_TC] : 0)));
+    hits[HIT_X] = right ? (other.x - (sprite.width * sprite.size_x * sprite.scale)) : (left ? (other.x + (other.width * other.size_x * other.scale)) : 0);
+    hits[HIT_Y] = bottom ? (other.y - (sprite.height * sprite.size_y * sprite.scale)) : (top ? (other.y + (other.height * other.size_y * other.scale)) : 0);
+    hits[HIT_LEFT_CORNER] = bottom & inside[POINT_BL];
+    hits[HIT_RIGHT_CORNER] = bottom & inside[POINT_BR];
+  }
+
+  /**
+   * Builds the collision grid from a tile map laid out like the one given to
+   * Draw_Tilemap. A tile is solid if its "solid" field is not 0. Tiles
+   * without that field are solid if they have an image.
+   * @param memory The memory holding the map.
+   * @param memory_size The size of the memory.
+   * @param offset The address of the first tile.
+   * @param width The number of tiles across.
+   * @param height The number of tiles down.
+   * @param tile The size of a tile in pixels.
+   * @throws An error if the map does not fit in memory or the parameters are invalid.
+   */
+  void cConsole::Build_Tile_Grid(cMemory& memory, int memory_size, int offset, int width, int height, int tile) {
+    if ((width <= 0) || (height <= 0) || (tile <= 0)) {
+      throw std::string("Tile grid dimensions must be positive.");
+    }
+    if ((offset < 0) || ((long long)offset + ((long long)width * height) > memory_size)) {
+      throw std::string("Tile grid does not fit in memory.");
+    }
+    static const std::string SOLID = "solid";
+    static const std::string IMAGE = "image";
+    this->tile_grid.width = width;
+    this->tile_grid.height = height;
+    this->tile_grid.tile = tile;
+    this->tile_grid.cells.assign(width * height, 0);
+    int cell_count = width * height;
+    for (int cell_index = 0; cell_index < cell_count; cell_index++) {
+      const sBlock& block = memory.Peek(offset + cell_index);
+      sFields::const_iterator solid = block.fields.find(SOLID);
+      if (solid != block.fields.end()) {
+        this->tile_grid.cells[cell_index] = (solid->second.number != 0);
+      }
+      else {
+        sFields::const_iterator field = block.fields.find(IMAGE);
+        const sValue& value = (field != block.fields.end()) ? field->second : block.value;
+        this->tile_grid.cells[cell_index] = ((value.type == TYPE_STRING) && (value.string.length() > 0) && (value.string != "null"));
+      }
+    }
+  }
+
+  /**
+   * Collides a sprite against the solid tiles of the collision grid. Only the
+   * tiles under the sprite's hit box are visited. Each one is treated as an
+   * other sprite the size of a tile, and the results are merged: faces,
+   * center and corners are combined, and the suggested x and y are the
+   * nearest ones that clear every tile hit on that face. The sprite needs the
+   * same fields as in Detect_Collision and the results object is the same.
+   * @param sprite The sprite object.
+   * @param results The results object.
+   * @throws An error if the sprite is incomplete.
+   */
+  void cConsole::Collide_Tiles(const sFields& sprite, sFields& results) {
+    sHitbox sprite_box;
+    int sprite_fields = this->Read_Hitbox(sprite, sprite_box);
+    int hits[HIT_RESULT_COUNT] = { 0 };
+    if ((sprite_fields & HITBOX_SPRITE) != HITBOX_SPRITE) {
+      this->Write_Hits(results, hits);
+      throw std::string("Sprite object missing field in collision.");
+    }
+    sTile_Grid& grid = this->tile_grid;
+    if (grid.cells.size() > 0) {
+      int col_left = (int)std::floor((double)sprite_box.left / grid.tile);
+      int row_top = (int)std::floor((double)sprite_box.top / grid.tile);
+      int col_right = (int)std::floor((double)sprite_box.right / grid.tile);
+      int row_bottom = (int)std::floor((double)sprite_box.bottom / grid.tile);
+      col_left = (col_left > 0) ? col_left : 0;
+      row_top = (row_top > 0) ? row_top : 0;
+      col_right = (col_right < grid.width) ? col_right : (grid.width - 1);
+      row_bottom = (row_bottom < grid.height) ? row_bottom : (grid.height - 1);
+      sHitbox tile_box;
+      tile_box.width = grid.tile;
+      tile_box.height = grid.tile;
+      tile_box.size_x = 1;
+      tile_box.size_y = 1;
+      tile_box.scale = 1;
+      tile_box.cdelta_x = 0;
+      tile_box.cdelta_y = 0;
+      int left_x = 0;
+      int right_x = 0;
+      int top_y = 0;
+      int bottom_y = 0;
+      for (int row = row_top; row <= row_bottom; row++) {
+        for (int col = col_left; col <= col_right; col++) {
+          if (!grid.cells[(row * grid.width) + col]) {
+            continue;
+          }
+          tile_box.x = col * grid.tile;
+          tile_box.y = row * grid.tile;
+          tile_box.left = tile_box.x;
+          tile_box.top = tile_box.y;
+          tile_box.right = tile_box.x + grid.tile - 1;
+          tile_box.bottom = tile_box.y + grid.tile - 1;
+          int tile_hits[HIT_RESULT_COUNT];
+          this->Collide_Hitboxes(sprite_box, tile_box, tile_hits);
+          if (tile_hits[HIT_LEFT]) {
+            int x = tile_box.x + grid.tile;
+            left_x = hits[HIT_LEFT] ? ((x > left_x) ? x : left_x) : x;
+          }
+          if (tile_hits[HIT_RIGHT]) {
+            int x = tile_box.x - (sprite_box.width * sprite_box.size_x * sprite_box.scale);
+            right_x = hits[HIT_RIGHT] ? ((x < right_x) ? x : right_x) : x;
+          }
+          if (tile_hits[HIT_TOP]) {
+            int y = tile_box.y + grid.tile;
+            top_y = hits[HIT_TOP] ? ((y > top_y) ? y : top_y) : y;
+          }
+          if (tile_hits[HIT_BOTTOM]) {
+            int y = tile_box.y - (sprite_box.height * sprite_box.size_y * sprite_box.scale);
+            bottom_y = hits[HIT_BOTTOM] ? ((y < bottom_y) ? y : bottom_y) : y;
+          }
+          hits[HIT_LEFT] |= tile_hits[HIT_LEFT];
+          hits[HIT_TOP] |= tile_hits[HIT_TOP];
+          hits[HIT_RIGHT] |= tile_hits[HIT_RIGHT];
+          hits[HIT_BOTTOM] |= tile_hits[HIT_BOTTOM];
+          hits[HIT_CENTER] |= tile_hits[HIT_CENTER];
+          hits[HIT_LEFT_CORNER] |= tile_hits[HIT_LEFT_CORNER];
+          hits[HIT_RIGHT_CORNER] |= tile_hits[HIT_RIGHT_CORNER];
+        }
+      }
+      // Same precedence as Detect_Collision.
+      hits[HIT_X] = hits[HIT_RIGHT] ? right_x : (hits[HIT_LEFT] ? left_x : 0);
+      hits[HIT_Y] = hits[HIT_BOTTOM] ? bottom_y : (hits[HIT_TOP] ? top_y : 0);
+    }
+    this->Write_Hits(results, hits);
+  }
+
+  /**
+   * Detects the collisions among a range of sprites. A uniform grid sized to
+   * the average hit box is used to find the sprites whose hit boxes overlap
+   * and only those pairs are collided, once each way, like in
+   * Detect_Collision. Hit boxes spanning more than a few cells are kept out
+   * of the grid and tested against every other sprite. Each hit writes a
+   * results object to the results list with two more fields:
+   * %
+   * {
+   *   sprite: 0, // Address of the sprite the faces are relative to.
+   *   other: 0 // Address of the sprite it hit.
+   * }
+   * %
+   * Misses write nothing. Blocks without a left field are skipped.
+   * @param memory The memory holding the sprites.
+   * @param memory_size The size of the memory.
+   * @param offset The address of the first sprite.
+   * @param count The number of sprites.
+   * @param results The address of the results list.
+   * @param max The number of blocks in the results list.
+   * @return The number of results written.
+   * @throws An error if a range is outside of memory or a sprite is incomplete.
+   */
+  int cConsole::Collide_All(cMemory& memory, int memory_size, int offset, int count, int results, int max) {
+    if ((offset < 0) || (count < 0) || ((long long)offset + count > memory_size)) {
+      throw std::string("Collision sprites are outside of memory.");
+    }
+    if ((results < 0) || (max < 0) || ((long long)results + max > memory_size)) {
+      throw std::string("Collision results are outside of memory.");
+    }
+    static const int BOX_FIELDS = (1 << HITBOX_LEFT) | (1 << HITBOX_TOP) | (1 << HITBOX_RIGHT) | (1 << HITBOX_BOTTOM);
+    // Pull out the hit boxes and pick a cell size.
+    this->collision_boxes.resize(count);
+    this->collision_fields.resize(count);
+    long long extent = 0;
+    int box_count = 0;
+    for (int sprite_index = 0; sprite_index < count; sprite_index++) {
+      sHitbox& box = this->collision_boxes[sprite_index];
+      int fields = this->Read_Hitbox(memory.Peek(offset + sprite_index).fields, box);
+      this->collision_fields[sprite_index] = fields;
+      if (!(fields & (1 << HITBOX_LEFT))) {
+        box.left = 1; // Empty box.
+        box.right = 0;
+        continue;
+      }
+      if ((fields & BOX_FIELDS) != BOX_FIELDS) {
+        throw std::string("Sprite object missing field in collision.");
+      }
+      if ((box.right >= box.left) && (box.bottom >= box.top)) {
+        int size = ((box.right - box.left) > (box.bottom - box.top)) ? (box.right - box.left) : (box.bottom - box.top);
+        extent += size + 1;
+        box_count++;
+      }
+    }
+    int cell = (box_count > 0) ? (int)(extent / box_count) : 1;
+    cell = (cell < COLLISION_CELL_MIN) ? COLLISION_CELL_MIN : cell;
+    // Put every box in each cell it touches, unless it touches too many.
+    this->collision_cells.clear();
+    this->collision_large.clear();
+    for (int sprite_index = 0; sprite_index < count; sprite_index++) {
+      sHitbox& box = this->collision_boxes[sprite_index];
+      if ((box.right < box.left) || (box.bottom < box.top)) {
+        continue;
+      }
+      int cell_left = (int)std::floor((double)box.left / cell);
+      int cell_top = (int)std::floor((double)box.top / cell);
+      int cell_right = (int)std::floor((double)box.right / cell);
+      int cell_bottom = (int)std::floor((double)box.bottom / cell);
+      if (((cell_right - cell_left) >= COLLISION_SPAN_MAX) || ((cell_bottom - cell_top) >= COLLISION_SPAN_MAX)) {
+        this->collision_large.push_back(sprite_index);
+        continue;
+      }
+      for (int cell_y = cell_top; cell_y <= cell_bottom; cell_y++) {
+        for (int cell_x = cell_left; cell_x <= cell_right; cell_x++) {
+          sCell_Entry entry;
+          entry.key = ((long long)cell_y << 32) | (unsigned int)cell_x;
+          entry.index = sprite_index;
+          this->collision_cells.push_back(entry);
+        }
+      }
+    }
+    std::sort(this->collision_cells.begin(), this->collision_cells.end(), cConsole::Compare_Cell_Entry);
+    // Test the pairs sharing a cell.
+    int found = 0;
+    int pairs = 0;
+    int entry_count = this->collision_cells.size();
+    int run_start = 0;
+    while ((run_start < entry_count) && (found < max)) {
+      int run_end = run_start + 1;
+      while ((run_end < entry_count) && (this->collision_cells[run_end].key == this->collision_cells[run_start].key)) {
+        run_end++;
+      }
+      long long key = this->collision_cells[run_start].key;
+      for (int first = run_start; (first < run_end) && (found < max); first++) {
+        for (int second = first + 1; (second < run_end) && (found < max); second++) {
+          int a = this->collision_cells[first].index;
+          int b = this->collision_cells[second].index;
+          sHitbox& box_a = this->collision_boxes[a];
+          sHitbox& box_b = this->collision_boxes[b];
+          if ((box_a.left > box_b.right) || (box_b.left > box_a.right) || (box_a.top > box_b.bottom) || (box_b.top > box_a.bottom)) {
+            continue;
+          }
+          // Boxes sharing several cells are only tested in the cell holding the overlap's corner.
+          int corner_x = (int)std::floor((double)((box_a.left > box_b.left) ? box_a.left : box_b.left) / cell);
+          int corner_y = (int)std::floor((double)((box_a.top > box_b.top) ? box_a.top : box_b.top) / cell);
+          if ((((long long)corner_y << 32) | (unsigned int)corner_x) != key) {
+            continue;
+          }
+          pairs++;
+          found += this->Collide_Pair(memory, offset, a, b, results + found, max - found);
+        }
+      }
+      run_start = run_end;
+    }
+    // Test the large boxes against everything. A pair of large boxes is tested by the first one.
+    int large_count = this->collision_large.size();
+    for (int large_index = 0; (large_index < large_count) && (found < max); large_index++) {
+      int a = this->collision_large[large_index];
+      sHitbox& box_a = this->collision_boxes[a];
+      int next_large = 0;
+      for (int b = 0; (b < count) && (found < max); b++) {
+        if ((next_large < large_count) && (this->collision_large[next_large] == b)) {
+          next_large++;
+          if (b <= a) {
+            continue;
+          }
+        }
+        sHitbox& box_b = this->collision_boxes[b];
+        if ((box_b.right < box_b.left) || (box_b.bottom < box_b.top)) {
+          continue;
+        }
+        if ((box_a.left > box_b.right) || (box_b.left > box_a.right) || (box_a.top > box_b.bottom) || (box_b.top > box_a.bottom)) {
+          continue;
+        }
+        pairs++;
+        found += this->Collide_Pair(memory, offset, a, b, results + found, max - found);
+      }
+    }
+    this->collision_pairs = pairs;
+    return found;
+  }
+
+  /**
+   * Collides a pair of the hit boxes read by Collide_All, once each way. A
+   * results object is only written for a hit.
+   * @param memory The memory holding the results list.
+   * @param offset The address of the first sprite.
+   * @param a The index of the first sprite.
+   * @param b The index of the second sprite.
+   * @param results The address of the next free result.
+   * @param max The number of free results.
+   * @return The number of results written.
+   * @throws An error if a sprite is incomplete.
+   */
+  int cConsole::Collide_Pair(cMemory& memory, int offset, int a, int b, int results, int max) {
+    int found = 0;
+    for (int side = 0; (side < 2) && (found < max); side++) {
+      int sprite_index = (side == 0) ? a : b;
+      int other_index = (side == 0) ? b : a;
+      if ((this->collision_fields[sprite_index] & HITBOX_SPRITE) != HITBOX_SPRITE) {
+        throw std::string("Sprite object missing field in collision.");
+      }
+      if ((this->collision_fields[other_index] & HITBOX_OTHER) != HITBOX_OTHER) {
+        throw std::string("Other sprite object missing field in collision.");
+      }
+      int hits[HIT_RESULT_COUNT] = { 0 };
+      this->Collide_Hitboxes(this->collision_boxes[sprite_index], this->collision_boxes[other_index], hits);
+      if (hits[HIT_LEFT] || hits[HIT_TOP] || hits[HIT_RIGHT] || hits[HIT_BOTTOM]) {
+        sFields& result = memory[results + found].fields;
+        this->Write_Hits(result, hits);
+        this->Set_Field_Number(result, "sprite", offset + sprite_index);
+        this->Set_Field_Number(result, "other", offset + other_index);
+        found++;
+      }
     }
+    return found;
+  }
+
+  /**
+   * Orders cell entries by cell and then by sprite.
+   * @param a The first entry.
+   * @param b The second entry.
+   * @return True if a comes before b.
+   */
+  bool cConsole::Compare_Cell_Entry(const sCell_Entry& a, const sCell_Entry& b) {
+    return (a.key < b.key) || ((a.key == b.key) && (a.index < b.index));
   }
 
   /**
@@ -257,96 +860,206 @@ namespace Codeloader {
    *     height: 10
    *   }
    * %
+   * The fields are looked up once and reused until a different camera or
+   * sprite is focused or one of them gets a new field. The time it takes is
+   * recorded as the camera stage in the profiler.
    * @param camera The camera object.
    * @param sprite The sprite object.
+   * @throws An error if the camera, sprite, or a bound layer is missing a field.
    */
-  void cConsole::Focus_Camera(std::map<std::string, sValue>& camera, std::map<std::string, sValue>& sprite) {
-    if (!this->Does_Field_Exist(camera, "x") ||
-        !this->Does_Field_Exist(camera, "y") ||
-        !this->Does_Field_Exist(camera, "limit_x") ||
-        !this->Does_Field_Exist(camera, "limit_y") ||
-        !this->Does_Field_Exist(camera, "upper_bound") ||
-        !this->Does_Field_Exist(camera, "bkg_x1") ||
-        !this->Does_Field_Exist(camera, "bkg_x2") ||
-        !this->Does_Field_Exist(camera, "bkg_y1") ||
-        !this->Does_Field_Exist(camera, "bkg_y2") ||
-        !this->Does_Field_Exist(camera, "x_speed") ||
-        !this->Does_Field_Exist(camera, "y_speed") ||
-        !this->Does_Field_Exist(camera, "x_direction") ||
-        !this->Does_Field_Exist(camera, "y_direction")) {
+  void cConsole::Focus_Camera(sFields& camera, const sFields& sprite) {
+    static const char* const camera_names[CAMERA_FIELD_COUNT] = {
+      "x",
+      "y",
+      "limit_x",
+      "limit_y",
+      "upper_bound",
+      "bkg_x1",
+      "bkg_x2",
+      "bkg_y1",
+      "bkg_y2",
+      "x_speed",
+      "y_speed",
+      "x_direction",
+      "y_direction"
+    };
+    static const char* const focus_names[FOCUS_FIELD_COUNT] = {
+      "x",
+      "y",
+      "width",
+      "height"
+    };
+    static const char* const backdrop_names[BACKDROP_FIELD_COUNT] = {
+      "x1",
+      "x2",
+      "y1",
+      "y2",
+      "x_speed",
+      "y_speed"
+    };
+    cScope_Timer timer(&this->allegro->profiler, cProfiler::STAGE_CAMERA);
+    if (!this->Bind_Slots(this->camera_slots, camera, camera_names, CAMERA_FIELD_COUNT)) {
       throw std::string("Camera is missing field in focus.");
     }
-    if (!this->Does_Field_Exist(sprite, "x") ||
-        !this->Does_Field_Exist(sprite, "y") ||
-        !this->Does_Field_Exist(sprite, "width") ||
-        !this->Does_Field_Exist(sprite, "height")) {
+    if (!this->Bind_Slots(this->focus_slots, const_cast<sFields&>(sprite), focus_names, FOCUS_FIELD_COUNT)) { // Only read.
       throw std::string("Sprite is missing field in focus.");
     }
+    // Only the bound camera scrolls the extra backdrops.
+    int backdrop_count = (&camera == this->backdrop_camera) ? this->backdrop_slots.size() : 0;
+    for (int backdrop_index = 0; backdrop_index < backdrop_count; backdrop_index++) {
+      sField_Slots& backdrop = this->backdrop_slots[backdrop_index];
+      if (!this->Bind_Slots(backdrop, *backdrop.fields, backdrop_names, BACKDROP_FIELD_COUNT)) {
+        throw std::string("Backdrop is missing field in focus.");
+      }
+    }
+    sValue** cam = &this->camera_slots.slots[0];
+    sValue** spr = &this->focus_slots.slots[0];
+    int sprite_x = spr[FOCUS_X]->number;
+    int sprite_y = spr[FOCUS_Y]->number;
+    int sprite_w = spr[FOCUS_WIDTH]->number;
+    int sprite_h = spr[FOCUS_HEIGHT]->number;
     // Focus on x.
-    int screen_cx = (this->screen_w - sprite["width"].number) / 2;
-    int screen_right = camera["limit_x"].number - screen_cx;
-    int sprite_right = sprite["x"].number + sprite["width"].number - 1;
+    int screen_cx = (this->screen_w - sprite_w) / 2;
+    int screen_right = cam[CAMERA_LIMIT_X]->number - screen_cx;
+    int sprite_right = sprite_x + sprite_w - 1;
     int dx = screen_right - screen_cx;
-    if (sprite["x"].number < screen_cx) { // Far left.
-      camera["x"].number = 0;
+    if (sprite_x < screen_cx) { // Far left.
+      cam[CAMERA_X]->number = 0;
     }
     else if (sprite_right > screen_right) { // Far right.
-      camera["x"].number = camera["limit_x"].number - this->screen_w;
+      cam[CAMERA_X]->number = cam[CAMERA_LIMIT_X]->number - this->screen_w;
     }
-    else if ((sprite["x"].number >= screen_cx) && (sprite_right <= screen_right) && (dx > sprite["width"].number)) {
-      camera["x"].number = sprite["x"].number - screen_cx;
+    else if ((sprite_x >= screen_cx) && (sprite_right <= screen_right) && (dx > sprite_w)) {
+      cam[CAMERA_X]->number = sprite_x - screen_cx;
       // Scroll backdrop.
-      camera["bkg_x1"].number += (camera["x_speed"].number * -camera["x_direction"].number);
-      if ((camera["bkg_x1"].number > 0) && (camera["bkg_x1"].number < this->screen_w)) {
-        camera["bkg_x2"].number = camera["bkg_x1"].number - this->screen_w;
-      }
-      else if (camera["bkg_x1"].number >= this->screen_w) {
-        camera["bkg_x1"].number = 0;
-        camera["bkg_x2"].number = 0;
-      }
-      else if ((camera["bkg_x1"].number < 0) && (camera["bkg_x1"].number > -this->screen_w)) {
-        camera["bkg_x2"].number = camera["bkg_x1"].number + this->screen_w;
-      }
-      else if (camera["bkg_x1"].number <= -this->screen_w) {
-        camera["bkg_x1"].number = 0;
-        camera["bkg_x2"].number = 0;
+      int direction = -cam[CAMERA_X_DIRECTION]->number;
+      this->Scroll_Backdrop(cam[CAMERA_BKG_X1]->number, cam[CAMERA_BKG_X2]->number, cam[CAMERA_X_SPEED]->number * direction, this->screen_w);
+      for (int backdrop_index = 0; backdrop_index < backdrop_count; backdrop_index++) {
+        sValue** layer = &this->backdrop_slots[backdrop_index].slots[0];
+        this->Scroll_Backdrop(layer[BACKDROP_X1]->number, layer[BACKDROP_X2]->number, layer[BACKDROP_X_SPEED]->number * direction, this->screen_w);
       }
     }
     // Focus on y.
-    int screen_cy = (this->screen_h - sprite["height"].number) / 2;
-    int screen_top = camera["upper_bound"].number + screen_cy;
-    int screen_bottom = camera["limit_y"].number - screen_cy;
-    int sprite_bottom = sprite["y"].number + sprite["height"].number - 1;
+    int screen_cy = (this->screen_h - sprite_h) / 2;
+    int screen_top = cam[CAMERA_UPPER_BOUND]->number + screen_cy;
+    int screen_bottom = cam[CAMERA_LIMIT_Y]->number - screen_cy;
+    int sprite_bottom = sprite_y + sprite_h - 1;
     int dy = screen_bottom - screen_top;
-    if (sprite["y"].number < screen_top) {
-      camera["y"].number = camera["upper_bound"].number;
+    if (sprite_y < screen_top) {
+      cam[CAMERA_Y]->number = cam[CAMERA_UPPER_BOUND]->number;
     }
     else if (sprite_bottom > screen_bottom) {
-      camera["y"].number = camera["limit_y"].number - this->screen_h;
+      cam[CAMERA_Y]->number = cam[CAMERA_LIMIT_Y]->number - this->screen_h;
     }
-    else if ((sprite["y"].number >= screen_top) && (sprite_bottom <= screen_bottom) && (dy > this->screen_h)) {
-      camera["y"].number = sprite["y"].number - screen_cy;
+    else if ((sprite_y >= screen_top) && (sprite_bottom <= screen_bottom) && (dy > this->screen_h)) {
+      cam[CAMERA_Y]->number = sprite_y - screen_cy;
       // Scroll backdrop.
-      if ((screen_bottom - screen_top) > screen_cy) {
-        camera["bkg_y1"].number += (camera["y_speed"].number * -camera["y_direction"].number);
-      }
-      if ((camera["bkg_y1"].number > 0) && (camera["bkg_y1"].number < this->screen_h)) {
-        camera["bkg_y2"].number = camera["bkg_y1"].number - this->screen_h;
-      }
-      else if (camera["bkg_y1"].number >= this->screen_h) {
-        camera["bkg_y1"].number = 0;
-        camera["bkg_y2"].number = 0;
-      }
-      else if ((camera["bkg_y1"].number < 0) && (camera["bkg_y1"].number > -this->screen_h)) {
-        camera["bkg_y2"].number = camera["bkg_y1"].number + this->screen_h;
+      bool scroll = ((screen_bottom - screen_top) > screen_cy);
+      int direction = -cam[CAMERA_Y_DIRECTION]->number;
+      this->Scroll_Backdrop(cam[CAMERA_BKG_Y1]->number, cam[CAMERA_BKG_Y2]->number, scroll ? (cam[CAMERA_Y_SPEED]->number * direction) : 0, this->screen_h);
+      for (int backdrop_index = 0; backdrop_index < backdrop_count; backdrop_index++) {
+        sValue** layer = &this->backdrop_slots[backdrop_index].slots[0];
+        this->Scroll_Backdrop(layer[BACKDROP_Y1]->number, layer[BACKDROP_Y2]->number, scroll ? (layer[BACKDROP_Y_SPEED]->number * direction) : 0, this->screen_h);
       }
-      else if (camera["bkg_y1"].number <= -this->screen_h) {
-        camera["bkg_y1"].number = 0;
-        camera["bkg_y2"].number = 0;
+    }
+  }
+
+  /**
+   * Binds a camera and its extra backdrop layers for focus. Each layer is an
+   * object with its own pair of coordinates and speeds that scroll the same
+   * way as the camera's background:
+   * %
+   *   layer = {
+   *     x1: 0,
+   *     x2: 0,
+   *     y1: 0,
+   *     y2: 0,
+   *     x_speed: 1,
+   *     y_speed: 0
+   *   }
+   * %
+   * @param memory The memory holding the camera and layers.
+   * @param memory_size The size of the memory.
+   * @param camera The address of the camera.
+   * @param layers The address of the first layer.
+   * @param count The number of layers. It can be 0.
+   * @throws An error if the camera or layers are not in memory.
+   */
+  void cConsole::Bind_Camera(cMemory& memory, int memory_size, int camera, int layers, int count) {
+    if ((camera < 0) || (camera >= memory_size)) {
+      throw std::string("Camera is not in memory.");
+    }
+    if ((count < 0) || ((count > 0) && ((layers < 0) || ((long long)layers + count > memory_size)))) {
+      throw std::string("Camera layers do not fit in memory.");
+    }
+    this->backdrop_camera = &memory[camera].fields;
+    this->camera_address = camera;
+    this->backdrop_layers = layers;
+    this->backdrop_slots.resize(count);
+    for (int layer_index = 0; layer_index < count; layer_index++) {
+      sField_Slots& backdrop = this->backdrop_slots[layer_index];
+      backdrop.fields = &memory[layers + layer_index].fields;
+      backdrop.field_count = -1; // Looked up on the next focus.
+      backdrop.slots.clear();
+    }
+  }
+
+  /**
+   * Gets direct references to an object's fields so they can be used without
+   * looking them up. The lookup is redone if the object is a different one,
+   * gained fields, or was cleared or erased from since, which changes its
+   * stamp. Adding fields does not move the ones already referenced.
+   * @param slots The cached references.
+   * @param fields The object.
+   * @param names The names of the fields.
+   * @param count The number of fields.
+   * @return True if all of the fields exist.
+   */
+  bool cConsole::Bind_Slots(sField_Slots& slots, sFields& fields, const char* const* names, int count) {
+    if ((slots.fields == &fields) && (slots.stamp == fields.stamp) && (slots.field_count == (int)fields.size()) &&
+        ((int)slots.slots.size() == count)) {
+      return true;
+    }
+    slots.fields = &fields;
+    slots.stamp = fields.stamp;
+    slots.field_count = -1;
+    slots.slots.resize(count);
+    for (int name_index = 0; name_index < count; name_index++) {
+      sFields::iterator field = fields.find(names[name_index]);
+      if (field == fields.end()) {
+        return false;
       }
+      slots.slots[name_index] = &field->second;
     }
+    slots.field_count = fields.size();
+    return true;
   }
-  
+
+  /**
+   * Scrolls a pair of backdrop coordinates that wrap around the screen.
+   * @param first The first coordinate.
+   * @param second The second coordinate, one screen away from the first.
+   * @param step How far to scroll.
+   * @param span The size of the screen.
+   */
+  void cConsole::Scroll_Backdrop(int& first, int& second, int step, int span) {
+    first += step;
+    if ((first > 0) && (first < span)) {
+      second = first - span;
+    }
+    else if (first >= span) {
+      first = 0;
+      second = 0;
+    }
+    else if ((first < 0) && (first > -span)) {
+      second = first + span;
+    }
+    else if (first <= -span) {
+      first = 0;
+      second = 0;
+    }
+  }
+
   /**
    * Loads a file into memory. Files a formatted with name=value pairs separated
    * by commas. Each line represents a record.
@@ -356,7 +1069,8 @@ namespace Codeloader {
    * @param offset Which block to start loading the file to.
    * @throws An error if the file could not be opened or invalid memory address.
    */
-  void cConsole::Load_File(std::string name, sBlock* memory, int memory_size, int offset) {
+  void cConsole::Load_File(std::string name, cMemory& memory, int memory_size, int offset) {
+    cScope_Timer timer(&this->allegro->profiler, cProfiler::STAGE_LOAD);
     std::vector<std::string> records = this->Split_File(this->root + "/" + name);
     int record_count = records.size();
     for (int record_index = 0; record_index < record_count; record_index++) {
@@ -397,12 +1111,13 @@ namespace Codeloader {
    * @param count The number of blocks to write.
    * @throws An error if the file could not be written.
    */
-  void cConsole::Save_File(std::string name, sBlock* memory, int memory_size, int offset, int count) {
+  void cConsole::Save_File(std::string name, cMemory& memory, int memory_size, int offset, int count) {
+    cScope_Timer timer(&this->allegro->profiler, cProfiler::STAGE_SAVE);
     int limit = offset + count;
     std::string data = "";
     for (int index = offset; index < limit; index++) {
       if ((index > 0) && (index < memory_size)) {
-        std::map<std::string, sValue>& object = memory[index].fields;
+        const sFields& object = memory.Peek(index).fields;
         data += std::string(this->Write_Object(object) + "\n");
       }
       else {
@@ -423,13 +1138,46 @@ namespace Codeloader {
   }
   
   /**
-   * Updates the output of the Allegro subsystem.
+   * Updates the output of the Allegro subsystem. The frame is handed to the
+   * render thread and the script carries on with the next one. Images and
+   * texts only last for one frame.
    */
   void cConsole::Update_Output() {
-    this->allegro->Clear_Screen();
-    this->allegro->Render_Images(this->images);
+    // The script has been running since the last update.
+    this->allegro->profiler.Stop_Timer(cProfiler::STAGE_EXECUTE, this->allegro->frame_stamp);
+    double start = al_get_time();
+    this->allegro->Wait_For_Renderer();
+    double waited = al_get_time() - start;
+    // The render thread writes these while it draws, so stats reads a copy.
+    this->frame_draw_calls = this->allegro->draw_calls;
+    this->frame_draw_batches = this->allegro->draw_batches;
+    this->frame_dirty_rects = this->allegro->dirty_rects;
+    this->frame_blits = this->allegro->compositor.blits;
+    this->frame_texts_cached = this->allegro->text_cache.size();
+    this->allegro->profiler.Next_Frame();
+    this->Drain_Inputs();
+    this->frame_input_events = this->input_count;
+    this->frame_input_latency = this->input_latency_max;
+    this->input_count = 0;
+    this->input_latency_max = 0;
+    this->frame_field_allocs = cPool::frame_allocations;
+    cPool::frame_allocations = 0;
+    // The renderer is idle so bitmaps can be swapped out safely.
+    this->allegro->Finish_Resources();
+    this->allegro->Trim_Cache();
+    this->allegro->Submit_Frame(this->images, this->texts);
+    this->frame_culls = this->cull_count;
+    this->cull_count = 0;
     this->allegro->Output_Sounds(this->sounds);
-    this->allegro->Output_Texts(this->texts);
+    this->allegro->Output_Tracks(this->tracks);
+    double now = al_get_time();
+    double frame = now - this->allegro->frame_stamp;
+    if ((this->allegro->frame_stamp > 0.0) && (frame > 0.0)) {
+      this->allegro->frame_time = (int)(frame * 1000000.0);
+      this->allegro->script_busy = (int)(((frame - waited) * 100.0) / frame);
+      this->allegro->render_busy = (int)((this->allegro->render_time / 10000.0) / frame);
+    }
+    this->allegro->frame_stamp = now;
   }
   
   /**
@@ -441,40 +1189,306 @@ namespace Codeloader {
   }
   
   /**
-   * Uploads resources to the Allegro subsystem for processing.
+   * Uploads resources to the Allegro subsystem for processing. This does not
+   * block. The resources are decoded in the background.
    */
   void cConsole::Upload_Resources() {
+    cScope_Timer timer(&this->allegro->profiler, cProfiler::STAGE_UPLOAD);
     this->allegro->Load_Resources(this->resources);
+    this->resources.clear();
   }
 
   /**
-   * Reads input from input array.
+   * Frees a range of blocks, such as a level that is no longer needed. Their
+   * fields are dropped and their values are set to 0. Pages that lie wholly
+   * in the range are dropped with their arenas, so freeing a level costs a
+   * few deletes per page. Only the blocks at the ends are cleared one by one.
+   * @param memory The memory holding the blocks.
+   * @param memory_size The size of the memory.
+   * @param offset The first block.
+   * @param count The number of blocks.
+   * @throws An error if the range is not in memory.
+   */
+  void cConsole::Free_Blocks(cMemory& memory, int memory_size, int offset, int count) {
+    if ((offset < 0) || (count < 0) || ((long long)offset + count > memory_size)) {
+      throw std::string("Cannot free blocks outside of memory.");
+    }
+    int end = offset + count;
+    int block_index = offset;
+    while (block_index < end) {
+      int page_index = block_index >> cMemory::PAGE_BITS;
+      int page_start = page_index << cMemory::PAGE_BITS;
+      int page_end = page_start + cMemory::PAGE_BLOCKS;
+      if (page_end > memory_size) { // The last page can be short.
+        page_end = memory_size;
+      }
+      // The bound camera and layers are kept since focus holds on to them.
+      bool bound = (this->backdrop_camera != NULL) &&
+        (((this->camera_address >= page_start) && (this->camera_address < page_end)) ||
+        ((this->backdrop_layers < page_end) && ((this->backdrop_layers + (int)this->backdrop_slots.size()) > page_start)));
+      if ((block_index == page_start) && (page_end <= end) && !bound && memory.Drop_Page(page_index)) {
+        block_index = page_end;
+        continue;
+      }
+      for (; (block_index < page_end) && (block_index < end); block_index++) {
+        sBlock& block = memory[block_index];
+        block.fields.clear();
+        block.value.string.clear();
+        block.value.number = 0;
+        block.value.type = TYPE_NUMBER;
+      }
+    }
+  }
+
+  /**
+   * Reads input from input array. Reading clears the pressed and released
+   * edges.
    * @param input The input ID.
    * @param memory The memory where the input will be stored.
    * @param memory_size The size of the memory.
    * @param offset The offset where to store the input.
    * @throws An error if the memory is being stored in an invalid location.
    */
-  void cConsole::Read_Input(int input, sBlock* memory, int memory_size, int offset) {
+  void cConsole::Read_Input(int input, cMemory& memory, int memory_size, int offset) {
+    static const std::string button_names[BUTTON_COUNT] = {
+      "left",
+      "right",
+      "up",
+      "down",
+      "action",
+      "fire_1",
+      "fire_2",
+      "fire_3",
+      "start",
+      "select",
+      "l_button",
+      "r_button"
+    };
     if ((offset >= 0) && (offset < memory_size)) {
+      this->Drain_Inputs();
       sBlock& block = memory[offset];
       sInput& buttons = this->inputs[input];
-      this->Set_Field_Number(block.fields, "left", buttons.left);
-      this->Set_Field_Number(block.fields, "right", buttons.right);
-      this->Set_Field_Number(block.fields, "up", buttons.up);
-      this->Set_Field_Number(block.fields, "down", buttons.down);
-      this->Set_Field_Number(block.fields, "action", buttons.action);
-      this->Set_Field_Number(block.fields, "fire_1", buttons.fire_1);
-      this->Set_Field_Number(block.fields, "fire_2", buttons.fire_2);
-      this->Set_Field_Number(block.fields, "fire_3", buttons.fire_3);
-      this->Set_Field_Number(block.fields, "start", buttons.start);
-      this->Set_Field_Number(block.fields, "select", buttons.select);
-      this->Set_Field_Number(block.fields, "l_button", buttons.l_button);
-      this->Set_Field_Number(block.fields, "r_button", buttons.r_button);
+      for (int button_index = 0; button_index < BUTTON_COUNT; button_index++) {
+        this->Set_Field_Number(block.fields, button_names[button_index], (buttons.buttons >> button_index) & 1);
+      }
+      buttons.pressed = 0;
+      buttons.released = 0;
     }
     else {
       throw std::string("Cannot store input in invalid memory location.");
     }
   }
 
+  /**
+   * Reads input as bit masks into the values of three blocks. Bit 0 is
+   * left, then right, up, down, action, fire_1, fire_2, fire_3, start,
+   * select, l_button, and r_button. The blocks are:
+   * %
+   *   offset + 0: Buttons held down.
+   *   offset + 1: Buttons pressed since the last read.
+   *   offset + 2: Buttons released since the last read.
+   * %
+   * @param input The input ID.
+   * @param memory The memory where the input will be stored.
+   * @param memory_size The size of the memory.
+   * @param offset The offset where to store the input.
+   * @throws An error if the memory is being stored in an invalid location.
+   */
+  void cConsole::Read_Input_Mask(int input, cMemory& memory, int memory_size, int offset) {
+    if ((offset >= 0) && ((offset + 2) < memory_size)) {
+      this->Drain_Inputs();
+      sInput& buttons = this->inputs[input];
+      this->Set_Number(memory[offset].value, buttons.buttons);
+      this->Set_Number(memory[offset + 1].value, buttons.pressed);
+      this->Set_Number(memory[offset + 2].value, buttons.released);
+      buttons.pressed = 0;
+      buttons.released = 0;
+    }
+    else {
+      throw std::string("Cannot store input in invalid memory location.");
+    }
+  }
+
+  /**
+   * Records a button going up or down. Only the event loop calls this, and
+   * only Drain_Inputs reads the ring, so it needs no lock. An event that
+   * does not fit is dropped and counted.
+   * @param input The input ID.
+   * @param button The button, one of the BUTTON_ values.
+   * @param down If the button went down.
+   */
+  void cConsole::Push_Input(int input, int button, bool down) {
+    unsigned int head = this->input_head.load(std::memory_order_relaxed);
+    if ((head - this->input_tail.load(std::memory_order_acquire)) >= INPUT_RING_SIZE) {
+      this->input_overflows++;
+      return;
+    }
+    sInput_Event& event = this->input_ring[head & (INPUT_RING_SIZE - 1)];
+    event.input = input;
+    event.button = button;
+    event.down = down;
+    event.time = al_get_time();
+    this->input_head.store(head + 1, std::memory_order_release);
+  }
+
+  /**
+   * Applies the recorded input events to the inputs. Buttons that change
+   * are added to the pressed and released edges, and the time each event
+   * waited is kept for the frame's latency.
+   */
+  void cConsole::Drain_Inputs() {
+    unsigned int tail = this->input_tail.load(std::memory_order_relaxed);
+    unsigned int head = this->input_head.load(std::memory_order_acquire);
+    if (tail == head) {
+      return;
+    }
+    double now = al_get_time();
+    for (; tail != head; tail++) {
+      sInput_Event& event = this->input_ring[tail & (INPUT_RING_SIZE - 1)];
+      std::map<int, sInput>::iterator entry = this->inputs.find(event.input);
+      if (entry != this->inputs.end()) {
+        sInput& input = entry->second;
+        int bit = 1 << event.button;
+        if (event.down) {
+          input.pressed |= (bit & ~input.buttons);
+          input.buttons |= bit;
+        }
+        else {
+          input.released |= (bit & input.buttons);
+          input.buttons &= ~bit;
+        }
+      }
+      int latency = (int)((now - event.time) * 1000000.0);
+      if (latency > this->input_latency_max) {
+        this->input_latency_max = latency;
+      }
+      this->input_count++;
+    }
+    this->input_tail.store(tail, std::memory_order_release);
+  }
+
+  /**
+   * Reads the progress of the resource upload. The block gets the following fields:
+   * %
+   * {
+   *   loaded: 0, // Number of resources handed off.
+   *   total: 0, // Number of resources in the upload.
+   *   percent: 0,
+   *   done: 0 // 1 if the upload is finished.
+   * }
+   * %
+   * @param memory The memory where the progress will be stored.
+   * @param memory_size The size of the memory.
+   * @param offset The offset where to store the progress.
+   * @throws An error if the memory is being stored in an invalid location.
+   */
+  void cConsole::Read_Progress(cMemory& memory, int memory_size, int offset) {
+    if ((offset >= 0) && (offset < memory_size)) {
+      this->allegro->Finish_Resources();
+      sBlock& block = memory[offset];
+      int loaded = this->allegro->load_count;
+      int total = this->allegro->load_total;
+      this->Set_Field_Number(block.fields, "loaded", loaded);
+      this->Set_Field_Number(block.fields, "total", total);
+      this->Set_Field_Number(block.fields, "percent", (total > 0) ? ((loaded * 100) / total) : 100);
+      this->Set_Field_Number(block.fields, "done", (loaded == total));
+    }
+    else {
+      throw std::string("Cannot store progress in invalid memory location.");
+    }
+  }
+
+  /**
+   * Reads the engine statistics. The block gets the following fields:
+   * %
+   * {
+   *   cache_bytes: 0, // Bytes of resident bitmaps and samples.
+   *   cache_budget: 0, // The cache budget in bytes. 0 is unlimited.
+   *   cache_hits: 0,
+   *   cache_misses: 0, // Lookups that had to reload an evicted resource.
+   *   cache_hit_rate: 100, // Percent.
+   *   cache_evictions: 0,
+   *   draw_calls: 0, // Images drawn last frame.
+   *   draw_batches: 0, // Atlas page switches last frame.
+   *   frame_time: 0, // Microseconds between the last two updates.
+   *   script_busy: 0, // Percent of the frame the script thread was not waiting on the renderer.
+   *   render_busy: 0, // Percent of the frame the render thread was drawing.
+   *   images_drawn: 0, // Images rendered last frame.
+   *   images_culled: 0, // Images dropped for being off screen last frame.
+   *   dirty_rects: 0, // Regions redrawn last frame in dirty mode.
+   *   texts_cached: 0, // Pre-rendered text images.
+   *   fast_blits: 0, // Images drawn by the compositor instead of Allegro last frame.
+   *   blit_kernel: "avx2", // One of avx2, sse2, scalar, or allegro when turned off.
+   *   raster_threads: 4, // Threads sharing the screen in full redraws.
+   *   collision_pairs: 0, // Overlapping pairs found by the last collide-all.
+   *   voices_busy: 0, // Sound voices playing right now.
+   *   voices_max: 32, // Size of the voice pool. 0 if there is no audio device.
+   *   voice_steals: 0, // Sounds that cut off an older one to play.
+   *   voice_drops: 0, // Sounds that could not get a voice.
+   *   input_events: 0, // Button changes handled last frame.
+   *   input_latency: 0, // Microseconds the oldest of those waited to reach the script.
+   *   input_overflows: 0, // Button changes lost to a full input ring.
+   *   field_bytes: 0, // Bytes of object fields and strings in use.
+   *   field_reserved: 0, // Bytes held by the field pools.
+   *   field_fragmentation: 0, // Percent of the held bytes not in use.
+   *   field_allocs: 0, // Fields allocated last frame.
+   *   memory_pages: 1, // Pages of blocks that have been touched.
+   *   memory_blocks: 1024, // Blocks those pages hold.
+   *   persist_writes: 0 // Persistent blocks committed at the end of the last frame.
+   * }
+   * %
+   * @param memory The memory where the statistics will be stored.
+   * @param memory_size The size of the memory.
+   * @param offset The offset where to store the statistics.
+   * @throws An error if the memory is being stored in an invalid location.
+   */
+  void cConsole::Read_Stats(cMemory& memory, int memory_size, int offset) {
+    if ((offset >= 0) && (offset < memory_size)) {
+      sBlock& block = memory[offset];
+      static const long long NUMBER_MAX = 2147483647;
+      int lookups = this->allegro->cache_hits + this->allegro->cache_misses;
+      long long cache_bytes = this->allegro->cache_bytes;
+      long long cache_budget = this->allegro->cache_budget;
+      long long field_bytes = cPool::used_total;
+      long long field_reserved = cPool::reserved_total;
+      // Numbers are ints so sizes past 2 GB read as the largest one.
+      this->Set_Field_Number(block.fields, "cache_bytes", (int)((cache_bytes < NUMBER_MAX) ? cache_bytes : NUMBER_MAX));
+      this->Set_Field_Number(block.fields, "cache_budget", (int)((cache_budget < NUMBER_MAX) ? cache_budget : NUMBER_MAX));
+      this->Set_Field_Number(block.fields, "cache_hits", this->allegro->cache_hits);
+      this->Set_Field_Number(block.fields, "cache_misses", this->allegro->cache_misses);
+      this->Set_Field_Number(block.fields, "cache_hit_rate", (lookups > 0) ? (int)(((long long)this->allegro->cache_hits * 100) / lookups) : 100);
+      this->Set_Field_Number(block.fields, "cache_evictions", this->allegro->cache_evictions);
+      this->Set_Field_Number(block.fields, "draw_calls", this->frame_draw_calls);
+      this->Set_Field_Number(block.fields, "draw_batches", this->frame_draw_batches);
+      this->Set_Field_Number(block.fields, "frame_time", this->allegro->frame_time);
+      this->Set_Field_Number(block.fields, "script_busy", this->allegro->script_busy);
+      this->Set_Field_Number(block.fields, "render_busy", this->allegro->render_busy);
+      this->Set_Field_Number(block.fields, "images_drawn", this->frame_draw_calls);
+      this->Set_Field_Number(block.fields, "images_culled", this->frame_culls);
+      this->Set_Field_Number(block.fields, "dirty_rects", this->frame_dirty_rects);
+      this->Set_Field_Number(block.fields, "texts_cached", this->frame_texts_cached);
+      this->Set_Field_Number(block.fields, "fast_blits", this->frame_blits);
+      this->Set_Field_String(block.fields, "blit_kernel", this->allegro->compositor.Get_Kernel_Name());
+      this->Set_Field_Number(block.fields, "raster_threads", this->allegro->raster_threads);
+      this->Set_Field_Number(block.fields, "collision_pairs", this->collision_pairs);
+      this->Set_Field_Number(block.fields, "voices_busy", this->allegro->Count_Busy_Voices());
+      this->Set_Field_Number(block.fields, "voices_max", this->allegro->voices.size());
+      this->Set_Field_Number(block.fields, "voice_steals", this->allegro->voice_steals);
+      this->Set_Field_Number(block.fields, "voice_drops", this->allegro->voice_drops);
+      this->Set_Field_Number(block.fields, "input_events", this->frame_input_events);
+      this->Set_Field_Number(block.fields, "input_latency", this->frame_input_latency);
+      this->Set_Field_Number(block.fields, "input_overflows", this->input_overflows);
+      this->Set_Field_Number(block.fields, "field_bytes", (int)((field_bytes < NUMBER_MAX) ? field_bytes : NUMBER_MAX));
+      this->Set_Field_Number(block.fields, "field_reserved", (int)((field_reserved < NUMBER_MAX) ? field_reserved : NUMBER_MAX));
+      this->Set_Field_Number(block.fields, "field_fragmentation", cPool::Get_Fragmentation());
+      this->Set_Field_Number(block.fields, "field_allocs", this->frame_field_allocs);
+      this->Set_Field_Number(block.fields, "memory_pages", memory.page_count);
+      this->Set_Field_Number(block.fields, "memory_blocks", memory.page_count * cMemory::PAGE_BLOCKS);
+      this->Set_Field_Number(block.fields, "persist_writes", memory.persist.last_commit);
+    }
+    else {
+      throw std::string("Cannot store statistics in invalid memory location.");
+    }
+  }
+
 }
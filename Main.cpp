@@ -3,13 +3,16 @@
 int main(int argc, char** argv) {
   Codeloader::cAllegro* allegro = NULL;
   Codeloader::cC_Lesh* c_lesh = NULL;
-  if (argc == 3) {
+  if ((argc == 3) || (argc == 4)) {
     std::string game = argv[1];
     int memory_size = std::atoi(argv[2]);
     try {
       allegro = new Codeloader::cAllegro();
       allegro->Set_Root(game);
       allegro->Load_Font("Game.ttf");
+      if ((argc == 4) && (std::string(argv[3]) == "profile")) {
+        allegro->profiler.Enable(true, false);
+      }
       c_lesh = new Codeloader::cC_Lesh(memory_size, allegro);
       c_lesh->Set_Root(game);
       c_lesh->Compile(game + ".clsh");
@@ -23,7 +26,7 @@ int main(int argc, char** argv) {
     }
   }
   else {
-    std::cout << "Usage: " << argv[0] << " <game> <memory>" << std::endl;
+    std::cout << "Usage: " << argv[0] << " <game> <memory> [profile]" << std::endl;
   }
   std::cout << "Done." << std::endl;
   return 0;
@@ -0,0 +1,259 @@
+#include "C_Lesh.hpp"
+
+namespace Codeloader {
+
+  /**
+   * Creates an empty memory. Call Resize to give it an address space.
+   */
+  cMemory::cMemory() {
+    this->size = 0;
+    this->page_count = 0;
+    this->code_end = 0;
+    this->zero.code = 0;
+    this->zero.value.number = 0;
+    this->zero.value.type = cUtility::TYPE_NUMBER;
+  }
+
+  /**
+   * Frees the pages. Persistent blocks that were not flushed are lost.
+   */
+  cMemory::~cMemory() {
+    this->Clear();
+  }
+
+  /**
+   * Sets the number of addressable blocks. Only the page table is
+   * allocated, so a large memory costs nothing until it is used.
+   * @param size The number of blocks.
+   */
+  void cMemory::Resize(int size) {
+    this->Clear();
+    this->size = (size > 0) ? size : 0;
+    this->pages.assign((this->size + PAGE_BLOCKS - 1) >> PAGE_BITS, (sBlock*)NULL);
+    this->arenas.assign(this->pages.size(), (cPool*)NULL);
+  }
+
+  /**
+   * Gets a block to write. Its page is created if it was never touched, and
+   * a persistent block is marked to be committed. Code that only reads uses
+   * Peek. The caller checks the address.
+   * @param address The address of the block.
+   * @return The block.
+   */
+  sBlock& cMemory::operator[](int address) {
+    sBlock* page = this->pages[address >> PAGE_BITS];
+    if (!page) {
+      page = this->Create_Page(address >> PAGE_BITS);
+    }
+    this->Mark(address); // Could be written.
+    return page[address & (PAGE_BLOCKS - 1)];
+  }
+
+  /**
+   * Records that a block was written through a reference that was kept from
+   * earlier, so that it is committed if it is persistent.
+   * @param address The address of the block.
+   */
+  void cMemory::Mark(int address) {
+    if (this->persist.map && this->persist.Contains(address)) {
+      this->persist.Mark(address);
+    }
+  }
+
+  /**
+   * Gets a block only to read it. A block in a page that was never touched
+   * reads as an empty number block and no page is created, unless the block
+   * has to be read from the persistent file.
+   * @param address The address of the block.
+   * @return The block.
+   */
+  const sBlock& cMemory::Peek(int address) {
+    sBlock* page = this->pages[address >> PAGE_BITS];
+    if (!page && this->persist.map && this->persist.Contains(address)) {
+      page = this->Create_Page(address >> PAGE_BITS);
+    }
+    return page ? page[address & (PAGE_BLOCKS - 1)] : this->zero;
+  }
+
+  /**
+   * Creates a page of empty number blocks with its own arena. Blocks in the
+   * persistent region are read from its file.
+   * @param page_index The page.
+   * @return The blocks of the page.
+   * @throws An error if a persistent block is corrupt. The page is still created.
+   */
+  sBlock* cMemory::Create_Page(int page_index) {
+    sBlock* page = (sBlock*)::operator new(sizeof(sBlock) * PAGE_BLOCKS);
+    cPool* arena = new cPool();
+    cPool* outer = cPool::current;
+    cPool::current = arena; // The fields and strings of the blocks come from the arena.
+    for (int block_index = 0; block_index < PAGE_BLOCKS; block_index++) {
+      new (&page[block_index]) sBlock;
+      page[block_index].code = 0;
+      page[block_index].value.number = 0;
+      page[block_index].value.type = cUtility::TYPE_NUMBER;
+    }
+    cPool::current = outer;
+    int corrupt = -1;
+    for (int block_index = 0; block_index < PAGE_BLOCKS; block_index++) {
+      int address = (page_index << PAGE_BITS) + block_index;
+      if (this->persist.map && this->persist.Contains(address)) {
+        if (!this->persist.Load_Block(address, page[block_index]) && (corrupt == -1)) {
+          corrupt = address;
+        }
+      }
+    }
+    this->pages[page_index] = page;
+    this->arenas[page_index] = arena;
+    this->page_count++;
+    if (corrupt != -1) { // The page is usable, the bad blocks read as empty.
+      throw std::string("Persistent block " + this->persist.To_String(corrupt) + " is corrupt.");
+    }
+    return page;
+  }
+
+  /**
+   * Backs a region of memory with a file. If the file exists the region
+   * takes its contents, otherwise the region's current contents are written
+   * to the new file on the next flush. Pages that were not touched yet are
+   * read from the file when they are first used.
+   * @param path The path of the file.
+   * @param offset The first block of the region.
+   * @param count The number of blocks in the region.
+   * @throws An error if the region is not in memory, the file could not be mapped or a block in it is corrupt.
+   */
+  void cMemory::Persist(std::string path, int offset, int count) {
+    if ((offset < 0) || (count <= 0) || ((long long)offset + count > this->size)) {
+      throw std::string("Persistent region is not in memory.");
+    }
+    this->Flush();
+    bool existed = this->persist.Open(path, offset, count);
+    int corrupt = -1;
+    int first_page = offset >> PAGE_BITS;
+    int last_page = (offset + count - 1) >> PAGE_BITS;
+    for (int page_index = first_page; page_index <= last_page; page_index++) {
+      sBlock* page = this->pages[page_index];
+      if (!page) {
+        continue;
+      }
+      for (int block_index = 0; block_index < PAGE_BLOCKS; block_index++) {
+        int address = (page_index << PAGE_BITS) + block_index;
+        if (this->persist.Contains(address)) {
+          if (existed) {
+            sBlock& block = page[block_index];
+            block.fields.clear();
+            block.value.string.clear();
+            block.value.number = 0;
+            block.value.type = cUtility::TYPE_NUMBER;
+            if (!this->persist.Load_Block(address, block) && (corrupt == -1)) {
+              corrupt = address;
+            }
+          }
+          else {
+            this->persist.Mark(address);
+          }
+        }
+      }
+    }
+    if (corrupt != -1) {
+      throw std::string("Persistent block " + this->persist.To_String(corrupt) + " is corrupt.");
+    }
+  }
+
+  /**
+   * Commits the blocks of the persistent region that were written since the
+   * last flush. This is done at the end of every frame. A block too big for
+   * its slot keeps its last commit and is reported once. The others are
+   * still committed.
+   * @throws An error if a block is too big for its slot or the file could not be written.
+   */
+  void cMemory::Flush() {
+    int dirty_count = this->persist.dirty_list.size();
+    this->persist.last_commit = 0;
+    if (!this->persist.map || (dirty_count == 0)) {
+      return;
+    }
+    std::vector<char> journal;
+    journal.reserve(dirty_count * (sizeof(int) + cPersist::SLOT_SIZE));
+    std::string error = "";
+    int stored = 0;
+    for (int dirty_index = 0; dirty_index < dirty_count; dirty_index++) {
+      int address = this->persist.dirty_list[dirty_index];
+      try {
+        this->persist.Store_Block(address, this->Peek(address), journal);
+        stored++;
+      }
+      catch (std::string message) {
+        this->persist.dirty[address - this->persist.offset] = 0; // Dropped until it is written again.
+        if (error.length() == 0) {
+          error = message;
+        }
+      }
+    }
+    if (stored > 0) {
+      this->persist.Commit(journal, stored);
+    }
+    this->persist.dirty_list.clear();
+    if (error.length() > 0) {
+      throw error;
+    }
+  }
+
+  /**
+   * Frees a page of data so that it reads as empty number blocks again. A
+   * page with code or persistent blocks is left alone, since those have to
+   * be cleared block by block.
+   * @param page_index The page.
+   * @return True if the page is free.
+   */
+  bool cMemory::Drop_Page(int page_index) {
+    int first = page_index << PAGE_BITS;
+    if (first < this->code_end) {
+      return false;
+    }
+    if (this->persist.map && (first < (this->persist.offset + this->persist.count)) && ((first + PAGE_BLOCKS) > this->persist.offset)) {
+      return false; // The cleared blocks must be committed.
+    }
+    if (this->pages[page_index]) {
+      this->Free_Page(page_index);
+    }
+    return true;
+  }
+
+  /**
+   * Frees a page. Every field and string of a data block came from the
+   * page's arena, so the blocks are not destroyed and the arena is deleted
+   * a page at a time. Blocks with code hold it in plain vectors and are
+   * destroyed first.
+   * @param page_index The page.
+   */
+  void cMemory::Free_Page(int page_index) {
+    sBlock* page = this->pages[page_index];
+    if ((page_index << PAGE_BITS) < this->code_end) {
+      for (int block_index = 0; block_index < PAGE_BLOCKS; block_index++) {
+        page[block_index].~sBlock();
+      }
+    }
+    ::operator delete(page);
+    delete this->arenas[page_index];
+    this->pages[page_index] = NULL;
+    this->arenas[page_index] = NULL;
+    this->page_count--;
+  }
+
+  /**
+   * Frees every page. The address space stays the same. Persistent blocks
+   * that were not flushed are lost.
+   */
+  void cMemory::Clear() {
+    this->persist.Close();
+    int page_total = this->pages.size();
+    for (int page_index = 0; page_index < page_total; page_index++) {
+      if (this->pages[page_index]) {
+        this->Free_Page(page_index);
+      }
+    }
+    this->code_end = 0;
+  }
+
+}
@@ -0,0 +1,370 @@
+#include "C_Lesh.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace Codeloader {
+
+  /**
+   * Creates a persistent region that is not backed by anything yet.
+   */
+  cPersist::cPersist() {
+    this->path = "";
+    this->offset = 0;
+    this->count = 0;
+    this->file = -1;
+    this->map = NULL;
+    this->map_size = 0;
+    this->last_commit = 0;
+  }
+
+  /**
+   * Unmaps the file.
+   */
+  cPersist::~cPersist() {
+    this->Close();
+  }
+
+  /**
+   * Maps a region's file into memory. The file has a small header followed
+   * by one fixed size slot per block, so it can be reopened without parsing
+   * and blocks are decoded only when their page is used. A new file is
+   * sparse and reads as empty blocks. A journal left by an interrupted
+   * commit is replayed first.
+   * %
+   *   Header: "CLPM", slot size, block count, reserved.
+   *   Slot: stored flag, value, field count, fields.
+   *   Value: type (1 byte), number (4 bytes), string length (2 bytes), string.
+   *   Field: name length (1 byte), name, value.
+   * %
+   * @param path The path of the file.
+   * @param offset The first block of the region.
+   * @param count The number of blocks in the region.
+   * @return True if the file already existed.
+   * @throws An error if the file could not be mapped or was made for a different region size.
+   */
+  bool cPersist::Open(std::string path, int offset, int count) {
+    this->Close();
+    this->path = path;
+    this->offset = offset;
+    this->count = count;
+    this->file = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (this->file == -1) {
+      throw std::string("Could not open persistent file " + path + ".");
+    }
+    struct stat info;
+    fstat(this->file, &info);
+    bool existed = (info.st_size > 0);
+    this->map_size = HEADER_SIZE + ((long long)count * SLOT_SIZE);
+    if (existed && (info.st_size != this->map_size)) {
+      this->Close();
+      throw std::string("Persistent file " + path + " was made for a different region size.");
+    }
+    if (!existed && (ftruncate(this->file, this->map_size) != 0)) {
+      this->Close();
+      throw std::string("Could not size persistent file " + path + ".");
+    }
+    void* map = mmap(NULL, this->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, this->file, 0);
+    if (map == MAP_FAILED) {
+      this->Close();
+      throw std::string("Could not map persistent file " + path + ".");
+    }
+    this->map = (char*)map;
+    if (!existed) {
+      int header[4] = { 0x4D504C43, SLOT_SIZE, count, 0 }; // "CLPM"
+      std::memcpy(this->map, header, HEADER_SIZE);
+      msync(this->map, HEADER_SIZE, MS_SYNC);
+      this->Sync_Directory();
+    }
+    else {
+      int header[4];
+      std::memcpy(header, this->map, HEADER_SIZE);
+      if ((header[0] != 0x4D504C43) || (header[1] != SLOT_SIZE) || (header[2] != count)) {
+        this->Close();
+        throw std::string(path + " is not a persistent file for this region.");
+      }
+    }
+    this->Replay_Journal();
+    this->dirty.assign(count, 0);
+    this->dirty_list.clear();
+    return existed;
+  }
+
+  /**
+   * Unmaps and closes the file. Blocks that were not flushed are lost.
+   */
+  void cPersist::Close() {
+    if (this->map) {
+      munmap(this->map, this->map_size);
+      this->map = NULL;
+    }
+    if (this->file != -1) {
+      close(this->file);
+      this->file = -1;
+    }
+    this->dirty.clear();
+    this->dirty_list.clear();
+  }
+
+  /**
+   * Determines if a block is in the region.
+   * @param address The address of the block.
+   * @return True if the block is in the region.
+   */
+  bool cPersist::Contains(int address) {
+    return (unsigned int)(address - this->offset) < (unsigned int)this->count;
+  }
+
+  /**
+   * Marks a block to be committed on the next flush.
+   * @param address The address of the block.
+   */
+  void cPersist::Mark(int address) {
+    int index = address - this->offset;
+    if (!this->dirty[index]) {
+      this->dirty[index] = 1;
+      this->dirty_list.push_back(address);
+    }
+  }
+
+  /**
+   * Decodes a block from its slot. An empty slot leaves the block as it is.
+   * Every length read from the file is checked against the slot, and a slot
+   * that does not add up leaves the block empty.
+   * @param address The address of the block.
+   * @param block The block to fill.
+   * @return False if the slot is corrupt.
+   */
+  bool cPersist::Load_Block(int address, sBlock& block) {
+    const char* slot = this->map + HEADER_SIZE + ((long long)(address - this->offset) * SLOT_SIZE);
+    const char* end = slot + SLOT_SIZE;
+    if (!slot[0]) {
+      return true; // Never stored.
+    }
+    const char* pos = slot + 1;
+    sValue* value = &block.value;
+    unsigned short field_count = 0;
+    std::memcpy(&field_count, pos, sizeof(field_count));
+    pos += sizeof(field_count);
+    sFields::iterator hint = block.fields.end();
+    bool fits = true;
+    for (int value_index = 0; fits && (value_index <= field_count); value_index++) {
+      if (value_index > 0) {
+        fits = ((pos + 1) <= end);
+        if (!fits) {
+          break;
+        }
+        unsigned char key_length = *pos++;
+        fits = ((pos + key_length) <= end);
+        if (!fits) {
+          break;
+        }
+        hint = block.fields.insert(hint, std::make_pair(std::string(pos, key_length), sValue()));
+        pos += key_length;
+        value = &hint->second;
+      }
+      unsigned short string_length = 0;
+      fits = ((pos + 1 + sizeof(value->number) + sizeof(string_length)) <= end);
+      if (!fits) {
+        break;
+      }
+      value->type = (unsigned char)*pos++;
+      std::memcpy(&value->number, pos, sizeof(value->number));
+      pos += sizeof(value->number);
+      std::memcpy(&string_length, pos, sizeof(string_length));
+      pos += sizeof(string_length);
+      fits = ((pos + string_length) <= end);
+      if (!fits) {
+        break;
+      }
+      value->string.assign(pos, string_length);
+      pos += string_length;
+    }
+    if (!fits) {
+      block.fields.clear();
+      block.value.string.clear();
+      block.value.number = 0;
+      block.value.type = TYPE_NUMBER;
+    }
+    return fits;
+  }
+
+  /**
+   * Encodes a block into a journal record of its address and slot. A block
+   * that does not fit adds nothing to the journal.
+   * @param address The address of the block.
+   * @param block The block.
+   * @param journal The journal to add the record to.
+   * @throws An error if the block does not fit into a slot.
+   */
+  void cPersist::Store_Block(int address, const sBlock& block, std::vector<char>& journal) {
+    int start = journal.size();
+    journal.resize(start + sizeof(int) + SLOT_SIZE, 0);
+    std::memcpy(&journal[start], &address, sizeof(int));
+    char* slot = &journal[start + sizeof(int)];
+    char* end = slot + SLOT_SIZE;
+    char* pos = slot + 1;
+    slot[0] = 1;
+    unsigned short field_count = block.fields.size();
+    std::memcpy(pos, &field_count, sizeof(field_count));
+    pos += sizeof(field_count);
+    bool fits = (block.fields.size() <= STRING_MAX);
+    sFields::const_iterator field = block.fields.begin();
+    for (int value_index = 0; fits && (value_index <= field_count); value_index++) {
+      const sValue* value = &block.value;
+      if (value_index > 0) {
+        int key_length = field->first.length();
+        fits = (key_length <= KEY_MAX) && ((pos + 1 + key_length) <= end);
+        if (!fits) {
+          break;
+        }
+        *pos++ = (char)key_length;
+        std::memcpy(pos, field->first.data(), key_length);
+        pos += key_length;
+        value = &field->second;
+        ++field;
+      }
+      int string_length = value->string.length();
+      fits = (string_length <= STRING_MAX) && ((pos + 1 + sizeof(value->number) + sizeof(unsigned short) + string_length) <= end);
+      if (!fits) {
+        break;
+      }
+      unsigned short length = string_length;
+      *pos++ = (char)value->type;
+      std::memcpy(pos, &value->number, sizeof(value->number));
+      pos += sizeof(value->number);
+      std::memcpy(pos, &length, sizeof(length));
+      pos += sizeof(length);
+      std::memcpy(pos, value->string.data(), string_length);
+      pos += string_length;
+    }
+    if (!fits) {
+      journal.resize(start); // Drop the partial record.
+      throw std::string("Block " + this->To_String(address) + " is too big to persist.");
+    }
+  }
+
+  /**
+   * Commits journal records to the file. The journal is written and synced
+   * with a closing marker before any slot changes, so a crash either leaves
+   * the old slots or a complete journal that is replayed on the next open.
+   * @param journal The journal records.
+   * @param count The number of records.
+   * @throws An error if the journal could not be written.
+   */
+  void cPersist::Commit(std::vector<char>& journal, int count) {
+    static const int JOURNAL_MAGIC = 0x4A504C43; // "CLPJ"
+    std::string journal_path = this->path + ".journal";
+    int journal_file = open(journal_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (journal_file == -1) {
+      throw std::string("Could not open journal for " + this->path + ".");
+    }
+    int footer[2] = { JOURNAL_MAGIC, count };
+    bool journal_ok = (write(journal_file, &journal[0], journal.size()) == (ssize_t)journal.size()) &&
+                      (write(journal_file, footer, sizeof(footer)) == (ssize_t)sizeof(footer)) &&
+                      (fsync(journal_file) == 0);
+    close(journal_file);
+    if (!journal_ok || !this->Sync_Directory()) { // The journal's name has to survive a crash too.
+      throw std::string("Could not write journal for " + this->path + ".");
+    }
+    int record_size = sizeof(int) + SLOT_SIZE;
+    std::vector<int> addresses(count);
+    for (int record_index = 0; record_index < count; record_index++) {
+      const char* record = &journal[record_index * record_size];
+      int address = 0;
+      std::memcpy(&address, record, sizeof(int));
+      std::memcpy(this->map + HEADER_SIZE + ((long long)(address - this->offset) * SLOT_SIZE), record + sizeof(int), SLOT_SIZE);
+      this->dirty[address - this->offset] = 0;
+      addresses[record_index] = address;
+    }
+    this->Sync_Slots(addresses);
+    unlink(journal_path.c_str());
+    this->Sync_Directory();
+    this->dirty_list.clear();
+    this->last_commit = count;
+  }
+
+  /**
+   * Writes the memory pages holding a set of slots back to the file. Pages
+   * next to each other are synced together.
+   * @param addresses The addresses of the blocks whose slots changed.
+   */
+  void cPersist::Sync_Slots(std::vector<int>& addresses) {
+    long long page_size = sysconf(_SC_PAGESIZE);
+    std::vector<long long> pages;
+    int address_count = addresses.size();
+    for (int address_index = 0; address_index < address_count; address_index++) {
+      long long first = HEADER_SIZE + ((long long)(addresses[address_index] - this->offset) * SLOT_SIZE);
+      for (long long page = first / page_size; page <= ((first + SLOT_SIZE - 1) / page_size); page++) {
+        pages.push_back(page);
+      }
+    }
+    std::sort(pages.begin(), pages.end());
+    pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+    int page_count = pages.size();
+    int run_start = 0;
+    for (int page_index = 1; page_index <= page_count; page_index++) {
+      if ((page_index == page_count) || (pages[page_index] != (pages[page_index - 1] + 1))) {
+        long long start = pages[run_start] * page_size;
+        long long end = std::min((pages[page_index - 1] + 1) * page_size, this->map_size);
+        msync(this->map + start, end - start, MS_SYNC);
+        run_start = page_index;
+      }
+    }
+  }
+
+  /**
+   * Syncs the directory holding the file, so that files created or removed
+   * in it are on disk.
+   * @return True if the directory was synced.
+   */
+  bool cPersist::Sync_Directory() {
+    std::string::size_type slash = this->path.rfind('/');
+    std::string directory = (slash == std::string::npos) ? "." : ((slash == 0) ? "/" : this->path.substr(0, slash));
+    int folder = open(directory.c_str(), O_RDONLY);
+    if (folder == -1) {
+      return false;
+    }
+    bool synced = (fsync(folder) == 0);
+    close(folder);
+    return synced;
+  }
+
+  /**
+   * Applies a complete journal left by an interrupted commit. A journal
+   * without its closing marker was never committed and is dropped.
+   */
+  void cPersist::Replay_Journal() {
+    static const int JOURNAL_MAGIC = 0x4A504C43;
+    std::string journal_path = this->path + ".journal";
+    std::ifstream file(journal_path.c_str(), std::ios::binary);
+    if (!file) {
+      return;
+    }
+    std::vector<char> journal((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    file.close();
+    int record_size = sizeof(int) + SLOT_SIZE;
+    int footer[2] = { 0, 0 };
+    if (journal.size() >= sizeof(footer)) {
+      std::memcpy(footer, &journal[journal.size() - sizeof(footer)], sizeof(footer));
+    }
+    if ((footer[0] == JOURNAL_MAGIC) && (footer[1] >= 0) && (journal.size() == (((long long)footer[1] * record_size) + sizeof(footer)))) {
+      std::vector<int> addresses;
+      for (int record_index = 0; record_index < footer[1]; record_index++) {
+        const char* record = &journal[record_index * record_size];
+        int address = 0;
+        std::memcpy(&address, record, sizeof(int));
+        if (this->Contains(address)) {
+          std::memcpy(this->map + HEADER_SIZE + ((long long)(address - this->offset) * SLOT_SIZE), record + sizeof(int), SLOT_SIZE);
+          addresses.push_back(address);
+        }
+      }
+      this->Sync_Slots(addresses);
+    }
+    unlink(journal_path.c_str());
+    this->Sync_Directory();
+  }
+
+}
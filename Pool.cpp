@@ -0,0 +1,174 @@
+#include "C_Lesh.hpp"
+
+namespace Codeloader {
+
+  unsigned int sFields::stamps = 0;
+  cPool* cPool::current = NULL;
+  long long cPool::used_total = 0;
+  long long cPool::reserved_total = 0;
+  int cPool::allocations = 0;
+  int cPool::frame_allocations = 0;
+
+  /**
+   * Creates an empty pool. Pages are allocated as blocks are needed.
+   */
+  cPool::cPool() {
+    for (int class_index = 0; class_index < CLASS_COUNT; class_index++) {
+      this->free_lists[class_index] = NULL;
+    }
+    this->page_top = NULL;
+    this->page_end = NULL;
+    this->large_blocks = NULL;
+    this->bytes_used = 0;
+    this->bytes_large = 0;
+  }
+
+  /**
+   * Frees all of the pages and large blocks.
+   */
+  cPool::~cPool() {
+    this->Reset();
+  }
+
+  /**
+   * Allocates a block from the size class that fits it. A free block of
+   * that class is reused first, then the current page is cut. Blocks bigger
+   * than the largest class come from the heap.
+   * @param bytes The size of the block.
+   * @return The block.
+   * @throws An error if there is no memory left.
+   */
+  void* cPool::Allocate(std::size_t bytes) {
+    cPool::allocations++;
+    cPool::frame_allocations++;
+    if (bytes > (CLASS_SIZE * CLASS_COUNT)) {
+      // Large blocks are kept in a list so that a reset can find them.
+      sLarge_Block* large = (sLarge_Block*)std::malloc(sizeof(sLarge_Block) + bytes);
+      if (!large) {
+        throw std::string("Out of memory for fields.");
+      }
+      large->prev = NULL;
+      large->next = this->large_blocks;
+      if (this->large_blocks) {
+        this->large_blocks->prev = large;
+      }
+      this->large_blocks = large;
+      this->bytes_large += bytes;
+      this->bytes_used += bytes;
+      cPool::used_total += bytes;
+      cPool::reserved_total += bytes;
+      return large + 1;
+    }
+    int class_index = (bytes > 0) ? ((bytes - 1) / CLASS_SIZE) : 0;
+    int size = (class_index + 1) * CLASS_SIZE;
+    this->bytes_used += size;
+    cPool::used_total += size;
+    void* block = this->free_lists[class_index];
+    if (block) {
+      this->free_lists[class_index] = *(void**)block;
+      return block;
+    }
+    if ((this->page_end - this->page_top) < size) {
+      // The rest of the old page is too small for this class and is left unused.
+      char* page = new (std::nothrow) char[PAGE_SIZE];
+      if (!page) {
+        throw std::string("Out of memory for fields.");
+      }
+      this->pages.push_back(page);
+      cPool::reserved_total += PAGE_SIZE;
+      this->page_top = page;
+      this->page_end = page + PAGE_SIZE;
+    }
+    block = this->page_top;
+    this->page_top += size;
+    return block;
+  }
+
+  /**
+   * Returns a block to the free list of its size class.
+   * @param block The block.
+   * @param bytes The size the block was allocated with.
+   */
+  void cPool::Free(void* block, std::size_t bytes) {
+    if (bytes > (CLASS_SIZE * CLASS_COUNT)) {
+      sLarge_Block* large = (sLarge_Block*)block - 1;
+      if (large->prev) {
+        large->prev->next = large->next;
+      }
+      else {
+        this->large_blocks = large->next;
+      }
+      if (large->next) {
+        large->next->prev = large->prev;
+      }
+      std::free(large);
+      this->bytes_large -= bytes;
+      this->bytes_used -= bytes;
+      cPool::used_total -= bytes;
+      cPool::reserved_total -= bytes;
+      return;
+    }
+    int class_index = (bytes > 0) ? ((bytes - 1) / CLASS_SIZE) : 0;
+    this->bytes_used -= (class_index + 1) * CLASS_SIZE;
+    cPool::used_total -= (class_index + 1) * CLASS_SIZE;
+    *(void**)block = this->free_lists[class_index];
+    this->free_lists[class_index] = block;
+  }
+
+  /**
+   * Drops everything allocated from the pool at once, whether it was freed
+   * or not. Nothing is destroyed, so this costs one delete per page and
+   * large block. The owner must not touch any of it afterwards.
+   */
+  void cPool::Reset() {
+    cPool::used_total -= this->bytes_used;
+    cPool::reserved_total -= this->Get_Reserved();
+    int page_count = this->pages.size();
+    for (int page_index = 0; page_index < page_count; page_index++) {
+      delete[] this->pages[page_index];
+    }
+    this->pages.clear();
+    while (this->large_blocks) {
+      sLarge_Block* large = this->large_blocks;
+      this->large_blocks = large->next;
+      std::free(large);
+    }
+    for (int class_index = 0; class_index < CLASS_COUNT; class_index++) {
+      this->free_lists[class_index] = NULL;
+    }
+    this->page_top = NULL;
+    this->page_end = NULL;
+    this->bytes_used = 0;
+    this->bytes_large = 0;
+  }
+
+  /**
+   * Gets the bytes held from the heap.
+   * @return The size of all pages and large blocks.
+   */
+  long long cPool::Get_Reserved() {
+    return ((long long)this->pages.size() * PAGE_SIZE) + this->bytes_large;
+  }
+
+  /**
+   * Gets how much of the memory held by all pools is not in use. This counts
+   * free blocks as well as the uncut part of each pool's current page.
+   * @return The percent of reserved bytes that are not allocated.
+   */
+  int cPool::Get_Fragmentation() {
+    long long reserved = cPool::reserved_total;
+    return (reserved > 0) ? (int)(((reserved - cPool::used_total) * 100) / reserved) : 0;
+  }
+
+  /**
+   * Gets the pool for fields that are not in a memory page, such as values
+   * being evaluated. Fields are only touched by the interpreter thread so the
+   * pools have no lock.
+   * @return The shared pool.
+   */
+  cPool& cPool::Get_Shared() {
+    static cPool pool;
+    return pool;
+  }
+
+}
@@ -0,0 +1,226 @@
+#include "C_Lesh.hpp"
+
+namespace Codeloader {
+
+  /**
+   * Creates a profiler. It stays disabled and costs a flag check per timer
+   * until it is enabled.
+   */
+  cProfiler::cProfiler() : cUtility() {
+    this->enabled = false;
+    this->overlay = false;
+    this->mutex = NULL;
+    this->history_index = 0;
+    this->history_count = 0;
+    this->epoch = 0.0;
+    for (int stage_index = 0; stage_index < STAGE_COUNT; stage_index++) {
+      this->frame_totals[stage_index] = 0;
+    }
+  }
+
+  /**
+   * Frees the profiler's mutex.
+   */
+  cProfiler::~cProfiler() {
+    if (this->mutex) {
+      al_destroy_mutex(this->mutex);
+    }
+  }
+
+  /**
+   * Turns the profiler on or off. Turning it on the first time sets the
+   * start of the trace timeline.
+   * @param enabled Whether timers record anything.
+   * @param overlay Whether the graph is drawn onto the screen.
+   * @throws An error if the profiler could not be set up.
+   */
+  void cProfiler::Enable(bool enabled, bool overlay) {
+    if (enabled && !this->mutex) {
+      this->mutex = al_create_mutex();
+      if (!this->mutex) {
+        throw std::string("Could not create profiler mutex.");
+      }
+      this->epoch = al_get_time();
+    }
+    this->overlay = enabled && overlay;
+    this->enabled.store(enabled, std::memory_order_release);
+  }
+
+  /**
+   * Starts a timer.
+   * @return The start time, or 0 if the profiler is disabled.
+   */
+  double cProfiler::Start_Timer() {
+    return this->enabled.load(std::memory_order_relaxed) ? al_get_time() : 0.0;
+  }
+
+  /**
+   * Stops a timer and records the sample. The sample is added to the frame's
+   * totals and to the trace, which stops growing once it is full.
+   * @param stage The stage that was timed.
+   * @param start The time returned by Start_Timer.
+   */
+  void cProfiler::Stop_Timer(int stage, double start) {
+    if ((start > 0.0) && this->enabled.load(std::memory_order_acquire)) {
+      sSample sample;
+      sample.stage = stage;
+      sample.start = start;
+      sample.end = al_get_time();
+      al_lock_mutex(this->mutex);
+      this->frame_totals[stage] += (int)((sample.end - sample.start) * 1000000.0);
+      if (this->samples.size() < SAMPLE_MAX) {
+        this->samples.push_back(sample);
+      }
+      al_unlock_mutex(this->mutex);
+    }
+  }
+
+  /**
+   * Moves the frame's totals into the graph history.
+   */
+  void cProfiler::Next_Frame() {
+    if (this->enabled.load(std::memory_order_acquire)) {
+      al_lock_mutex(this->mutex);
+      for (int stage_index = 0; stage_index < STAGE_COUNT; stage_index++) {
+        this->history[this->history_index][stage_index] = this->frame_totals[stage_index];
+        this->frame_totals[stage_index] = 0;
+      }
+      al_unlock_mutex(this->mutex);
+      this->history_index = (this->history_index + 1) % HISTORY_MAX;
+      if (this->history_count < HISTORY_MAX) {
+        this->history_count++;
+      }
+    }
+  }
+
+  /**
+   * Gets the box the graph covers. It sits in the bottom left corner.
+   * @param width The width of the screen.
+   * @param height The height of the screen.
+   * @return The box of left, top, right, bottom. Right and bottom are exclusive.
+   */
+  sBox cProfiler::Get_Overlay_Bounds(int width, int height) {
+    sBox bounds;
+    bounds.left = 0;
+    bounds.top = (height > GRAPH_H) ? (height - GRAPH_H) : 0;
+    bounds.right = (width < HISTORY_MAX) ? width : HISTORY_MAX;
+    bounds.bottom = height;
+    return bounds;
+  }
+
+  /**
+   * Draws the frame time graph. Each column is a frame with its stages
+   * stacked from the bottom. The line marks a 60 Hz frame.
+   * @param target The bitmap to draw onto.
+   */
+  void cProfiler::Draw_Overlay(ALLEGRO_BITMAP* target) {
+    static const unsigned char colors[STAGE_COUNT][3] = {
+      { 0, 160, 0 }, // Execute
+      { 0, 96, 224 }, // Render images
+      { 224, 160, 0 }, // Output sounds
+      { 160, 0, 224 }, // Output texts
+      { 224, 0, 0 }, // Render screen
+      { 128, 128, 128 },
+      { 128, 128, 128 },
+      { 128, 128, 128 },
+      { 128, 128, 128 },
+      { 0, 192, 192 }, // Upscale
+      { 192, 192, 0 } // Camera
+    };
+    sBox bounds = this->Get_Overlay_Bounds(al_get_bitmap_width(target), al_get_bitmap_height(target));
+    int graph_h = bounds.bottom - bounds.top;
+    al_set_target_bitmap(target);
+    al_draw_filled_rectangle(bounds.left, bounds.top, bounds.right, bounds.bottom, al_map_rgba(0, 0, 0, 192));
+    int column_count = (this->history_count < (bounds.right - bounds.left)) ? this->history_count : (bounds.right - bounds.left);
+    for (int column_index = 0; column_index < column_count; column_index++) {
+      // Newest frame on the right.
+      int frame = (this->history_index - column_count + column_index + HISTORY_MAX) % HISTORY_MAX;
+      int x = bounds.right - column_count + column_index;
+      int y = bounds.bottom;
+      for (int stage_index = 0; stage_index < STAGE_COUNT; stage_index++) {
+        int bar = (this->history[frame][stage_index] * graph_h) / GRAPH_SPAN;
+        if (bar > 0) {
+          int top = ((y - bar) > bounds.top) ? (y - bar) : bounds.top;
+          al_draw_filled_rectangle(x, top, x + 1, y, al_map_rgb(colors[stage_index][0], colors[stage_index][1], colors[stage_index][2]));
+          y = top;
+        }
+      }
+    }
+    int target_y = bounds.bottom - (graph_h / 2);
+    al_draw_line(bounds.left, target_y + 0.5, bounds.right, target_y + 0.5, al_map_rgb(255, 255, 255), 1);
+  }
+
+  /**
+   * Exports the recorded samples as a Chrome trace event file and clears
+   * them. The file can be opened in chrome://tracing or Perfetto.
+   * @param name The name of the file.
+   * @throws An error if the file could not be written.
+   */
+  void cProfiler::Export_Trace(std::string name) {
+    std::vector<sSample> samples;
+    if (this->mutex) {
+      al_lock_mutex(this->mutex);
+      samples.swap(this->samples);
+      al_unlock_mutex(this->mutex);
+    }
+    std::ofstream file(std::string(this->root + "/" + name).c_str());
+    if (!file) {
+      throw std::string("Could not write trace " + name + ".");
+    }
+    file << "{\"traceEvents\":[\n";
+    file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"Script\"}},\n";
+    file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"Renderer\"}}";
+    int sample_count = samples.size();
+    for (int sample_index = 0; sample_index < sample_count; sample_index++) {
+      sSample& sample = samples[sample_index];
+      bool render = (sample.stage == STAGE_RENDER_IMAGES) || (sample.stage == STAGE_OUTPUT_TEXTS) || (sample.stage == STAGE_RENDER_SCREEN) || (sample.stage == STAGE_UPSCALE);
+      char buffer[256];
+      std::sprintf(buffer, ",\n{\"name\":\"%s\",\"cat\":\"frame\",\"ph\":\"X\",\"pid\":1,\"tid\":%i,\"ts\":%.3f,\"dur\":%.3f}",
+                   this->Get_Stage_Name(sample.stage).c_str(), render ? 2 : 1,
+                   (sample.start - this->epoch) * 1000000.0, (sample.end - sample.start) * 1000000.0);
+      file << buffer;
+    }
+    file << "\n]}\n";
+  }
+
+  /**
+   * Gets the display name of a stage.
+   * @param stage The stage.
+   * @return The name of the stage.
+   */
+  std::string cProfiler::Get_Stage_Name(int stage) {
+    static const char* names[STAGE_COUNT] = {
+      "Execute",
+      "Render_Images",
+      "Output_Sounds",
+      "Output_Texts",
+      "Render_Screen",
+      "Compile",
+      "Load",
+      "Save",
+      "Upload",
+      "Upscale",
+      "Camera"
+    };
+    return ((stage >= 0) && (stage < STAGE_COUNT)) ? names[stage] : "Unknown";
+  }
+
+  /**
+   * Starts timing a stage until the end of the scope.
+   * @param profiler The profiler to record to.
+   * @param stage The stage being timed.
+   */
+  cScope_Timer::cScope_Timer(cProfiler* profiler, int stage) {
+    this->profiler = profiler;
+    this->stage = stage;
+    this->start = profiler->Start_Timer();
+  }
+
+  /**
+   * Records the stage's sample.
+   */
+  cScope_Timer::~cScope_Timer() {
+    this->profiler->Stop_Timer(this->stage, this->start);
+  }
+
+}
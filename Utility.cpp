@@ -132,9 +132,18 @@ namespace Codeloader {
    * @return The string version of the number.
    */
   std::string cUtility::To_String(int number) {
-    char buffer[256];
-    std::sprintf(buffer, "%i", number);
-    return std::string(buffer);
+    // Digits are written from the back to avoid going through sprintf.
+    char buffer[16];
+    int pos = sizeof(buffer);
+    unsigned int value = (number < 0) ? (0u - (unsigned int)number) : (unsigned int)number;
+    do {
+      buffer[--pos] = (char)('0' + (value % 10));
+      value /= 10;
+    } while (value > 0);
+    if (number < 0) {
+      buffer[--pos] = '-';
+    }
+    return std::string(buffer + pos, sizeof(buffer) - pos);
   }
 
   /**
@@ -176,19 +185,14 @@ namespace Codeloader {
    * @param field The object's field.
    * @param number The number to set.
    */
-  void cUtility::Set_Field_Number(std::map<std::string, sValue>& object, std::string field, int number) {
-    if (object.find(field) != object.end()) {
-      object[field].number = number;
-      object[field].string = "";
-      object[field].type = TYPE_NUMBER;
-    }
-    else {
-      sValue valuea;
-      value.number = number;
-      value.string = "";
-      value.type = TYPE_NUMBER;
-      object[field] = value;
+  void cUtility::Set_Field_Number(sFields& object, const std::string& field, int number) {
+    sFields::iterator entry = object.lower_bound(field);
+    if ((entry == object.end()) || (entry->first != field)) {
+      entry = object.insert(entry, std::make_pair(field, sValue()));
     }
+    entry->second.number = number;
+    entry->second.string.clear();
+    entry->second.type = TYPE_NUMBER;
   }
 
   /**
@@ -197,7 +201,7 @@ namespace Codeloader {
    * @param field The object's field.
    * @param string The string value to set.
    */
-  void cUtility::Set_Field_String(std::map<std::string, sValue>& object, std::string field, std::string string) {
+  void cUtility::Set_Field_String(sFields& object, std::string field, std::string string) {
     if (object.find(field) != object.end()) {
       object[field].string = string;
       object[field].number = 0;
@@ -218,7 +222,7 @@ namespace Codeloader {
    * @param field The field to test.
    * @return True if the field exists, false otherwise.
    */
-  bool cUtility::Does_Field_Exist(std::map<std::string, sValue>& object, std::string field) {
+  bool cUtility::Does_Field_Exist(sFields& object, std::string field) {
     return (object.find(field) != object.end());
   }
   
@@ -238,21 +242,51 @@ namespace Codeloader {
    * @param object The object from the memory to write.
    * @return The serialized string. The string consists of key=value pairs separated by commas.
    */
-  std::string cUtility::Write_Object(std::map<std::string, sValue>& object) {
+  std::string cUtility::Write_Object(const sFields& object) {
     std::vector<std::string> pairs;
-    for (std::map<std::string, sValue>::iterator i = object.begin(); i != object.end(); ++i) {
+    for (sFields::const_iterator i = object.begin(); i != object.end(); ++i) {
       std::string key = i->first;
       sValue value = i->second;
       if (value.type == TYPE_NUMBER) {
         pairs.push_back(key + "=" + this->To_String(value.number));
       }
       else if (value.type == TYPE_STRING) {
-        pairs.push_back(key + "=" + value.string);
+        pairs.push_back(key + "=" + (std::string)value.string);
       }
     }
     return boost::algorithm::join(pairs, ",");
   }
   
+  /**
+   * Gets the bounding box that an image covers on the screen. This follows the
+   * transforms used by the renderer. Rotated images rotate around their center
+   * so the box is the one of the circle that they sweep.
+   * @param image The image object.
+   * @return The box of left, top, right, bottom. Right and bottom are exclusive.
+   */
+  sBox cUtility::Get_Image_Bounds(sImage& image) {
+    sBox bounds;
+    int scale = (image.scale > 1) ? image.scale : 1;
+    if (image.angle > 0) {
+      int center_x = image.width / 2;
+      int center_y = image.height / 2;
+      int reach_x = ((image.width - center_x) > center_x) ? (image.width - center_x) : center_x;
+      int reach_y = ((image.height - center_y) > center_y) ? (image.height - center_y) : center_y;
+      int radius = (int)std::ceil(std::sqrt((double)(reach_x * reach_x + reach_y * reach_y)) * scale) + 1;
+      bounds.left = image.x - radius;
+      bounds.top = image.y - radius;
+      bounds.right = image.x + radius;
+      bounds.bottom = image.y + radius;
+    }
+    else {
+      bounds.left = image.x;
+      bounds.top = image.y;
+      bounds.right = image.x + (image.width * scale);
+      bounds.bottom = image.y + (image.height * scale);
+    }
+    return bounds;
+  }
+
   /**
    * Sets the root for the whole project.
    * @param root The project folder name.